@@ -0,0 +1,12 @@
+; Ackermann function: very deep recursion
+(define (ack m n)
+  (cond ((= m 0) (+ n 1))
+        ((= n 0) (ack (+ m -1) 1))
+        (else (ack (+ m -1) (ack m (+ n -1))))))
+
+(define (repeat n)
+  (if (= n 1)
+      (ack 2 12)
+      (begin (ack 2 12) (repeat (+ n -1)))))
+
+(print (repeat 20))
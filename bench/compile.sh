@@ -0,0 +1,59 @@
+#!/bin/sh
+# Compiles each benchmark in bench/ to C with the given lithp binary's
+# --compile, builds it against an optimized runtime and times it against the
+# same binary running the benchmark with and without the JIT, printing one JSON
+# object per benchmark:
+#   {"bench": ..., "runs": ..., "interpreted_ms": ..., "jit_ms": ..., "compiled_ms": ..., "speedup": ...}
+# speedup is interpreted_ms / compiled_ms. Timings are wall clock medians. A
+# benchmark whose compiled output differs from the interpreter's isn't timed.
+# Must be run from the repository root.
+
+LITHP=${1:-./lithp}
+RUNS=${BENCH_RUNS:-5}
+CC=${CC:-gcc}
+BENCH_DIR=$(dirname "$0")
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+# median wall clock microseconds of RUNS runs of the command, or nothing if it
+# fails
+median_us () {
+    : > "$TMP_DIR/times"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$@" > /dev/null 2>&1 || return
+        end=$(date +%s%N)
+        echo $(( (end - start) / 1000 )) >> "$TMP_DIR/times"
+        i=$((i + 1))
+    done
+    sort -n "$TMP_DIR/times" | awk '{ t[NR] = $1 } END { print (NR % 2) ? t[(NR + 1) / 2] : int((t[NR / 2] + t[NR / 2 + 1]) / 2) }'
+}
+
+"$CC" -O2 -c -o "$TMP_DIR/lithp.o" lithp.c -pthread || exit 1
+
+for bench in "$BENCH_DIR"/*.scm; do
+    name=$(basename "$bench" .scm)
+    if ! "$LITHP" --compile "$bench" > "$TMP_DIR/$name.c" \
+        || ! "$CC" -O2 -I. -o "$TMP_DIR/$name" "$TMP_DIR/$name.c" "$TMP_DIR/lithp.o" -pthread 2> "$TMP_DIR/cc"; then
+        echo "{\"bench\": \"$name\", \"error\": \"couldn't compile\"}"
+        continue
+    fi
+    "$LITHP" --no-jit "$bench" > "$TMP_DIR/$name.expected" 2>&1
+    "$TMP_DIR/$name" > "$TMP_DIR/$name.actual" 2>&1
+    if ! cmp -s "$TMP_DIR/$name.expected" "$TMP_DIR/$name.actual"; then
+        echo "{\"bench\": \"$name\", \"error\": \"compiled output differs\"}"
+        continue
+    fi
+    interpreted=$(median_us "$LITHP" --no-jit "$bench")
+    jit=$(median_us "$LITHP" "$bench")
+    compiled=$(median_us "$TMP_DIR/$name")
+    if [ -z "$interpreted" ] || [ -z "$jit" ] || [ -z "$compiled" ]; then
+        echo "{\"bench\": \"$name\", \"error\": \"failed to run\"}"
+        continue
+    fi
+    printf '{"bench": "%s", "runs": %d, "interpreted_ms": %d.%03d, "jit_ms": %d.%03d, "compiled_ms": %d.%03d, "speedup": %s}\n' \
+        "$name" "$RUNS" $((interpreted / 1000)) $((interpreted % 1000)) $((jit / 1000)) $((jit % 1000)) \
+        $((compiled / 1000)) $((compiled % 1000)) \
+        $(awk "BEGIN { printf \"%.2f\", $interpreted / ($compiled > 0 ? $compiled : 1) }")
+done
@@ -0,0 +1,25 @@
+; symbolic differentiation: list construction and symbol dispatch
+(define (map-list f l)
+  (if (null? l)
+      '()
+      (cons (f (car l)) (map-list f (cdr l)))))
+
+(define (deriv a)
+  (cond ((not-pair? a)
+         (if (eq? a 'x) 1 0))
+        ((eq? (car a) '+)
+         (cons '+ (map-list deriv (cdr a))))
+        ((eq? (car a) '*)
+         (list '*
+               a
+               (cons '+ (map-list (lambda (a) (list '/ (deriv a) a)) (cdr a)))))
+        (else 'error)))
+
+(define (not-pair? a) (if (pair? a) #f #t))
+
+(define (run n result)
+  (if (= n 0)
+      result
+      (run (+ n -1) (deriv '(+ (* 3 x x) (* a x x) (* b x) 5)))))
+
+(print (run 2000 '()))
@@ -0,0 +1,7 @@
+; naive doubly recursive fibonacci: call overhead and small-integer arithmetic
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (+ n -1)) (fib (+ n -2)))))
+
+(print (fib 22))
@@ -0,0 +1,21 @@
+; count the solutions to the n-queens problem by backtracking over lists
+(define (ok? row dist placed)
+  (cond ((null? placed) #t)
+        ((= (car placed) (+ row dist)) #f)
+        ((= (car placed) (+ row (* -1 dist))) #f)
+        ((= (car placed) row) #f)
+        (else (ok? row (+ dist 1) (cdr placed)))))
+
+(define (try-rows row n placed)
+  (cond ((> row n) 0)
+        ((ok? row 1 placed)
+         (+ (queens n (cons row placed))
+            (try-rows (+ row 1) n placed)))
+        (else (try-rows (+ row 1) n placed))))
+
+(define (queens n placed)
+  (if (= (length placed) n)
+      1
+      (try-rows 1 n placed)))
+
+(print (queens 7 '()))
@@ -0,0 +1,7 @@
+; independent fibonacci calls spread over the worker pool; compare against a run with LITHP_WORKERS=1 for the speedup
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (+ n -1)) (fib (+ n -2)))))
+
+(print (pmap fib (list 19 19 19 19 19 19 19 19 19 19 19 19 19 19 19 19)))
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs each benchmark in bench/ several times with the given lithp binary and
+# prints one JSON object per benchmark:
+#   {"bench": ..., "runs": ..., "median_ms": ..., "max_rss_kb": ..., "cells": ..., "bytes": ...}
+# Timings are wall clock; max_rss_kb, cells and bytes come from lithp --stats.
+# Must be run from the repository root so lithp can find prelude.scm.
+
+LITHP=${1:-./lithp}
+RUNS=${BENCH_RUNS:-5}
+BENCH_DIR=$(dirname "$0")
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+# the parse benchmark is a large quoted literal, generated rather than checked in
+awk 'BEGIN {
+    print "(define data (quote (";
+    for (i = 0; i < 20000; i++)
+        printf "(record %d \"name-%d\" sym%d (%d %d) #t)\n", i, i, i % 64, i * 7, i % 13;
+    print ")))";
+    print "(print (length data))";
+}' > "$TMP_DIR/parse.scm"
+
+for bench in "$BENCH_DIR"/*.scm "$TMP_DIR/parse.scm"; do
+    name=$(basename "$bench" .scm)
+    : > "$TMP_DIR/times"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        if ! "$LITHP" --stats "$bench" > /dev/null 2> "$TMP_DIR/stats"; then
+            echo "{\"bench\": \"$name\", \"error\": \"exited with status $?\"}"
+            continue 2
+        fi
+        end=$(date +%s%N)
+        echo $(( (end - start) / 1000 )) >> "$TMP_DIR/times"
+        i=$((i + 1))
+    done
+
+    median_us=$(sort -n "$TMP_DIR/times" | awk '{ t[NR] = $1 } END { print (NR % 2) ? t[(NR + 1) / 2] : int((t[NR / 2] + t[NR / 2 + 1]) / 2) }')
+    stats=$(grep '^stats:' "$TMP_DIR/stats" | tail -n 1)
+    rss=$(echo "$stats" | sed -n 's/.*max_rss_kb=\([0-9]*\).*/\1/p')
+    cells=$(echo "$stats" | sed -n 's/.*cells=\([0-9]*\).*/\1/p')
+    bytes=$(echo "$stats" | sed -n 's/.*bytes=\([0-9]*\).*/\1/p')
+    printf '{"bench": "%s", "runs": %d, "median_ms": %d.%03d, "max_rss_kb": %s, "cells": %s, "bytes": %s}\n' \
+        "$name" "$RUNS" $((median_us / 1000)) $((median_us % 1000)) "${rss:-null}" "${cells:-null}" "${bytes:-null}"
+done
@@ -0,0 +1,17 @@
+; sieve of Eratosthenes over a list, repeatedly filtering out multiples
+(define (range from to)
+  (if (> from to)
+      '()
+      (cons from (range (+ from 1) to))))
+
+(define (remove-multiples p l)
+  (cond ((null? l) '())
+        ((= (remainder (car l) p) 0) (remove-multiples p (cdr l)))
+        (else (cons (car l) (remove-multiples p (cdr l))))))
+
+(define (sieve l)
+  (if (null? l)
+      '()
+      (cons (car l) (sieve (remove-multiples (car l) (cdr l))))))
+
+(print (length (sieve (range 2 3000))))
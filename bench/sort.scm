@@ -0,0 +1,30 @@
+; merge sort of a list of pseudo-random integers
+(define (random-list n seed)
+  (if (= n 0)
+      '()
+      (cons seed (random-list (+ n -1) (remainder (+ (* seed 1103515245) 12345) 2147483648)))))
+
+(define (merge a b)
+  (cond ((null? a) b)
+        ((null? b) a)
+        ((< (car a) (car b)) (cons (car a) (merge (cdr a) b)))
+        (else (cons (car b) (merge a (cdr b))))))
+
+(define (split l a b)
+  (if (null? l)
+      (cons a b)
+      (split (cdr l) (cons (car l) b) a)))
+
+(define (merge-sort l)
+  (if (or (null? l) (null? (cdr l)))
+      l
+      (let ((halves (split l '() '())))
+        (merge (merge-sort (car halves)) (merge-sort (cdr halves))))))
+
+(define (sorted? l)
+  (cond ((null? l) #t)
+        ((null? (cdr l)) #t)
+        ((< (cadr l) (car l)) #f)
+        (else (sorted? (cdr l)))))
+
+(print (sorted? (merge-sort (random-list 3000 42))))
@@ -0,0 +1,18 @@
+; build a large text payload by appending to a growable string
+(define out (make-string 0))
+
+(define (emit-line i)
+  (string-append! out "line " (number->string i) ": " (number->string (* i i) 16) #\newline))
+
+; loop in blocks so the recursion (which isn't a proper tail call) stays shallow
+(define (emit-block i n)
+  (if (< i n)
+      (begin (emit-line i) (emit-block (+ i 1) n))))
+
+(define (build block n-blocks)
+  (if (< block n-blocks)
+      (begin (emit-block (* block 200) (* (+ block 1) 200))
+             (build (+ block 1) n-blocks))
+      out))
+
+(print (string-length (build 0 100)))
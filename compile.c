@@ -0,0 +1,834 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lithp.h"
+
+// COMPILER
+// lithp --compile translates the prelude and a program into a C file that
+// links against the lithp runtime. Each lambda becomes a C function taking its
+// arguments in argv and its free variables in its CompiledProcedure; variables
+// that are assigned are kept in boxes (a pair holding the value in its car) so
+// closures see each other's assignments. Globals, quoted data and symbols are
+// C statics set up once at startup. Calls in tail position go through
+// compiled_tail_call, so loops written as tail calls run in constant C stack.
+
+// A text buffer that's filled with fprintf and written out at the end
+typedef struct Output {
+    FILE *file;
+    char *chars;
+    size_t length;
+} Output;
+
+typedef struct Variable {
+    SExp *symbol;
+    int id;
+    int boxed;
+    // set once anything refers to it
+    int used;
+    struct Variable *next;
+} Variable;
+
+// A lambda being compiled. scope holds its innermost binding first; free holds
+// the variables of enclosing functions it refers to, in the order they're
+// stored in its CompiledProcedure.
+typedef struct Function {
+    struct Function *parent;
+    Variable *scope;
+    Variable **free;
+    int n_free;
+} Function;
+
+typedef struct Compiler {
+    Interp *interp;
+    FILE *out;
+    Output prototypes;
+    Output functions;
+    Output literals;
+    SExp **symbols;
+    char *symbol_has_cell;
+    // whether the symbol names a primitive some folded expression assumed
+    char *symbol_folded;
+    int n_symbols;
+    int n_lambdas;
+    int n_variables;
+    int n_temps;
+    int n_literals;
+    // the open-coded primitives used, by OpenCoded tag
+    SExp *primitives[OPEN_CODED_PAIR + 1];
+    // the head of the re-raise at the end of a guard's clauses
+    SExp *reraise;
+} Compiler;
+
+static void compile_exp (Compiler *c, Function *f, SExp *exp, int tail);
+
+static void
+output_open (Output *output) {
+    output->file = open_memstream(&output->chars, &output->length);
+}
+
+static void
+output_close (Output *output) {
+    fclose(output->file);
+}
+
+// The index of symbol's sym_ static, adding one the first time
+static int
+symbol_index (Compiler *c, SExp *symbol) {
+    int i;
+    for (i = 0; i < c->n_symbols; i++) {
+        if (c->symbols[i] == symbol)
+            return i;
+    }
+    c->symbols = realloc(c->symbols, (c->n_symbols + 1) * sizeof(SExp*));
+    c->symbol_has_cell = realloc(c->symbol_has_cell, c->n_symbols + 1);
+    c->symbol_folded = realloc(c->symbol_folded, c->n_symbols + 1);
+    c->symbols[c->n_symbols] = symbol;
+    c->symbol_has_cell[c->n_symbols] = 0;
+    c->symbol_folded[c->n_symbols] = 0;
+    return c->n_symbols++;
+}
+
+static void
+write_c_string (FILE *out, const char *chars, size_t length) {
+    size_t i;
+    fputc('"', out);
+    for (i = 0; i < length; i++) {
+        unsigned char ch = chars[i];
+        if (ch == '"' || ch == '\\')
+            fprintf(out, "\\%c", ch);
+        else if (ch >= ' ' && ch < 127 && ch != '?')
+            fputc(ch, out);
+        else
+            fprintf(out, "\\%03o", ch);
+    }
+    fputc('"', out);
+}
+
+// Writes a C expression for an atom or the empty list
+static void
+write_atom (Compiler *c, FILE *out, SExp *atom) {
+    if (is_nil(atom)) {
+        fprintf(out, "&NIL");
+    } else if (is_symbol(atom)) {
+        fprintf(out, "sym_%d", symbol_index(c, atom));
+    } else if (is_boolean(atom)) {
+        fprintf(out, is_true(atom) ? "&TRUE" : "&FALSE");
+    } else if (is_number(atom)) {
+        fprintf(out, "new_number(interp, %ldL)", atom->atom->number_value);
+    } else if (is_character(atom)) {
+        fprintf(out, "new_character(interp, %d)", atom->atom->character_value);
+    } else if (is_string(atom)) {
+        fprintf(out, "new_string(interp, ");
+        write_c_string(out, atom->atom->string_value.chars, atom->atom->string_value.length);
+        fprintf(out, ", %zu)", atom->atom->string_value.length);
+    } else {
+        raise_error(c->interp, "can't compile a literal", atom);
+    }
+}
+
+// Writes statements building datum into d<depth>. Lists are built from their
+// last element back, so only nesting recurses.
+static void
+write_datum (Compiler *c, SExp *datum, int depth) {
+    FILE *out = c->literals.file;
+    SExp **elements = NULL;
+    int n_elements = 0;
+
+    for (; is_pair(datum); datum = cdr(datum)) {
+        elements = realloc(elements, (n_elements + 1) * sizeof(SExp*));
+        elements[n_elements++] = car(datum);
+    }
+    fprintf(out, "    SExp *d%d = ", depth);
+    write_atom(c, out, datum);
+    fprintf(out, ";\n");
+    while (n_elements-- > 0) {
+        if (is_pair(elements[n_elements])) {
+            fprintf(out, "    {\n");
+            write_datum(c, elements[n_elements], depth + 1);
+            fprintf(out, "    d%d = cons(interp, d%d, d%d);\n    }\n", depth, depth + 1, depth);
+        } else {
+            fprintf(out, "    d%d = cons(interp, ", depth);
+            write_atom(c, out, elements[n_elements]);
+            fprintf(out, ", d%d);\n", depth);
+        }
+    }
+    free(elements);
+}
+
+// Symbols, booleans and the empty list are written in place; anything that
+// allocates is built once into a lit_ static
+static void
+compile_literal (Compiler *c, SExp *datum) {
+    int id;
+
+    if (is_nil(datum) || is_symbol(datum) || is_boolean(datum)) {
+        write_atom(c, c->out, datum);
+        return;
+    }
+    id = c->n_literals++;
+    if (is_pair(datum)) {
+        fprintf(c->literals.file, "    {\n");
+        write_datum(c, datum, 0);
+        fprintf(c->literals.file, "    lit_%d = d0;\n    }\n", id);
+    } else {
+        fprintf(c->literals.file, "    lit_%d = ", id);
+        write_atom(c, c->literals.file, datum);
+        fprintf(c->literals.file, ";\n");
+    }
+    fprintf(c->out, "lit_%d", id);
+}
+
+static Variable *
+new_variable (Compiler *c, Function *f, SExp *symbol, int boxed) {
+    Variable *var = malloc(sizeof(Variable));
+    var->symbol = symbol;
+    var->id = c->n_variables++;
+    var->boxed = boxed;
+    var->used = 0;
+    var->next = f->scope;
+    f->scope = var;
+    return var;
+}
+
+static Variable *
+find_local (Function *f, SExp *symbol) {
+    Variable *var;
+    for (var = f->scope; var != NULL; var = var->next) {
+        if (var->symbol == symbol)
+            return var;
+    }
+    return NULL;
+}
+
+// Finds the variable symbol refers to in f, making it a free variable of f and
+// every function between f and the one binding it. Returns NULL for a global.
+// *index is where it is in f's free variables, or -1 if f binds it.
+static Variable *
+resolve (Function *f, SExp *symbol, int *index) {
+    Variable *var = find_local(f, symbol);
+    int i;
+
+    *index = -1;
+    if (var != NULL)
+        var->used = 1;
+    if (var != NULL || f->parent == NULL)
+        return var;
+    var = resolve(f->parent, symbol, &i);
+    if (var == NULL)
+        return NULL;
+    for (i = 0; i < f->n_free; i++) {
+        if (f->free[i] == var) {
+            *index = i;
+            return var;
+        }
+    }
+    f->free = realloc(f->free, (f->n_free + 1) * sizeof(Variable*));
+    f->free[f->n_free] = var;
+    *index = f->n_free++;
+    return var;
+}
+
+// Writes where var's value, or its box, is kept in f
+static void
+write_location (Compiler *c, Function *f, Variable *var, int index) {
+    if (index < 0)
+        fprintf(c->out, "v%d", var->id);
+    else
+        fprintf(c->out, "fv[%d]", index);
+}
+
+// Where f keeps var, which it binds or has as a free variable
+static int
+captured_index (Function *f, Variable *var) {
+    Variable *local;
+    int i;
+    for (local = f->scope; local != NULL; local = local->next) {
+        if (local == var)
+            return -1;
+    }
+    for (i = 0; i < f->n_free; i++) {
+        if (f->free[i] == var)
+            break;
+    }
+    return i;
+}
+
+static void
+compile_variable (Compiler *c, Function *f, SExp *symbol) {
+    int index;
+    Variable *var = resolve(f, symbol, &index);
+    int sym;
+
+    if (var == NULL) {
+        sym = symbol_index(c, symbol);
+        c->symbol_has_cell[sym] = 1;
+        fprintf(c->out, "compiled_global(interp, &cell_%d, sym_%d)", sym, sym);
+        return;
+    }
+    write_location(c, f, var, index);
+    if (var->boxed)
+        fprintf(c->out, "->pair->car");
+}
+
+static void
+compile_assignment (Compiler *c, Function *f, SExp *exp) {
+    SExp *symbol = cadr(exp);
+    int index;
+    Variable *var = resolve(f, symbol, &index);
+
+    if (var == NULL) {
+        fprintf(c->out, "({ set_variable(interp, sym_%d, ", symbol_index(c, symbol));
+        compile_exp(c, f, caddr(exp), 0);
+        fprintf(c->out, ", interp->global_env); sym_%d; })", symbol_index(c, lithp_symbol(c->interp, "ok")));
+        return;
+    }
+    // assigned variables are always boxed
+    fprintf(c->out, "({ ");
+    write_location(c, f, var, index);
+    fprintf(c->out, "->pair->car = ");
+    compile_exp(c, f, caddr(exp), 0);
+    fprintf(c->out, "; sym_%d; })", symbol_index(c, lithp_symbol(c->interp, "ok")));
+}
+
+// A body: internal definitions are boxed variables bound for the whole body,
+// so they can refer to each other
+static void
+compile_body (Compiler *c, Function *f, SExp *body, int tail) {
+    Variable *saved_scope = f->scope;
+    Variable *var;
+    SExp *exp;
+
+    if (is_nil(body)) {
+        fprintf(c->out, "&NIL");
+        return;
+    }
+    fprintf(c->out, "({ ");
+    for (exp = body; is_pair(exp); exp = cdr(exp)) {
+        if (is_definition(car(exp))) {
+            var = new_variable(c, f, definition_variable(car(exp)), 1);
+            fprintf(c->out, "SExp *v%d = cons(interp, &FALSE, &NIL); ", var->id);
+        }
+    }
+    for (; is_pair(body); body = cdr(body)) {
+        exp = car(body);
+        if (is_definition(exp)) {
+            var = find_local(f, definition_variable(exp));
+            fprintf(c->out, "v%d->pair->car = compiled_name(", var->id);
+            compile_exp(c, f, definition_value(c->interp, exp), 0);
+            fprintf(c->out, ", sym_%d); ", symbol_index(c, var->symbol));
+            if (is_nil(cdr(body)))
+                fprintf(c->out, "sym_%d; ", symbol_index(c, lithp_symbol(c->interp, "ok")));
+        } else if (is_nil(cdr(body))) {
+            compile_exp(c, f, exp, tail);
+            fprintf(c->out, "; ");
+        } else {
+            fprintf(c->out, "(void)(");
+            compile_exp(c, f, exp, 0);
+            fprintf(c->out, "); ");
+        }
+    }
+    fprintf(c->out, "})");
+    f->scope = saved_scope;
+}
+
+// Writes the C function for a lambda, and where the lambda was an expression
+// that makes a procedure closing over its free variables
+static void
+compile_lambda (Compiler *c, Function *parent, SExp *params, SExp *body) {
+    Function f = { parent, NULL, NULL, 0 };
+    FILE *saved_out = c->out;
+    int id = c->n_lambdas++;
+    int n_params = 0;
+    Variable **vars = NULL;
+    Output out;
+    SExp *param;
+    int i;
+
+    for (param = params; is_pair(param); param = cdr(param)) {
+        if (!is_symbol(car(param)))
+            raise_error(c->interp, "lambda parameters must be symbols", params);
+        vars = realloc(vars, (n_params + 1) * sizeof(Variable*));
+        vars[n_params++] = new_variable(c, &f, car(param), is_assigned_in(body, car(param)));
+    }
+    if (!is_nil(param))
+        raise_error(c->interp, "can't compile rest parameters", params);
+    output_open(&out);
+    c->out = out.file;
+    fprintf(c->out, "    return ");
+    compile_body(c, &f, body, 1);
+    fprintf(c->out, ";\n}\n\n");
+    output_close(&out);
+    c->out = saved_out;
+
+    fprintf(c->prototypes.file, "static SExp *lambda_%d (Interp *interp, SExp *self, int argc, SExp **argv);\n", id);
+    fprintf(c->functions.file, "static SExp *\nlambda_%d (Interp *interp, SExp *self, int argc, SExp **argv) {\n", id);
+    if (f.n_free > 0)
+        fprintf(c->functions.file, "    SExp **fv = self->compiled->free;\n");
+    fprintf(c->functions.file, "    if (argc != %d)\n        return compiled_arity_error(interp, self, argc);\n", n_params);
+    // parameters the body never refers to aren't bound
+    for (i = 0; i < n_params; i++) {
+        if (!vars[i]->used)
+            continue;
+        if (vars[i]->boxed)
+            fprintf(c->functions.file, "    SExp *v%d = cons(interp, argv[%d], &NIL);\n", vars[i]->id, i);
+        else
+            fprintf(c->functions.file, "    SExp *v%d = argv[%d];\n", vars[i]->id, i);
+    }
+    fwrite(out.chars, 1, out.length, c->functions.file);
+    free(out.chars);
+    free(vars);
+
+    fprintf(c->out, "new_compiled_procedure(interp, lambda_%d, %d, ", id, f.n_free);
+    if (f.n_free == 0) {
+        fprintf(c->out, "NULL)");
+    } else {
+        fprintf(c->out, "(SExp *[]){ ");
+        for (i = 0; i < f.n_free; i++) {
+            write_location(c, parent, f.free[i], captured_index(parent, f.free[i]));
+            fprintf(c->out, ", ");
+        }
+        fprintf(c->out, "})");
+    }
+    free(f.free);
+}
+
+static void
+compile_let (Compiler *c, Function *f, SExp *exp, int tail) {
+    Variable *saved_scope = f->scope;
+    FILE *saved_out = c->out;
+    SExp *binding;
+    int first_temp = c->n_temps;
+    int n_bindings = 0;
+    Variable **vars;
+    Output body;
+    int i;
+
+    fprintf(c->out, "({ ");
+    for (binding = cadr(exp); is_pair(binding); binding = cdr(binding)) {
+        if (!is_pair(car(binding)) || !is_symbol(caar(binding)) || !is_pair(cdar(binding)))
+            raise_error(c->interp, "malformed let binding", car(binding));
+        n_bindings++;
+    }
+    c->n_temps += n_bindings;
+    // the values are evaluated before any of the variables are bound
+    for (i = 0, binding = cadr(exp); i < n_bindings; i++, binding = cdr(binding)) {
+        fprintf(c->out, "SExp *t%d = ", first_temp + i);
+        compile_exp(c, f, cadar(binding), 0);
+        fprintf(c->out, "; ");
+    }
+
+    // the body goes first to find out which variables it uses
+    vars = malloc(n_bindings * sizeof(Variable*));
+    for (i = 0, binding = cadr(exp); i < n_bindings; i++, binding = cdr(binding))
+        vars[i] = new_variable(c, f, caar(binding), is_assigned_in(cddr(exp), caar(binding)));
+    output_open(&body);
+    c->out = body.file;
+    compile_body(c, f, cddr(exp), tail);
+    output_close(&body);
+    c->out = saved_out;
+
+    for (i = 0; i < n_bindings; i++) {
+        if (!vars[i]->used)
+            fprintf(c->out, "(void)t%d; ", first_temp + i);
+        else if (vars[i]->boxed)
+            fprintf(c->out, "SExp *v%d = cons(interp, t%d, &NIL); ", vars[i]->id, first_temp + i);
+        else
+            fprintf(c->out, "SExp *v%d = t%d; ", vars[i]->id, first_temp + i);
+    }
+    fwrite(body.chars, 1, body.length, c->out);
+    fprintf(c->out, "; })");
+    free(body.chars);
+    free(vars);
+    f->scope = saved_scope;
+}
+
+// (and ...) and (or ...) evaluate each operand once, keeping it in a temporary
+// to return it
+static void
+compile_bool (Compiler *c, Function *f, SExp *operands, int is_and, int tail) {
+    int temp;
+
+    if (is_nil(operands)) {
+        fprintf(c->out, is_and ? "&TRUE" : "&FALSE");
+        return;
+    }
+    if (is_nil(cdr(operands))) {
+        compile_exp(c, f, car(operands), tail);
+        return;
+    }
+    temp = c->n_temps++;
+    fprintf(c->out, "({ SExp *t%d = ", temp);
+    compile_exp(c, f, car(operands), 0);
+    fprintf(c->out, "; %s(t%d) ? t%d : ", is_and ? "is_false" : "is_true", temp, temp);
+    compile_bool(c, f, cdr(operands), is_and, tail);
+    fprintf(c->out, "; })");
+}
+
+// The clauses of (guard (var clause ...) body ...) as one expression of var,
+// ending by raising var again
+static SExp *
+guard_clauses_to_exp (Compiler *c, SExp *var, SExp *clauses) {
+    Interp *interp = c->interp;
+    SExp *clause, *rest, *value, *result;
+
+    if (is_nil(clauses))
+        return cons(interp, c->reraise, cons(interp, var, &NIL));
+    clause = car(clauses);
+    rest = guard_clauses_to_exp(c, var, cdr(clauses));
+    if (is_tagged_list(clause, "else"))
+        return cons(interp, new_symbol(interp, "begin"), cdr(clause));
+    if (!is_nil(cdr(clause)) && !is_tagged_list(cdr(clause), "=>"))
+        return cons(interp, new_symbol(interp, "if"), cons(interp, car(clause),
+                    cons(interp, cons(interp, new_symbol(interp, "begin"), cdr(clause)), cons(interp, rest, &NIL))));
+
+    // a clause returning its test's value needs it in a variable of its own
+    value = new_symbol(interp, "guard-value");
+    if (is_nil(cdr(clause)))
+        result = value;
+    else
+        result = cons(interp, caddr(clause), cons(interp, value, &NIL));
+    return cons(interp, new_symbol(interp, "let"),
+                cons(interp, cons(interp, cons(interp, value, cons(interp, car(clause), &NIL)), &NIL),
+                     cons(interp, cons(interp, new_symbol(interp, "if"),
+                                       cons(interp, value, cons(interp, result, cons(interp, rest, &NIL)))), &NIL)));
+}
+
+static void
+compile_guard (Compiler *c, Function *f, SExp *exp) {
+    SExp *var = caadr(exp);
+    SExp *clauses = guard_clauses_to_exp(c, var, cdadr(exp));
+
+    if (!is_symbol(var))
+        raise_error(c->interp, "guard requires a variable", var);
+    fprintf(c->out, "compiled_guard(interp, ");
+    compile_lambda(c, f, &NIL, cddr(exp));
+    fprintf(c->out, ", ");
+    compile_lambda(c, f, cons(c->interp, var, &NIL), cons(c->interp, clauses, &NIL));
+    fprintf(c->out, ")");
+}
+
+// The OpenCoded tag of the primitive operator names when it isn't bound
+// locally and takes argc arguments, or OPEN_CODED_NONE
+static OpenCoded
+open_coded_operator (Compiler *c, Function *f, SExp *operator, int argc) {
+    SExp *value;
+    OpenCoded tag;
+    int index;
+
+    if (!is_symbol(operator) || resolve(f, operator, &index) != NULL)
+        return OPEN_CODED_NONE;
+    value = lithp_lookup(c->interp, operator->atom->string_value.chars);
+    if (value == NULL || !is_primitive_procedure(value))
+        return OPEN_CODED_NONE;
+    tag = value->primitive->open_coded;
+    if (argc != (tag == OPEN_CODED_CONS || tag == OPEN_CODED_ADD || tag == OPEN_CODED_NUM_EQ || tag == OPEN_CODED_LT ? 2 : 1))
+        return OPEN_CODED_NONE;
+    c->primitives[tag] = operator;
+    return tag;
+}
+
+// Writes the fast path of an open-coded call, guarded on the operator in t<f>
+// still being the primitive, ending where the call it falls back to goes
+static void
+write_open_coded (Compiler *c, OpenCoded tag, int f) {
+    FILE *out = c->out;
+    int a = f + 1, b = f + 2;
+
+    fprintf(out, "t%d == prim_%d", f, tag);
+    switch (tag) {
+        case OPEN_CODED_CAR:
+            fprintf(out, " && is_pair(t%d) ? t%d->pair->car : ", a, a);
+            break;
+        case OPEN_CODED_CDR:
+            fprintf(out, " && is_pair(t%d) ? t%d->pair->cdr : ", a, a);
+            break;
+        case OPEN_CODED_CONS:
+            fprintf(out, " ? cons(interp, t%d, t%d) : ", a, b);
+            break;
+        case OPEN_CODED_ADD:
+            fprintf(out, " && is_number(t%d) && is_number(t%d) ? new_number(interp, t%d->atom->number_value + t%d->atom->number_value) : ", a, b, a, b);
+            break;
+        case OPEN_CODED_NUM_EQ:
+        case OPEN_CODED_LT:
+            fprintf(out, " && is_number(t%d) && is_number(t%d) ? (t%d->atom->number_value %s t%d->atom->number_value ? &TRUE : &FALSE) : ",
+                    a, b, a, tag == OPEN_CODED_LT ? "<" : "==", b);
+            break;
+        case OPEN_CODED_NULL:
+            fprintf(out, " ? (is_nil(t%d) ? &TRUE : &FALSE) : ", a);
+            break;
+        case OPEN_CODED_PAIR:
+            fprintf(out, " ? (is_pair(t%d) ? &TRUE : &FALSE) : ", a);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+compile_application (Compiler *c, Function *f, SExp *exp, int tail) {
+    SExp *operand;
+    int argc = 0;
+    int first_temp = c->n_temps;
+    OpenCoded tag;
+    int i;
+
+    for (operand = cdr(exp); is_pair(operand); operand = cdr(operand))
+        argc++;
+    if (!is_nil(operand))
+        raise_error(c->interp, "malformed application", exp);
+    if (is_tagged_list(exp, "interaction-environment")) {
+        fprintf(c->out, "interp->global_env");
+        return;
+    }
+    if ((is_tagged_list(exp, "apply") || is_tagged_list(exp, "eval")) && argc != 2)
+        raise_error(c->interp, "wrong number of arguments", car(exp));
+
+    c->n_temps += argc + 1;
+    fprintf(c->out, "({ SExp *t%d = ", first_temp);
+    if (is_tagged_list(exp, "apply") || is_tagged_list(exp, "eval"))
+        fprintf(c->out, "NULL");
+    else
+        compile_exp(c, f, car(exp), 0);
+    for (i = 1, operand = cdr(exp); is_pair(operand); i++, operand = cdr(operand)) {
+        fprintf(c->out, "; SExp *t%d = ", first_temp + i);
+        compile_exp(c, f, car(operand), 0);
+    }
+    fprintf(c->out, "; ");
+
+    // like eval, these are recognized by name and have no operator to call
+    if (is_tagged_list(exp, "apply")) {
+        fprintf(c->out, "(void)t%d; apply_list(interp, t%d, t%d); })", first_temp, first_temp + 1, first_temp + 2);
+        return;
+    }
+    if (is_tagged_list(exp, "eval")) {
+        fprintf(c->out, "(void)t%d; eval(interp, t%d, t%d); })", first_temp, first_temp + 1, first_temp + 2);
+        return;
+    }
+    tag = open_coded_operator(c, f, car(exp), argc);
+    if (tag != OPEN_CODED_NONE)
+        write_open_coded(c, tag, first_temp);
+    fprintf(c->out, "%s(interp, t%d, %d, ", tail ? "compiled_tail_call" : "apply", first_temp, argc);
+    if (argc == 0) {
+        fprintf(c->out, "NULL");
+    } else {
+        fprintf(c->out, "(SExp *[]){ ");
+        for (i = 1; i <= argc; i++)
+            fprintf(c->out, "t%d, ", first_temp + i);
+        fprintf(c->out, "}");
+    }
+    fprintf(c->out, "); })");
+}
+
+// The optimized expression while each primitive the fold assumed is still
+// bound to its name, as captured at startup, and the original otherwise
+static void
+compile_folded (Compiler *c, Function *f, SExp *exp, int tail) {
+    FoldGuard *guard = exp->pair->cache;
+    int i, sym;
+
+    fprintf(c->out, "(");
+    for (i = 0; i < guard->n_cells; i++) {
+        sym = symbol_index(c, guard->symbols[i]);
+        c->symbol_has_cell[sym] = 1;
+        c->symbol_folded[sym] = 1;
+        fprintf(c->out, "%scompiled_global(interp, &cell_%d, sym_%d) == fold_%d", i > 0 ? " && " : "", sym, sym, sym);
+    }
+    fprintf(c->out, " ? ");
+    compile_exp(c, f, cadr(exp), tail);
+    fprintf(c->out, " : ");
+    compile_exp(c, f, caddr(exp), tail);
+    fprintf(c->out, ")");
+}
+
+static void
+compile_exp (Compiler *c, Function *f, SExp *exp, int tail) {
+    SExp *exps;
+
+    if (is_self_evaluating(exp) || is_nil(exp)) {
+        compile_literal(c, exp);
+    } else if (is_symbol(exp)) {
+        compile_variable(c, f, exp);
+    } else if (is_quoted(exp)) {
+        compile_literal(c, cadr(exp));
+    } else if (is_folded(exp)) {
+        compile_folded(c, f, exp, tail);
+    } else if (is_assignment(exp)) {
+        compile_assignment(c, f, exp);
+    } else if (is_definition(exp)) {
+        // elsewhere definitions are only allowed at the start of a body
+        if (f->parent != NULL || f->scope != NULL)
+            raise_error(c->interp, "can't compile a definition here", exp);
+        fprintf(c->out, "compiled_define(interp, sym_%d, ", symbol_index(c, definition_variable(exp)));
+        compile_exp(c, f, definition_value(c->interp, exp), 0);
+        fprintf(c->out, ")");
+    } else if (is_if(exp)) {
+        fprintf(c->out, "(is_true(");
+        compile_exp(c, f, cadr(exp), 0);
+        fprintf(c->out, ") ? ");
+        compile_exp(c, f, caddr(exp), tail);
+        fprintf(c->out, " : ");
+        if (is_nil(cdddr(exp)))
+            fprintf(c->out, "&FALSE");
+        else
+            compile_exp(c, f, cadddr(exp), tail);
+        fprintf(c->out, ")");
+    } else if (is_and(exp) || is_or(exp)) {
+        compile_bool(c, f, cdr(exp), is_and(exp), tail);
+    } else if (is_lambda(exp)) {
+        compile_lambda(c, f, cadr(exp), cddr(exp));
+    } else if (is_let(exp)) {
+        compile_let(c, f, exp, tail);
+    } else if (is_begin(exp)) {
+        fprintf(c->out, "({ ");
+        for (exps = cdr(exp); is_pair(exps); exps = cdr(exps)) {
+            fprintf(c->out, is_nil(cdr(exps)) ? "" : "(void)(");
+            compile_exp(c, f, car(exps), tail && is_nil(cdr(exps)));
+            fprintf(c->out, is_nil(cdr(exps)) ? "; " : "); ");
+        }
+        fprintf(c->out, is_nil(cdr(exp)) ? "&NIL; })" : "})");
+    } else if (is_cond(exp)) {
+        compile_exp(c, f, cond_to_if(c->interp, exp), tail);
+    } else if (is_guard(exp)) {
+        compile_guard(c, f, exp);
+    } else if (is_delay(exp) || is_delay_force(exp)) {
+        if (!is_pair(cdr(exp)))
+            raise_error(c->interp, "delay requires an expression", exp);
+        fprintf(c->out, "new_promise(interp, NULL, NULL, ");
+        compile_lambda(c, f, &NIL, cons(c->interp, cadr(exp), &NIL));
+        fprintf(c->out, ", %d)", is_delay_force(exp));
+    } else if (is_cons_stream(exp)) {
+        if (!is_pair(cdr(exp)) || !is_pair(cddr(exp)))
+            raise_error(c->interp, "cons-stream requires two expressions", exp);
+        fprintf(c->out, "cons(interp, ");
+        compile_exp(c, f, cadr(exp), 0);
+        fprintf(c->out, ", new_promise(interp, NULL, NULL, ");
+        compile_lambda(c, f, &NIL, cons(c->interp, caddr(exp), &NIL));
+        fprintf(c->out, ", 0))");
+    } else if (car(exp) == c->reraise) {
+        fprintf(c->out, "raise_object(interp, ");
+        compile_variable(c, f, cadr(exp));
+        fprintf(c->out, ", 0)");
+    } else {
+        compile_application(c, f, exp, tail);
+    }
+}
+
+// Parses the programs at paths as one, the way load_and_run would read them
+static SExp *
+read_programs (Interp *interp, char **paths, int n_paths) {
+    SExp *forms = &NIL;
+    SExp *program, *tail;
+    FILE *in;
+    int i;
+
+    for (i = n_paths - 1; i >= 0; i--) {
+        in = fopen(paths[i], "r");
+        if (in == NULL)
+            return raise_error(interp, "couldn't open file", new_string(interp, paths[i], strlen(paths[i])));
+        program = parse_and_close(interp, in);
+        if (program == NULL)
+            return raise_error(interp, "couldn't parse file", new_string(interp, paths[i], strlen(paths[i])));
+        program = intern_symbols(interp, program);
+        // program is (begin ...); splice its forms in front of the later files'
+        for (tail = program; !is_nil(cdr(tail)); tail = cdr(tail))
+            ;
+        tail->pair->cdr = forms;
+        forms = cdr(program);
+    }
+    return cons(interp, new_symbol(interp, "begin"), forms);
+}
+
+static void
+write_program (Compiler *c, FILE *out, char **paths, int n_paths, Output *toplevel) {
+    int i;
+
+    fprintf(out, "// Generated by lithp --compile from");
+    for (i = 0; i < n_paths; i++)
+        fprintf(out, " %s", paths[i]);
+    fprintf(out, "\n#include \"lithp.h\"\n\n");
+    for (i = 0; i < c->n_symbols; i++) {
+        fprintf(out, "static SExp *sym_%d;\n", i);
+        if (c->symbol_has_cell[i])
+            fprintf(out, "static SExp *cell_%d;\n", i);
+        if (c->symbol_folded[i])
+            fprintf(out, "static SExp *fold_%d;\n", i);
+    }
+    for (i = 0; i < c->n_literals; i++)
+        fprintf(out, "static SExp *lit_%d;\n", i);
+    for (i = 0; i <= OPEN_CODED_PAIR; i++) {
+        if (c->primitives[i] != NULL)
+            fprintf(out, "static SExp *prim_%d;\n", i);
+    }
+    fprintf(out, "\n");
+    fwrite(c->prototypes.chars, 1, c->prototypes.length, out);
+    fprintf(out, "\n");
+    fwrite(c->functions.chars, 1, c->functions.length, out);
+
+    fprintf(out, "static void\ninit_constants (Interp *interp) {\n");
+    for (i = 0; i < c->n_symbols; i++) {
+        fprintf(out, "    sym_%d = lithp_symbol(interp, ", i);
+        write_c_string(out, c->symbols[i]->atom->string_value.chars, c->symbols[i]->atom->string_value.length);
+        fprintf(out, ");\n");
+    }
+    // captured before the program can redefine them, for the open-coded calls
+    for (i = 0; i <= OPEN_CODED_PAIR; i++) {
+        if (c->primitives[i] != NULL)
+            fprintf(out, "    prim_%d = lithp_lookup(interp, \"%s\");\n", i, c->primitives[i]->atom->string_value.chars);
+    }
+    for (i = 0; i < c->n_symbols; i++) {
+        if (c->symbol_folded[i])
+            fprintf(out, "    fold_%d = lithp_lookup(interp, \"%s\");\n", i, c->symbols[i]->atom->string_value.chars);
+    }
+    fwrite(c->literals.chars, 1, c->literals.length, out);
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static SExp *\ntoplevel (Interp *interp) {\n");
+    fwrite(toplevel->chars, 1, toplevel->length, out);
+    fprintf(out, "    return &NIL;\n}\n\n");
+
+    fprintf(out, "int\nmain (int argc, char **argv) {\n");
+    fprintf(out, "    Interp *interp = lithp_new(NULL);\n");
+    fprintf(out, "    init_constants(interp);\n");
+    fprintf(out, "    return lithp_run_compiled(interp, toplevel);\n}\n");
+}
+
+int
+compile_program (Interp *interp, FILE *out, char **paths, int n_paths) {
+    Compiler c;
+    Function toplevel = { NULL, NULL, NULL, 0 };
+    Output toplevel_out;
+    ErrorHandler handler;
+    SExp *program, *exp;
+
+    memset(&c, 0, sizeof(c));
+    c.interp = interp;
+    c.reraise = new_symbol(interp, "reraise");
+    output_open(&c.prototypes);
+    output_open(&c.functions);
+    output_open(&c.literals);
+    output_open(&toplevel_out);
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        print_error(stderr, handler.raised);
+        return 1;
+    }
+    program = read_programs(interp, paths, n_paths);
+    if (interp->optimize)
+        program = optimize(interp, program);
+    for (exp = cdr(program); is_pair(exp); exp = cdr(exp)) {
+        c.out = toplevel_out.file;
+        fprintf(c.out, "    (void)(");
+        compile_exp(&c, &toplevel, car(exp), 0);
+        fprintf(c.out, ");\n");
+    }
+    pop_error_handler(interp, &handler);
+
+    output_close(&c.prototypes);
+    output_close(&c.functions);
+    output_close(&c.literals);
+    output_close(&toplevel_out);
+    write_program(&c, out, paths, n_paths, &toplevel_out);
+    return 0;
+}
@@ -4,25 +4,40 @@
 #include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
-#include <regex.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "lithp.h"
 
+SExp NIL = { SEXP_TYPE_NIL };
+Atom _true_atom = { ATOM_TYPE_BOOLEAN, 0, 0, { 1 } };
+SExp TRUE = { SEXP_TYPE_ATOM, { &_true_atom } };
+Atom _false_atom = { ATOM_TYPE_BOOLEAN, 0, 0, { 0 } };
+SExp FALSE = { SEXP_TYPE_ATOM, { &_false_atom } };
+SExp EOF_OBJECT = { SEXP_TYPE_EOF };
+Atom _folded_atom = { ATOM_TYPE_SYMBOL, 0, 0, { .string_value = { 6, 7, "folded" } } };
+SExp FOLDED = { SEXP_TYPE_ATOM, { &_folded_atom } };
+
+// the interpreter whose handlers catch errors raised on this thread by code
+// that isn't given one, like car and cdr
+__thread Interp *current_interp;
+
 // PARSER
 
+// A symbol is any token with a character that can start one somewhere in it,
+// which is what the unanchored regex this replaced matched. glibc's regexec
+// takes a lock, which serialized parsing on several threads.
 int
 parser__is_symbol_token (char *token, size_t token_size) {
-    regex_t re;
-    int ret;
-    ret = regcomp(&re, "[_a-zA-Z!0&*/:<=>+?^][_a-zA-Z!0&*/:<=>?^0-9.+-]*", REG_EXTENDED|REG_NOSUB);
-    if (ret != 0) {
-        printf("Error comiling symbol regex\n");
-        exit(1);
-    }
-    ret = regexec(&re, token, 0, NULL, 0);
-    if (ret == 0)
-        return 1;
-    return 0;
+    return strpbrk(token, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ!0&*/:<=>+?^") != NULL;
 }
 
 int
@@ -54,45 +69,189 @@ parser__is_nil_token (char *token, size_t token_size) {
     return 0;
 }
 
-FILE *_t_in;
-char _t_buf[MAX_STRING_SIZE];
-char _t_peek_buf[MAX_STRING_SIZE];
+// SCANNING
+// The reader finds the ends of tokens, skips whitespace and comments and
+// copies string bodies by scanning for a class of bytes a block at a time. The
+// widest block the CPU supports is picked once, on first use.
+
+// the ScanClass bits of each byte
+const unsigned char byte_classes[256] = {
+    [' '] = SCAN_DELIM | SCAN_SPACE,
+    ['\n'] = SCAN_DELIM | SCAN_SPACE | SCAN_NEWLINE | SCAN_STRUCTURE,
+    ['('] = SCAN_DELIM | SCAN_STRUCTURE,
+    [')'] = SCAN_DELIM | SCAN_STRUCTURE,
+    ['"'] = SCAN_DELIM | SCAN_STRING | SCAN_STRUCTURE,
+    ['\\'] = SCAN_DELIM | SCAN_STRING | SCAN_STRUCTURE,
+    [';'] = SCAN_STRUCTURE,
+    ['\0'] = SCAN_DELIM,
+};
+
+// the bytes of each class, for the block compares
+const struct {
+    char bytes[8];
+    int n;
+} class_members[] = {
+    // the terminating NUL is the seventh
+    [SCAN_DELIM] = { " ()\n\"\\", 7 },
+    [SCAN_SPACE] = { " \n", 2 },
+    [SCAN_NEWLINE] = { "\n", 1 },
+    [SCAN_STRING] = { "\"\\", 2 },
+    [SCAN_STRUCTURE] = { "\n()\"\\;", 6 },
+};
+
+const char *
+scan_scalar (const char *p, const char *end, ScanClass class, int in_class) {
+    while (p < end && ((byte_classes[(unsigned char)*p] & class) != 0) != in_class)
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__)
+const char *
+scan_sse2 (const char *p, const char *end, ScanClass class, int in_class) {
+    __m128i members[8], block, hits;
+    int i, n = class_members[class].n;
+    unsigned mask;
+
+    for (i = 0; i < n; i++)
+        members[i] = _mm_set1_epi8(class_members[class].bytes[i]);
+    for (; end - p >= 16; p += 16) {
+        block = _mm_loadu_si128((const __m128i *)p);
+        hits = _mm_cmpeq_epi8(block, members[0]);
+        for (i = 1; i < n; i++)
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, members[i]));
+        mask = _mm_movemask_epi8(hits);
+        if (!in_class)
+            mask ^= 0xffff;
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return scan_scalar(p, end, class, in_class);
+}
+
+__attribute__((target("avx2")))
+const char *
+scan_avx2 (const char *p, const char *end, ScanClass class, int in_class) {
+    __m256i members[8], block, hits;
+    int i, n = class_members[class].n;
+    unsigned mask;
+
+    for (i = 0; i < n; i++)
+        members[i] = _mm256_set1_epi8(class_members[class].bytes[i]);
+    for (; end - p >= 32; p += 32) {
+        block = _mm256_loadu_si256((const __m256i *)p);
+        hits = _mm256_cmpeq_epi8(block, members[0]);
+        for (i = 1; i < n; i++)
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, members[i]));
+        mask = _mm256_movemask_epi8(hits);
+        if (!in_class)
+            mask = ~mask;
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return scan_sse2(p, end, class, in_class);
+}
+#endif
+
+const char * (*scan_impl) (const char *p, const char *end, ScanClass class, int in_class);
+pthread_once_t scan_impl_once = PTHREAD_ONCE_INIT;
+
+void
+choose_scan_impl () {
+    scan_impl = scan_scalar;
+#if defined(__x86_64__)
+    // every x86-64 has SSE2; AVX2 is looked up with cpuid, which also checks
+    // that the OS saves the wider registers
+    scan_impl = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+}
+
+const char *
+scan_for (const char *p, const char *end, ScanClass class) {
+    pthread_once(&scan_impl_once, choose_scan_impl);
+    return scan_impl(p, end, class, 1);
+}
+
+const char *
+scan_past (const char *p, const char *end, ScanClass class) {
+    pthread_once(&scan_impl_once, choose_scan_impl);
+    return scan_impl(p, end, class, 0);
+}
 
-const char* delim = " ()\n\"\\\0";
-int n_delim = 7;
+// READER
 
 void
-init_parser (FILE *in) {
-    _t_in = in;
+init_parser (Interp *interp, FILE *in, int is_repl) {
+    Reader *reader = is_repl ? &interp->repl_reader : &interp->file_reader;
+
+    // the REPL carries on with whatever it buffered past its last expression
+    if (!is_repl || reader->in != in) {
+        reader->pos = 0;
+        reader->len = 0;
+    }
+    reader->in = in;
+    reader->by_line = is_repl;
+    interp->reader = reader;
 }
 
+// Reads more of the input once everything buffered has been consumed, keeping
+// the last `keep` bytes, which are the start of a token. Returns 0 at the end
+// of the input.
 int
-_next_token (char *buf) {
-    int i;
-    char c;
+fill_read_buffer (Reader *reader, size_t keep) {
+    size_t n;
 
-    i = 0;
-    while (1) {
-        if (i >= MAX_STRING_SIZE) {
-            printf("ran out of token buffer space\n");
+    if (reader->buf == NULL) {
+        reader->buf = malloc(READ_BUFFER_SIZE + MAX_STRING_SIZE);
+        if (reader->buf == NULL) {
+            printf("ERR: out of memory\n");
             exit(1);
         }
+    }
+    memmove(reader->buf, reader->buf + reader->pos - keep, keep);
+    reader->pos = keep;
+    reader->len = keep;
+    if (reader->by_line) {
+        if (fgets(reader->buf + keep, READ_BUFFER_SIZE, reader->in) == NULL)
+            return 0;
+        n = strlen(reader->buf + keep);
+    } else {
+        n = fread(reader->buf + keep, 1, READ_BUFFER_SIZE, reader->in);
+    }
+    reader->len += n;
+    return n > 0;
+}
+
+// Whether there's unconsumed input, reading more if needed
+int
+reader_has_input (Reader *reader) {
+    return reader->pos < reader->len || fill_read_buffer(reader, 0);
+}
 
-        c = getc(_t_in);
+int
+_next_token (Interp *interp, char *buf) {
+    Reader *reader = interp->reader;
+    const char *start, *end;
+    size_t i = 0;
 
-        if (c == EOF)
-            break;
+    if (!reader_has_input(reader)) {
+        buf[0] = '\0';
+        return 0;
+    }
 
-        if (is_delim(c)) {
-            if(i == 0) {
-                buf[i++] = c;
-                break;
-            } else {
-                ungetc(c, _t_in);
-                break;
-            }
-        }
-        buf[i++] = c;
+    // a delimiter is a token of its own
+    if (is_delim(reader->buf[reader->pos])) {
+        buf[i++] = reader->buf[reader->pos++];
+    } else {
+        do {
+            start = reader->buf + reader->pos;
+            end = scan_for(start, reader->buf + reader->len, SCAN_DELIM);
+            i += end - start;
+            reader->pos += end - start;
+            if (i >= MAX_STRING_SIZE)
+                raise_error(interp, "token too long", NULL);
+        } while (reader->pos == reader->len && fill_read_buffer(reader, i));
+        memcpy(buf, reader->buf + reader->pos - i, i);
     }
 
     buf[i] = '\0';
@@ -100,52 +259,66 @@ _next_token (char *buf) {
 }
 
 char *
-peek_next_token () {
-    int buf_len = _next_token(_t_peek_buf);
+peek_next_token (Interp *interp) {
+    int buf_len = _next_token(interp, interp->peek_buf);
 
     if (buf_len == 0)
         return NULL;
 
-    while (buf_len > 0) {
-        ungetc(_t_peek_buf[--buf_len], _t_in);
-    }
-
-    return _t_peek_buf;
+    // the token is still buffered, so unreading it is a rewind
+    interp->reader->pos -= buf_len;
+    return interp->peek_buf;
 }
 
 char *
-next_token () {
-    int buf_len = _next_token(_t_buf);
+next_token (Interp *interp) {
+    int buf_len = _next_token(interp, interp->token_buf);
     if (buf_len == 0)
         return NULL;
-    return _t_buf;
+    return interp->token_buf;
 }
 
 int
 is_delim (char c) {
-    int i;
-    for (i=0; i<n_delim; i++) {
-        if (delim[i] == c)
-            return 1;
+    return byte_classes[(unsigned char)c] & SCAN_DELIM;
+}
+
+// Skips spaces, newlines and ; comments, starting inside a comment if
+// in_comment is set
+void
+skip_whitespace (Interp *interp, int in_comment) {
+    Reader *reader = interp->reader;
+    const char *p, *end;
+
+    while (reader_has_input(reader)) {
+        p = reader->buf + reader->pos;
+        end = reader->buf + reader->len;
+        if (in_comment) {
+            p = scan_for(p, end, SCAN_NEWLINE);
+            in_comment = (p == end);
+        } else {
+            p = scan_past(p, end, SCAN_SPACE);
+            if (p < end && *p != ';') {
+                reader->pos = p - reader->buf;
+                return;
+            }
+            in_comment = (p < end);
+        }
+        reader->pos = p - reader->buf;
     }
-    return 0;
 }
 
 void
-consume_whitespace () {
-    char c;
-    c = getc(_t_in);
-    while (c == ' ' || c == '\n') c = getc(_t_in);
-    ungetc(c, _t_in);
+consume_whitespace (Interp *interp) {
+    skip_whitespace(interp, 0);
 }
 
 int
-parser__parse_atom (char *token, size_t token_size, Atom *atom) {
-    int string_buf_idx;
-    int token_buf_idx;
+parser__parse_atom (Interp *interp, char *token, size_t token_size, Atom *atom) {
+    Reader *reader = interp->reader;
+    const char *start, *end;
     int string_terminated;
-    int token_buf_start;
-    int is_escaped;
+    char c;
 
     if (parser__is_number_token(token)) {
         atom->type = ATOM_TYPE_NUMBER;
@@ -155,11 +328,11 @@ parser__parse_atom (char *token, size_t token_size, Atom *atom) {
         // If we've only got the # token, the next character must be an escaped
         // sequence. Otherwise, assume it's either #t or #f
         if (token_size == 1) {
-            token = next_token();
+            token = next_token(interp);
             if (token == NULL || token[0] != '\\') {
                 return 1;
             }
-            token = next_token();
+            token = next_token(interp);
             if (token == NULL) {
                 return 1;
             }
@@ -186,41 +359,29 @@ parser__parse_atom (char *token, size_t token_size, Atom *atom) {
         }
     } else if (token[0] == '"') {
         atom->type = ATOM_TYPE_STRING;
-        string_buf_idx = 0;
+        string_init(interp, &atom->string_value, "", 0);
         string_terminated = 0;
-        is_escaped = 0;
-        while ((token = next_token())) {
-            token_size = strlen(token);
-            token_buf_start = 0;
-
-            if (is_escaped) {
-                if (token[0] == 'n')
-                    atom->string_value[string_buf_idx++] = '\n';
-                else // not totally correct but w/e
-                    atom->string_value[string_buf_idx++] = token[0];
-                is_escaped = 0;
-                token_buf_start++;
-            }
-
-            if (token[token_buf_start] == '"') {
-                string_terminated = 1;
-                char *next_token = peek_next_token();
-                if (next_token != NULL && !is_delim(next_token[0])) {
-                    printf("Can't terminate quote here: %s\n", token);
-                    return 1;
-                }
-                atom->string_value[string_buf_idx] = '\0';
-                break;
-            }
-
-            if (token[token_buf_start] == '\\') {
-                is_escaped = 1;
+        // copy runs up to the next quote or backslash
+        while (!string_terminated && reader_has_input(reader)) {
+            start = reader->buf + reader->pos;
+            end = scan_for(start, reader->buf + reader->len, SCAN_STRING);
+            string_append_chars(interp, &atom->string_value, start, end - start);
+            reader->pos = end - reader->buf;
+            if (reader->pos == reader->len)
                 continue;
-            }
-
-            for (token_buf_idx=token_buf_start; token_buf_idx < token_size; token_buf_idx++) {
-                char c = token[token_buf_idx];
-                atom->string_value[string_buf_idx++] = c;
+            reader->pos++;
+            if (*end == '"') {
+                string_terminated = 1;
+            } else if (reader_has_input(reader)) {
+                c = reader->buf[reader->pos++];
+                if (c == 'n')
+                    c = '\n';
+                else if (c == 't')
+                    c = '\t';
+                else if (c == 'r')
+                    c = '\r';
+                // not totally correct but w/e
+                string_append_chars(interp, &atom->string_value, &c, 1);
             }
         }
 
@@ -228,11 +389,15 @@ parser__parse_atom (char *token, size_t token_size, Atom *atom) {
             printf("Unterminated string\n");
             return 1;
         }
+        if (reader_has_input(reader) && !is_delim(reader->buf[reader->pos])) {
+            printf("Can't terminate quote here: \"\n");
+            return 1;
+        }
         return 0;
     } else {
         if (parser__is_symbol_token(token, token_size)) {
             atom->type = ATOM_TYPE_SYMBOL;
-            strncpy(atom->string_value, token, token_size);
+            string_init(interp, &atom->string_value, token, token_size);
             return 0;
         }
     }
@@ -240,18 +405,18 @@ parser__parse_atom (char *token, size_t token_size, Atom *atom) {
 }
 
 int
-parser__parse_pair (char *token, size_t token_size, Pair *pair) {
+parser__parse_pair (Interp *interp, char *token, size_t token_size, Pair *pair) {
     // parse car
-    pair->car = new_sexp();
-    if (parser__parse_sexp(token, token_size, pair->car)) {
+    pair->car = new_sexp(interp);
+    if (parser__parse_sexp(interp, token, token_size, pair->car)) {
         return 1;
     }
 
-    consume_whitespace();
+    consume_whitespace(interp);
 
     // handle NIL cdr
-    pair->cdr = new_sexp();
-    token = peek_next_token();
+    pair->cdr = new_sexp(interp);
+    token = peek_next_token(interp);
     if (token == NULL) {
         return 1;
     } else if (token[0] == ')') {
@@ -260,11 +425,11 @@ parser__parse_pair (char *token, size_t token_size, Pair *pair) {
     }
 
     // parse cdr
-    token = next_token();
+    token = next_token(interp);
     token_size = strlen(token);
-    pair->cdr->pair = new_pair();
+    pair->cdr->pair = new_pair(interp);
     pair->cdr->type = SEXP_TYPE_PAIR;
-    if (parser__parse_pair(token, token_size, pair->cdr->pair)) {
+    if (parser__parse_pair(interp, token, token_size, pair->cdr->pair)) {
         return 1;
     } else {
         return 0;
@@ -272,14 +437,17 @@ parser__parse_pair (char *token, size_t token_size, Pair *pair) {
 }
 
 int
-parser__parse_sexp (char *token, size_t token_size, SExp *exp) {
+parser__parse_sexp (Interp *interp, char *token, size_t token_size, SExp *exp) {
     if (token[0] == ';') {
-        while (token[0] != '\n') token = next_token();
-        token = next_token();
+        skip_whitespace(interp, 1);
+        token = next_token(interp);
+        if (token == NULL)
+            return 1;
+        token_size = strlen(token);
     }
     if (token[0] == '\'') {
         if (token_size == 1) {
-            token = next_token();
+            token = next_token(interp);
             if (token == NULL)
                 return 1;
             token_size = strlen(token);
@@ -288,15 +456,15 @@ parser__parse_sexp (char *token, size_t token_size, SExp *exp) {
             token_size--;
         }
         exp->type = SEXP_TYPE_PAIR;
-        exp->pair = new_pair();
-        exp->pair->car = new_symbol("quote");
-        exp->pair->cdr = cons(new_sexp(), &NIL);
-        return parser__parse_sexp(token, token_size, cadr(exp));
+        exp->pair = new_pair(interp);
+        exp->pair->car = new_symbol(interp, "quote");
+        exp->pair->cdr = cons(interp, new_sexp(interp), &NIL);
+        return parser__parse_sexp(interp, token, token_size, cadr(exp));
     }
 
     if (token[0] == '(') {
-        consume_whitespace();
-        token = next_token();
+        consume_whitespace(interp);
+        token = next_token(interp);
         if (token == NULL)
             return 1;
         token_size = strlen(token);
@@ -306,9 +474,9 @@ parser__parse_sexp (char *token, size_t token_size, SExp *exp) {
             return 0;
         }
 
-        Pair *pair = new_pair();
-        if (parser__parse_pair(token, token_size, pair) == 0) {
-            token = next_token();
+        Pair *pair = new_pair(interp);
+        if (parser__parse_pair(interp, token, token_size, pair) == 0) {
+            token = next_token(interp);
             if (token == NULL || token[0] != ')') {
                 printf("Unclosed parenthesis\n");
                 return 1;
@@ -318,23 +486,24 @@ parser__parse_sexp (char *token, size_t token_size, SExp *exp) {
             return 0;
         }
 
-        free(pair);
+        discard_pair(interp, pair);
         return 1;
     }
 
-    Atom *atom = new_atom();
-    if (parser__parse_atom(token, token_size, atom) == 0) {
+    Atom parsed;
+    if (parser__parse_atom(interp, token, token_size, &parsed) == 0) {
         exp->type = SEXP_TYPE_ATOM;
-        exp->atom = atom;
+        exp->atom = new_atom(interp, parsed.type);
+        parsed.bound_locally = 0;
+        parsed.rebound = 0;
+        *exp->atom = parsed;
         return 0;
     }
-
-    free(atom);
     return 1;
 }
 
 SExp *
-parser__parse_program (FILE *in, int is_repl) {
+parser__parse_program (Interp *interp, FILE *in, int is_repl) {
     char *token;
     size_t token_size;
     SExp *program, *ret;
@@ -342,20 +511,21 @@ parser__parse_program (FILE *in, int is_repl) {
 
     program = &NIL;
 
-    init_parser(in);
-    token = next_token();
+    init_parser(interp, in, is_repl);
+    consume_whitespace(interp);
+    token = next_token(interp);
     while (token != NULL) {
         if (isspace(token[0])) {
-            token = next_token();
+            token = next_token(interp);
             continue;
         }
 
         token_size = strlen(token);
-        curr_exp = new_sexp();
+        curr_exp = new_sexp(interp);
 
-        if (!parser__parse_sexp(token, token_size, curr_exp)) {
+        if (!parser__parse_sexp(interp, token, token_size, curr_exp)) {
             // this builds a list of the expressions from last to first
-            program = cons(curr_exp, program);
+            program = cons(interp, curr_exp, program);
 
             // if we're running in the context of a REPL, just return after the
             // first expression is parsed
@@ -364,16 +534,17 @@ parser__parse_program (FILE *in, int is_repl) {
             printf("Unknown token %s\n", token);
             return NULL;
         }
-        token = next_token();
+        consume_whitespace(interp);
+        token = next_token(interp);
     }
 
     // we want to return cons('begin, reverse(program))
     ret = &NIL;
     while (!is_nil(program)) {
-        ret = cons(car(program), ret);
+        ret = cons(interp, car(program), ret);
         program = cdr(program);
     }
-    ret = cons(new_symbol("begin"), ret);
+    ret = cons(interp, new_symbol(interp, "begin"), ret);
 
     return ret;
 }
@@ -381,37 +552,117 @@ parser__parse_program (FILE *in, int is_repl) {
 // EVALUATOR
 // These functions are largely modeled after SICP's metacircular evaluator
 
+void
+count_alloc (Interp *interp, AllocCounter *counter, size_t bytes) {
+    counter->total++;
+    counter->live++;
+    counter->bytes += bytes;
+    interp->bytes_allocated += bytes;
+}
+
 SExp *
-new_sexp () {
+new_sexp (Interp *interp) {
+    if (interp->bytes_allocated > interp->bytes_limit
+        && !refill_limit(interp, LIMIT_MEMORY, interp->bytes_allocated - interp->bytes_limit))
+        limit_exceeded(interp, LIMIT_MEMORY);
+    interp->cells_allocated++;
+    count_alloc(interp, &interp->memory_stats.sexps, sizeof(SExp));
+    if ((interp->cells_allocated & MEMORY_STATS_CHECK_MASK) == 0 && interp->memory_stats_interval_ns)
+        maybe_dump_memory_stats(interp);
     return (SExp*)(malloc(sizeof(SExp)));
 }
 
 Atom *
-new_atom () {
-    return (Atom*)(malloc(sizeof(Atom)));
+new_atom (Interp *interp, AtomType type) {
+    count_alloc(interp, &interp->memory_stats.atoms[type], sizeof(Atom));
+    Atom *atom = (Atom*)(malloc(sizeof(Atom)));
+    atom->type = type;
+    atom->bound_locally = 0;
+    atom->rebound = 0;
+    return atom;
 }
 
 Pair *
-new_pair () {
-    return (Pair*)(malloc(sizeof(Pair)));
+new_pair (Interp *interp) {
+    count_alloc(interp, &interp->memory_stats.pairs, sizeof(Pair));
+    Pair *pair = (Pair*)(malloc(sizeof(Pair)));
+    pair->cache = NULL;
+    return pair;
+}
+
+void
+discard_pair (Interp *interp, Pair *pair) {
+    interp->memory_stats.pairs.live--;
+    free(pair);
+}
+
+void
+string_reserve (Interp *interp, String *string, size_t capacity) {
+    if (capacity <= string->capacity)
+        return;
+    if (capacity < string->capacity * 2)
+        capacity = string->capacity * 2;
+    // a string is the one thing that can take a lot of memory in one go
+    if (interp->bytes_allocated + (capacity - string->capacity) > interp->bytes_limit
+        && !refill_limit(interp, LIMIT_MEMORY, interp->bytes_allocated + (capacity - string->capacity) - interp->bytes_limit))
+        limit_exceeded(interp, LIMIT_MEMORY);
+    if (string->chars == NULL)
+        count_alloc(interp, &interp->memory_stats.string_buffers, 0);
+    interp->memory_stats.string_buffers.bytes += capacity - string->capacity;
+    interp->bytes_allocated += capacity - string->capacity;
+    string->chars = realloc(string->chars, capacity);
+    string->capacity = capacity;
+}
+
+void
+string_init (Interp *interp, String *string, const char *chars, size_t length) {
+    string->length = 0;
+    string->capacity = 0;
+    string->chars = NULL;
+    string_reserve(interp, string, length + 1);
+    string_append_chars(interp, string, chars, length);
+}
+
+void
+string_append_chars (Interp *interp, String *string, const char *chars, size_t length) {
+    string_reserve(interp, string, string->length + length + 1);
+    memcpy(string->chars + string->length, chars, length);
+    string->length += length;
+    string->chars[string->length] = '\0';
+}
+
+SExp *
+new_symbol (Interp *interp, const char* symbol_string) {
+    SExp *ret = new_sexp(interp);
+    ret->type = SEXP_TYPE_ATOM;
+    ret->atom = new_atom(interp, ATOM_TYPE_SYMBOL);
+    string_init(interp, &ret->atom->string_value, symbol_string, strlen(symbol_string));
+    return ret;
 }
 
 SExp *
-new_symbol (const char* symbol_string) {
-    SExp *ret = new_sexp();
+new_string (Interp *interp, const char *chars, size_t length) {
+    SExp *ret = new_sexp(interp);
     ret->type = SEXP_TYPE_ATOM;
-    ret->atom = new_atom();
-    ret->atom->type = ATOM_TYPE_SYMBOL;
-    strcpy(ret->atom->string_value, symbol_string);
+    ret->atom = new_atom(interp, ATOM_TYPE_STRING);
+    string_init(interp, &ret->atom->string_value, chars, length);
     return ret;
 }
 
 SExp *
-new_number (long int value) {
-    SExp *ret = new_sexp();
+new_character (Interp *interp, char value) {
+    SExp *ret = new_sexp(interp);
     ret->type = SEXP_TYPE_ATOM;
-    ret->atom = new_atom();
-    ret->atom->type = ATOM_TYPE_NUMBER;
+    ret->atom = new_atom(interp, ATOM_TYPE_CHARACTER);
+    ret->atom->character_value = value;
+    return ret;
+}
+
+SExp *
+new_number (Interp *interp, long int value) {
+    SExp *ret = new_sexp(interp);
+    ret->type = SEXP_TYPE_ATOM;
+    ret->atom = new_atom(interp, ATOM_TYPE_NUMBER);
     ret->atom->number_value = value;
     return ret;
 }
@@ -422,10 +673,17 @@ new_boolean (int value) {
 }
 
 SExp *
-new_primitive_proc (Proc proc) {
-    SExp *ret = new_sexp();
+new_primitive_proc (Interp *interp, const char *name, Proc proc, int min_args, int max_args) {
+    SExp *ret = new_sexp(interp);
     ret->type = SEXP_TYPE_PRIMITIVE_PROC;
-    ret->proc = proc;
+    count_alloc(interp, &interp->memory_stats.primitives, sizeof(Primitive));
+    ret->primitive = malloc(sizeof(Primitive));
+    ret->primitive->proc = proc;
+    ret->primitive->name = name;
+    ret->primitive->min_args = min_args;
+    ret->primitive->max_args = max_args;
+    ret->primitive->pure = 0;
+    ret->primitive->open_coded = OPEN_CODED_NONE;
     return ret;
 }
 
@@ -437,11 +695,11 @@ int is_string (SExp *exp) { return is_atom(exp) && (exp->atom->type == ATOM_TYPE
 int is_symbol (SExp *exp) { return is_atom(exp) && (exp->atom->type == ATOM_TYPE_SYMBOL); }
 int is_boolean (SExp *exp) { return is_atom(exp) && (exp->atom->type == ATOM_TYPE_BOOLEAN); }
 int is_character (SExp *exp) { return is_atom(exp) && (exp->atom->type == ATOM_TYPE_CHARACTER); }
-int is_self_evaluating (SExp *exp) { return is_number(exp) || is_string(exp) || is_boolean(exp); }
+int is_self_evaluating (SExp *exp) { return is_number(exp) || is_string(exp) || is_boolean(exp) || is_character(exp); }
 int is_tagged_list (SExp *exp, const char *tag) {
     return is_pair(exp)
         && is_symbol(exp->pair->car)
-        && (strcmp(tag, exp->pair->car->atom->string_value) == 0);
+        && (strcmp(tag, exp->pair->car->atom->string_value.chars) == 0);
 }
 int is_quoted (SExp *exp) { return is_tagged_list(exp, "quote"); }
 int is_variable (SExp *exp) { return is_symbol(exp) && !is_quoted(exp); }
@@ -454,13 +712,25 @@ int is_true (SExp *exp) { return !is_false(exp); }
 int is_if (SExp *exp) { return is_tagged_list(exp, "if"); }
 int is_application (SExp *exp) { return is_pair(exp); }
 int is_primitive_procedure (SExp *exp) { return exp->type == SEXP_TYPE_PRIMITIVE_PROC; }
-int is_compound_procedure (SExp *exp) { return is_tagged_list(exp, "procedure"); }
+int is_future (SExp *exp) { return exp->type == SEXP_TYPE_FUTURE; }
+int is_promise (SExp *exp) { return exp->type == SEXP_TYPE_PROMISE; }
+int is_port (SExp *exp) { return exp->type == SEXP_TYPE_PORT; }
+int is_eof_object (SExp *exp) { return exp->type == SEXP_TYPE_EOF; }
+int is_compiled_procedure (SExp *exp) { return exp->type == SEXP_TYPE_COMPILED_PROC; }
+int is_error_object (SExp *exp) { return exp->type == SEXP_TYPE_ERROR; }
+int is_compound_procedure (SExp *exp) { return exp->type == SEXP_TYPE_CLOSURE; }
+int is_procedure (SExp *exp) { return is_primitive_procedure(exp) || is_compound_procedure(exp) || is_compiled_procedure(exp); }
 int is_lambda (SExp *exp) { return is_tagged_list(exp, "lambda"); }
 int is_begin (SExp *exp) { return is_tagged_list(exp, "begin"); }
 int is_cond (SExp *exp) { return is_tagged_list(exp, "cond"); }
 int is_let (SExp *exp) { return is_tagged_list(exp, "let"); }
 int is_and (SExp *exp) { return is_tagged_list(exp, "and"); }
 int is_or (SExp *exp) { return is_tagged_list(exp, "or"); }
+int is_guard (SExp *exp) { return is_tagged_list(exp, "guard"); }
+int is_delay (SExp *exp) { return is_tagged_list(exp, "delay"); }
+int is_delay_force (SExp *exp) { return is_tagged_list(exp, "delay-force"); }
+int is_cons_stream (SExp *exp) { return is_tagged_list(exp, "cons-stream"); }
+int is_folded (SExp *exp) { return is_pair(exp) && exp->pair->car == &FOLDED; }
 
 int is_finite (SExp *exp) {
     if (!is_pair(exp)) return 1;
@@ -494,25 +764,23 @@ int is_list (SExp *exp) {
 
 SExp * car (SExp *exp) {
     if (!is_pair(exp)) {
-        printf("Tried to apply car to non-pair: "); print(exp); printf("\n");
-        exit(1);
+        raise_error(current_interp, "car: not a pair", exp);
     }
     return exp->pair->car;
 }
 
 SExp * cdr (SExp *exp) {
     if (!is_pair(exp)) {
-        printf("Tried to apply cdr to non-pair: "); print(exp); printf("\n");
-        exit(1);
+        raise_error(current_interp, "cdr: not a pair", exp);
     }
     return exp->pair->cdr;
 }
 
 SExp *
-cons (SExp *car, SExp *cdr) {
-    SExp *ret = new_sexp();
+cons (Interp *interp, SExp *car, SExp *cdr) {
+    SExp *ret = new_sexp(interp);
     ret->type = SEXP_TYPE_PAIR;
-    ret->pair = new_pair();
+    ret->pair = new_pair(interp);
     ret->pair->car = car;
     ret->pair->cdr = cdr;
     return ret;
@@ -527,272 +795,466 @@ length (SExp *list) {
 }
 
 SExp *
-length_proc (SExp *arguments) {
-    if (length(arguments) != 1) {
-        printf("ERR: wrong number of arguments to length, expected 1");
-        return &NIL;
-    }
-    SExp *list = car(arguments);
+length_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *list = argv[0];
     if (is_pair(list) || is_nil(list)) {
-        return new_number(length(list));
+        return new_number(interp, length(list));
     } else {
-        printf("ERR: length must be applied to a pair\n");
-        return &NIL;
+        return raise_error(interp, "length must be applied to a pair", argv[0]);
     }
 }
 
 SExp *
-print_proc (SExp *args) {
-    if (length(args) != 1) {
-        printf("ERR: wrong number of arguments to length, expected 1");
-        return &NIL;
-    }
-    print(car(args)); printf("\n");
+print_proc (Interp *interp, int argc, SExp **argv) {
+    print(argv[0]); printf("\n");
     return &NIL;
 }
 
 SExp *
-str_to_sym_proc (SExp *args) {
-    if (length(args) != 1 || !is_string(car(args))) {
-        printf("ERR: string->symbol requires a string");
-        return &NIL;
+str_to_sym_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0])) {
+        return raise_error(interp, "string->symbol requires a string", argv[0]);
+    }
+    return lithp_symbol(interp, argv[0]->atom->string_value.chars);
+}
+
+SExp *
+sym_to_str_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_symbol(argv[0])) {
+        return raise_error(interp, "symbol->string requires a symbol", argv[0]);
+    }
+    String *name = &argv[0]->atom->string_value;
+    return new_string(interp, name->chars, name->length);
+}
+
+int
+string_equal (String *a, String *b) {
+    return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+SExp *
+string_length_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0])) {
+        return raise_error(interp, "string-length requires a string", argv[0]);
+    }
+    return new_number(interp, argv[0]->atom->string_value.length);
+}
+
+SExp *
+string_ref_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0]) || !is_number(argv[1])) {
+        return raise_error(interp, "string-ref requires a string and an index", NULL);
+    }
+    String *string = &argv[0]->atom->string_value;
+    long int k = argv[1]->atom->number_value;
+    if (k < 0 || k >= string->length) {
+        return raise_error(interp, "string-ref index out of range", argv[1]);
+    }
+    return new_character(interp, string->chars[k]);
+}
+
+SExp *
+substring_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0]) || !is_number(argv[1]) || (argc == 3 && !is_number(argv[2]))) {
+        return raise_error(interp, "substring requires a string, a start index and an optional end index", NULL);
+    }
+    String *string = &argv[0]->atom->string_value;
+    long int start = argv[1]->atom->number_value;
+    long int end = argc == 3 ? argv[2]->atom->number_value : string->length;
+    if (start < 0 || end > string->length || start > end) {
+        return raise_error(interp, "substring range out of range", cons(interp, argv[1], cons(interp, new_number(interp, end), &NIL)));
+    }
+    return new_string(interp, string->chars + start, end - start);
+}
+
+SExp *
+string_append_proc (Interp *interp, int argc, SExp **argv) {
+    int i;
+    size_t total = 0;
+    for (i = 0; i < argc; i++) {
+        if (!is_string(argv[i])) {
+            return raise_error(interp, "string-append requires strings", argv[i]);
+        }
+        total += argv[i]->atom->string_value.length;
+    }
+
+    // size the result once so this is linear in the total length
+    SExp *ret = new_string(interp, "", 0);
+    string_reserve(interp, &ret->atom->string_value, total + 1);
+    for (i = 0; i < argc; i++) {
+        String *string = &argv[i]->atom->string_value;
+        string_append_chars(interp, &ret->atom->string_value, string->chars, string->length);
+    }
+    return ret;
+}
+
+// (string-append! buf x ...) appends strings and characters to buf in place
+SExp *
+string_append_bang_proc (Interp *interp, int argc, SExp **argv) {
+    int i;
+    if (!is_string(argv[0])) {
+        return raise_error(interp, "string-append! requires a string to append to", argv[0]);
+    }
+    if (in_segment(argv[0]->atom))
+        return raise_error(interp, "string-append! can't change a heap segment", argv[0]);
+    String *buf = &argv[0]->atom->string_value;
+    for (i = 1; i < argc; i++) {
+        SExp *next = argv[i];
+        if (is_string(next)) {
+            string_append_chars(interp, buf, next->atom->string_value.chars, next->atom->string_value.length);
+        } else if (is_character(next)) {
+            string_append_chars(interp, buf, &next->atom->character_value, 1);
+        } else {
+            return raise_error(interp, "string-append! can only append strings and characters", next);
+        }
+    }
+    return argv[0];
+}
+
+SExp *
+make_string_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_number(argv[0]) || (argc == 2 && !is_character(argv[1]))) {
+        return raise_error(interp, "make-string requires a length and an optional fill character", NULL);
+    }
+    long int k = argv[0]->atom->number_value;
+    char fill = argc == 2 ? argv[1]->atom->character_value : ' ';
+    if (k < 0) {
+        return raise_error(interp, "make-string requires a non-negative length", argv[0]);
+    }
+    SExp *ret = new_string(interp, "", 0);
+    String *string = &ret->atom->string_value;
+    string_reserve(interp, string, k + 1);
+    memset(string->chars, fill, k);
+    string->length = k;
+    string->chars[k] = '\0';
+    return ret;
+}
+
+SExp *
+string_eq_proc (Interp *interp, int argc, SExp **argv) {
+    int i;
+    for (i = 0; i < argc; i++) {
+        if (!is_string(argv[i])) {
+            return raise_error(interp, "string=? requires strings", argv[i]);
+        }
+        if (!string_equal(&argv[0]->atom->string_value, &argv[i]->atom->string_value))
+            return &FALSE;
     }
-    return new_symbol(car(args)->atom->string_value);
+    return &TRUE;
+}
+
+SExp *
+num_to_str_proc (Interp *interp, int argc, SExp **argv) {
+    char buf[64];
+    if (!is_number(argv[0]) || (argc == 2 && !is_number(argv[1]))) {
+        return raise_error(interp, "number->string requires a number and an optional radix", NULL);
+    }
+    long int value = argv[0]->atom->number_value;
+    long int radix = argc == 2 ? argv[1]->atom->number_value : 10;
+    if (radix < 2 || radix > 36) {
+        return raise_error(interp, "number->string radix must be between 2 and 36", argv[1]);
+    }
+
+    // build the digits backwards from the end of buf
+    unsigned long int magnitude = value < 0 ? -(unsigned long int)value : value;
+    int i = sizeof(buf);
+    do {
+        buf[--i] = "0123456789abcdefghijklmnopqrstuvwxyz"[magnitude % radix];
+        magnitude /= radix;
+    } while (magnitude > 0);
+    if (value < 0)
+        buf[--i] = '-';
+    return new_string(interp, buf + i, sizeof(buf) - i);
+}
+
+SExp *
+str_to_num_proc (Interp *interp, int argc, SExp **argv) {
+    char *endptr;
+    if (!is_string(argv[0]) || (argc == 2 && !is_number(argv[1]))) {
+        return raise_error(interp, "string->number requires a string and an optional radix", NULL);
+    }
+    String *string = &argv[0]->atom->string_value;
+    long int radix = argc == 2 ? argv[1]->atom->number_value : 10;
+    if (string->length == 0 || radix < 2 || radix > 36)
+        return &FALSE;
+    long int value = strtol(string->chars, &endptr, radix);
+    if (endptr != string->chars + string->length)
+        return &FALSE;
+    return new_number(interp, value);
 }
 
 typedef long int (*num_reducer)(long int acc, long int next);
 
 SExp *
-num_reducer_proc (SExp *arguments, num_reducer fn, long int init) {
+num_reducer_proc (Interp *interp, int argc, SExp **argv, num_reducer fn, long int init) {
+    int i;
     long int result = init;
-    while (!is_nil(arguments)) {
-        if (!is_number(car(arguments))) {
-            printf("ERR: Unexpected non-numeric value "); print(car(arguments)); printf("\n");
-            return &NIL;
+    for (i = 0; i < argc; i++) {
+        if (!is_number(argv[i])) {
+            return raise_error(interp, "unexpected non-numeric value", argv[i]);
         }
-        result = fn(result, car(arguments)->atom->number_value);
-        arguments = cdr(arguments);
+        result = fn(result, argv[i]->atom->number_value);
     }
-    return new_number(result);
+    return new_number(interp, result);
 }
 
 long int add_reducer (long int acc, long int next) { return acc + next; }
-SExp * add_proc (SExp *args) { return num_reducer_proc(args, add_reducer, 0); }
+SExp * add_proc (Interp *interp, int argc, SExp **argv) { return num_reducer_proc(interp, argc, argv, add_reducer, 0); }
 
 long int mult_reducer (long int acc, long int next) { return acc * next; }
-SExp * mult_proc (SExp *args) { return num_reducer_proc(args, mult_reducer, 1); }
+SExp * mult_proc (Interp *interp, int argc, SExp **argv) { return num_reducer_proc(interp, argc, argv, mult_reducer, 1); }
 
 SExp *
-num_comparator_proc (SExp *arguments, num_reducer fn) {
-    if (length(arguments) < 2) {
-        printf("ERR: need at least 2 numbers to compare\n");
-        return &NIL;
-    }
-    long int result = 1;
-    SExp *a, *b;
-    while (!is_nil(cdr(arguments))) {
-        a = car(arguments);
-        b = cadr(arguments);
-        if (!is_number(a) || !is_number(b)) {
-            printf("ERR: Unexpected non-numeric value "); print(car(arguments)); printf("\n");
-            return &NIL;
-        }
-        if (!fn(a->atom->number_value, b->atom->number_value)) {
-            result = 0;
-            break;
+num_comparator_proc (Interp *interp, int argc, SExp **argv, num_reducer fn) {
+    int i;
+    for (i = 0; i < argc; i++) {
+        if (!is_number(argv[i])) {
+            return raise_error(interp, "unexpected non-numeric value", argv[i]);
         }
-        arguments = cdr(arguments);
     }
-    return new_boolean(result);
+    for (i = 0; i + 1 < argc; i++) {
+        if (!fn(argv[i]->atom->number_value, argv[i + 1]->atom->number_value))
+            return &FALSE;
+    }
+    return &TRUE;
 }
 
 long int eq_comparator (long int a, long int b) { return a == b; }
-SExp * num_eq_proc (SExp *args) { return num_comparator_proc(args, eq_comparator); }
+SExp * num_eq_proc (Interp *interp, int argc, SExp **argv) { return num_comparator_proc(interp, argc, argv, eq_comparator); }
 
 long int lt_comparator (long int a, long int b) { return a < b; }
-SExp * lt_proc (SExp *args) { return num_comparator_proc(args, lt_comparator); }
+SExp * lt_proc (Interp *interp, int argc, SExp **argv) { return num_comparator_proc(interp, argc, argv, lt_comparator); }
 
 long int lte_comparator (long int a, long int b) { return a <= b; }
-SExp * lte_proc (SExp *args) { return num_comparator_proc(args, lte_comparator); }
+SExp * lte_proc (Interp *interp, int argc, SExp **argv) { return num_comparator_proc(interp, argc, argv, lte_comparator); }
 
 long int gt_comparator (long int a, long int b) { return a > b; }
-SExp * gt_proc (SExp *args) { return num_comparator_proc(args, gt_comparator); }
+SExp * gt_proc (Interp *interp, int argc, SExp **argv) { return num_comparator_proc(interp, argc, argv, gt_comparator); }
 
 long int gte_comparator (long int a, long int b) { return a >= b; }
-SExp * gte_proc (SExp *args) { return num_comparator_proc(args, gte_comparator); }
+SExp * gte_proc (Interp *interp, int argc, SExp **argv) { return num_comparator_proc(interp, argc, argv, gte_comparator); }
 
 SExp *
-num_binary_op_proc (SExp *args, num_reducer fn) {
-    long int a, b;
-    if (length(args) != 2 || !is_number(car(args)) || !is_number(cadr(args))) {
-        printf("ERR: need exactly 2 numbers\n");
-        return &NIL;
+num_binary_op_proc (Interp *interp, int argc, SExp **argv, num_reducer fn) {
+    if (!is_number(argv[0]) || !is_number(argv[1])) {
+        return raise_error(interp, "need exactly 2 numbers", NULL);
     }
-    a = car(args)->atom->number_value;
-    b = cadr(args)->atom->number_value;
-    return new_number(fn(a, b));
+    if (argv[1]->atom->number_value == 0)
+        return raise_error(interp, "division by zero", argv[0]);
+    return new_number(interp, fn(argv[0]->atom->number_value, argv[1]->atom->number_value));
 }
 
 long int rem_op (long int a, long int b) { return a % b; }
-SExp * remainder_proc (SExp* args) { return num_binary_op_proc(args, rem_op);  }
+SExp * remainder_proc (Interp *interp, int argc, SExp **argv) { return num_binary_op_proc(interp, argc, argv, rem_op);  }
 long int div_op (long int a, long int b) { return a / b; }
-SExp * quotient_proc (SExp* args) { return num_binary_op_proc(args, div_op);  }
+SExp * quotient_proc (Interp *interp, int argc, SExp **argv) { return num_binary_op_proc(interp, argc, argv, div_op);  }
 
 typedef int (*type_predicate) (SExp* exp);
 
 SExp *
-type_wrapper(type_predicate fn, SExp *arguments) {
-    if (length(arguments) != 1) {
-        printf("ERR: Wrong number of arguments to predicate\n");
-        return &NIL;
-    }
-    return new_boolean(fn(car(arguments)));
+type_wrapper(type_predicate fn, SExp **argv) {
+    return new_boolean(fn(argv[0]));
 }
 
-SExp *nil_proc (SExp *args) { return type_wrapper(is_nil, args); }
-SExp *boolean_proc (SExp *args) { return type_wrapper(is_boolean, args); }
-SExp *symbol_proc (SExp *args) { return type_wrapper(is_symbol, args); }
-SExp *number_proc (SExp *args) { return type_wrapper(is_number, args); }
-SExp *character_proc (SExp *args) { return type_wrapper(is_character, args); }
-SExp *pair_proc (SExp *args) { return type_wrapper(is_pair, args); }
-SExp *primitive_procedure_proc (SExp *args) { return type_wrapper(is_primitive_procedure, args); }
-SExp *string_proc (SExp *args) { return type_wrapper(is_string, args); }
-SExp *is_list_proc (SExp *args) { return type_wrapper(is_list, args); }
-SExp *is_finite_proc (SExp *args) { return type_wrapper(is_finite, args); }
+SExp *nil_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_nil, argv); }
+SExp *boolean_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_boolean, argv); }
+SExp *symbol_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_symbol, argv); }
+SExp *number_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_number, argv); }
+SExp *character_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_character, argv); }
+SExp *pair_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_pair, argv); }
+SExp *procedure_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_procedure, argv); }
+SExp *string_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_string, argv); }
+SExp *is_list_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_list, argv); }
+SExp *is_finite_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_finite, argv); }
+SExp *future_pred_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_future, argv); }
+SExp *promise_pred_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_promise, argv); }
+SExp *eof_object_pred_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_eof_object, argv); }
+SExp *error_object_proc (Interp *interp, int argc, SExp **argv) { return type_wrapper(is_error_object, argv); }
 
 SExp *
-cons_proc (SExp *args) {
-    if (length(args) != 2) {
-        printf("ERR: cons requires 2 args\n");
-        return &NIL;
-    }
-    return cons(car(args), cadr(args));
+cons_proc (Interp *interp, int argc, SExp **argv) {
+    return cons(interp, argv[0], argv[1]);
 }
 
 SExp *
-car_proc (SExp *args) {
-    if (length(args) != 1) {
-        printf("ERR: car requires 1 arg\n");
-        return &NIL;
-    }
-    return caar(args);
+car_proc (Interp *interp, int argc, SExp **argv) {
+    return car(argv[0]);
 }
 SExp *
-cdr_proc (SExp *args) {
-    if (length(args) != 1) {
-        printf("ERR: cdr requires 1 arg\n");
-        return &NIL;
-    }
-    return cdar(args);
+cdr_proc (Interp *interp, int argc, SExp **argv) {
+    return cdr(argv[0]);
 }
 SExp *
-set_car_proc (SExp *args) {
-    if (length(args) != 2) {
-        printf("ERR: set-car! requires 2 arg\n");
-        return &NIL;
+set_car_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_pair(argv[0])) {
+        return raise_error(interp, "invalid first argument to set-car!", argv[0]);
     }
-    if (!is_pair(car(args))) {
-        printf("ERR: invalid first argument to set-car!\n");
-        return &NIL;
-    }
-    car(args)->pair->car = cadr(args);
+    if (in_segment(argv[0]->pair))
+        return raise_error(interp, "set-car! can't change a heap segment", argv[0]);
+    argv[0]->pair->car = argv[1];
     return &NIL;
 }
 
 SExp *
-set_cdr_proc (SExp *args) {
-    if (length(args) != 2) {
-        printf("ERR: set-cdr! requires 2 arg\n");
-        return &NIL;
-    }
-    if (!is_pair(car(args))) {
-        printf("ERR: invalid first argument to set-cdr!\n");
-        return &NIL;
+set_cdr_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_pair(argv[0])) {
+        return raise_error(interp, "invalid first argument to set-cdr!", argv[0]);
     }
-    car(args)->pair->cdr = cadr(args);
+    if (in_segment(argv[0]->pair))
+        return raise_error(interp, "set-cdr! can't change a heap segment", argv[0]);
+    argv[0]->pair->cdr = argv[1];
     return &NIL;
 }
 
 SExp *
-list_proc (SExp *args) {
-    return args;
-}
-
-SExp *
-poly_eq_proc (SExp *args) {
-    if (length(args) != 2) {
-        printf("ERR: eq? requires 2 args\n");
-        return &NIL;
+list_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *ret = &NIL;
+    while (argc > 0) {
+        ret = cons(interp, argv[--argc], ret);
     }
-    SExp *a = car(args);
-    SExp *b = cadr(args);
+    return ret;
+}
 
+// Numbers, characters, booleans and the empty list are boxed, but they're
+// values rather than objects, so eq? already compares them by value. That
+// leaves eqv? with nothing of its own to add.
+int
+is_eqv (SExp *a, SExp *b) {
+    if (a == b)
+        return 1;
     if (a->type != b->type)
-        return &FALSE;
+        return 0;
+    if (a->type == SEXP_TYPE_NIL)
+        return 1;
+    if (a->type != SEXP_TYPE_ATOM || a->atom->type != b->atom->type)
+        return 0;
+    switch (a->atom->type) {
+        case ATOM_TYPE_SYMBOL:
+            return a->atom == b->atom;
+        case ATOM_TYPE_NUMBER:
+        case ATOM_TYPE_BOOLEAN:
+            return a->atom->number_value == b->atom->number_value;
+        case ATOM_TYPE_CHARACTER:
+            return a->atom->character_value == b->atom->character_value;
+        default:
+            return 0;
+    }
+}
 
-    if (a->type == SEXP_TYPE_ATOM) {
-        if (a->atom->type != b->atom->type)
-            return &FALSE;
-        switch (a->atom->type) {
-            case ATOM_TYPE_NUMBER:
-            case ATOM_TYPE_BOOLEAN:
-                return new_boolean(a->atom->number_value == b->atom->number_value);
-            case ATOM_TYPE_STRING:
-                return new_boolean(strcmp(a->atom->string_value, b->atom->string_value) == 0);
-            case ATOM_TYPE_CHARACTER:
-                return new_boolean(a->atom->character_value == b->atom->character_value);
-            case ATOM_TYPE_SYMBOL:
-                return new_boolean(a == b);
+// Where the walk down a pair of structures last took a checkpoint. Each car
+// recursion gets its own copy, so every path is checked on its own.
+typedef struct EqualCheckpoint {
+    SExp *a;
+    SExp *b;
+    unsigned long steps;
+    unsigned long limit;
+} EqualCheckpoint;
+
+// Walks cdrs in a loop and recurses only into cars. Cycles are caught with
+// Brent's algorithm: the checkpoint moves forward at every power of two steps,
+// and arriving back at it means the rest of the path repeats what has already
+// been compared.
+int
+is_equal_from (SExp *a, SExp *b, EqualCheckpoint checkpoint) {
+    while (1) {
+        if (is_eqv(a, b))
+            return 1;
+        if (a->type != b->type)
+            return 0;
+        if (a->type == SEXP_TYPE_ATOM) {
+            return a->atom->type == ATOM_TYPE_STRING && b->atom->type == ATOM_TYPE_STRING &&
+                string_equal(&a->atom->string_value, &b->atom->string_value);
         }
-    } else if (a->type == SEXP_TYPE_PRIMITIVE_PROC) {
-        return new_boolean(a->proc == b->proc);
-    } else if (a->type == SEXP_TYPE_PAIR) {
-        SExp *car_list = cons(car(a), cons(car(b), &NIL));
-        SExp *cdr_list = cons(cdr(a), cons(cdr(b), &NIL));
-        if (is_true(poly_eq_proc(car_list))) {
-            return poly_eq_proc(cdr_list);
-        } else {
-            return &FALSE;
+        if (a->type != SEXP_TYPE_PAIR)
+            return 0;
+
+        if (a == checkpoint.a && b == checkpoint.b)
+            return 1;
+        if (++checkpoint.steps == checkpoint.limit) {
+            checkpoint.a = a;
+            checkpoint.b = b;
+            checkpoint.limit *= 2;
         }
+
+        if (!is_equal_from(a->pair->car, b->pair->car, checkpoint))
+            return 0;
+        a = a->pair->cdr;
+        b = b->pair->cdr;
     }
-    return &TRUE;
+}
+
+int
+is_equal (SExp *a, SExp *b) {
+    EqualCheckpoint checkpoint = { NULL, NULL, 0, 1 };
+    return is_equal_from(a, b, checkpoint);
 }
 
 SExp *
-load_proc (SExp* args) {
+eq_proc (Interp *interp, int argc, SExp **argv) {
+    return new_boolean(is_eqv(argv[0], argv[1]));
+}
+
+SExp *
+equal_proc (Interp *interp, int argc, SExp **argv) {
+    return new_boolean(is_equal(argv[0], argv[1]));
+}
+
+// (load filename) runs a file; (load filename 'parallel) parses it with
+// read-all-parallel first
+SExp *
+load_proc (Interp *interp, int argc, SExp **argv) {
     char *filename;
+    FILE *in;
+    SExp *program;
 
-    if (length(args) != 1 || !is_string(car(args))) {
-        printf("ERR: load requires a single filename\n");
+    if (!is_string(argv[0])) {
+        return raise_error(interp, "load requires a single filename", argv[0]);
+    }
+    if (argc > 1) {
+        if (!is_symbol(argv[1]) || strcmp(argv[1]->atom->string_value.chars, "parallel") != 0)
+            return raise_error(interp, "unknown load option", argv[1]);
+        program = cons(interp, new_symbol(interp, "begin"), read_all_parallel(interp, argv[0]));
+        eval(interp, optimize(interp, program), interp->global_env);
         return &NIL;
     }
 
-    filename = car(args)->atom->string_value;
-    load_and_run(filename);
+    filename = argv[0]->atom->string_value.chars;
+    in = fopen(filename, "r");
+    if (in == NULL)
+        return raise_error(interp, "couldn't read file", argv[0]);
+    if (run_program(interp, in, interp->global_env) == NULL)
+        return raise_error(interp, "parser error", argv[0]);
     return &NIL;
 }
 
 SExp *
-apply_primitive_procedure (SExp *procedure, SExp *arguments) {
-    return (procedure->proc)(arguments);
+apply_primitive_procedure (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    Primitive *primitive = procedure->primitive;
+    if (argc < primitive->min_args || (primitive->max_args != VARIADIC && argc > primitive->max_args)) {
+        return raise_error(interp, "wrong number of arguments", new_symbol(interp, primitive->name));
+    }
+    return (primitive->proc)(interp, argc, argv);
 }
 
+// A symbol in a heap segment shares the atom of the interned symbol of its
+// name rather than being it
 int
 is_eq (SExp *a, SExp *b) {
-    return a == b;
+    return a == b || (a->type == SEXP_TYPE_ATOM && a->atom == b->atom);
 }
 
-void
-add_binding_to_frame (SExp *var, SExp *val, SExp *frame) {
-    frame->pair->car = cons(var, car(frame));
-    frame->pair->cdr = cons(val, cdr(frame));
+// The frame at the head of env. Bindings are added by swapping in a new frame,
+// so this is the load that has to synchronize with a concurrent define.
+SExp *
+first_frame (SExp *env) {
+    return __atomic_load_n(&env->pair->car, __ATOMIC_ACQUIRE);
 }
 
 SExp *
-lookup_variable_value (SExp *var, SExp *env) {
+lookup_variable_value (Interp *interp, SExp *var, SExp *env) {
     SExp *frame, *frame_vars, *frame_vals;
     while (!is_nil(env)) {
-        frame = car(env);
+        frame = first_frame(env);
         frame_vars = car(frame);
         frame_vals = cdr(frame);
         while (!is_nil(frame_vars)) {
@@ -804,29 +1266,155 @@ lookup_variable_value (SExp *var, SExp *env) {
         }
         env = cdr(env);
     }
-    printf("Unbound variable: "); print(var); printf("\n");
-    exit(1);
+    return raise_error(interp, "unbound variable", var);
 }
 
+// Returns the pair in the global frame's value list holding var's binding, or
+// NULL if var isn't globally bound
 SExp *
-extend_environment (SExp *vars, SExp *vals, SExp *base_env) {
-    if (length(vars) != length(vals)) {
-        printf("Variables and values must be equal in length: \n"); print(vars); printf("\n"); print(vals); printf("\n");
-        return &NIL;
+lookup_global_cell (Interp *interp, SExp *var) {
+    SExp *frame, *frame_vars, *frame_vals;
+    frame = first_frame(interp->global_env);
+    frame_vars = car(frame);
+    frame_vals = cdr(frame);
+    while (!is_nil(frame_vars)) {
+        if (is_eq(var, car(frame_vars)))
+            return frame_vals;
+        frame_vars = cdr(frame_vars);
+        frame_vals = cdr(frame_vals);
     }
-    return cons(cons(vars, vals), base_env);
+    return NULL;
 }
 
-void
-set_variable (SExp *var, SExp *val, SExp *env) {
-    SExp *frame, *frame_vars, *frame_vals;
-    while (!is_nil(env)) {
-        frame = car(env);
-        frame_vars = car(frame);
-        frame_vals = cdr(frame);
-        while (!is_nil(frame_vars)) {
+// Evaluates the operator of the application exp, going through the call site's
+// inline cache when the operator is a symbol that can only refer to a global
+SExp *
+eval_operator (Interp *interp, SExp *exp, SExp *env) {
+    SExp *operator = car(exp);
+    if (!is_symbol(operator)
+        || __atomic_load_n(&operator->atom->bound_locally, __ATOMIC_RELAXED)
+        || __atomic_load_n(&interp->root->detached_environments, __ATOMIC_RELAXED))
+        return eval(interp, operator, env);
+
+    InlineCache *cache = __atomic_load_n(&exp->pair->cache, __ATOMIC_ACQUIRE);
+    if (cache != NULL)
+        return car(cache->cell);
+
+    SExp *cell = lookup_global_cell(interp, operator);
+    if (cell == NULL)
+        return eval(interp, operator, env);
+    if (in_segment(exp->pair))
+        return car(cell);
+    // threads racing to fill the same site each publish an equivalent entry
+    count_alloc(interp, &interp->memory_stats.inline_caches, sizeof(InlineCache));
+    cache = malloc(sizeof(InlineCache));
+    cache->cell = cell;
+    __atomic_store_n(&exp->pair->cache, cache, __ATOMIC_RELEASE);
+    return car(cell);
+}
+
+SExp *
+extend_environment (Interp *interp, SExp *vars, SExp *vals, SExp *base_env) {
+    SExp *var = vars, *val = vals;
+    while (is_pair(var) && is_pair(val)) {
+        var = cdr(var);
+        val = cdr(val);
+    }
+    if (!is_nil(var) || !is_nil(val)) {
+        return raise_error(interp, "variables and values must be equal in length", cons(interp, vars, cons(interp, vals, &NIL)));
+    }
+    unsigned long start_bytes = interp->bytes_allocated;
+    SExp *env = cons(interp, cons(interp, vars, vals), base_env);
+    count_alloc(interp, &interp->memory_stats.frames, 0);
+    interp->memory_stats.frames.bytes += interp->bytes_allocated - start_bytes;
+    return env;
+}
+
+// A pair of a frame, taken from the interpreter's frame stack if on_stack is
+// set and there's room
+SExp *
+frame_cons (Interp *interp, int on_stack, SExp *car, SExp *cdr) {
+    FrameCell *cell;
+    if (!on_stack)
+        return cons(interp, car, cdr);
+    if (interp->frame_stack == NULL) {
+        interp->frame_stack = mmap(NULL, FRAME_STACK_CELLS * sizeof(FrameCell), PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (interp->frame_stack == MAP_FAILED) {
+            printf("ERR: out of memory\n");
+            exit(1);
+        }
+    }
+    if (interp->frame_top == FRAME_STACK_CELLS)
+        return cons(interp, car, cdr);
+    cell = &interp->frame_stack[interp->frame_top++];
+    cell->sexp.type = SEXP_TYPE_PAIR;
+    cell->sexp.pair = &cell->pair;
+    cell->pair.car = car;
+    cell->pair.cdr = cdr;
+    cell->pair.cache = NULL;
+    return &cell->sexp;
+}
+
+// A new frame on top of base_env binding vars to the values in argv followed by
+// those in vals
+SExp *
+bind_frame (Interp *interp, SExp *vars, int argc, SExp **argv, SExp *vals, SExp *base_env, int on_stack) {
+    unsigned long start_bytes = interp->bytes_allocated;
+    while (argc > 0) {
+        vals = frame_cons(interp, on_stack, argv[--argc], vals);
+    }
+    SExp *env = frame_cons(interp, on_stack, frame_cons(interp, on_stack, vars, vals), base_env);
+    if (!on_stack) {
+        count_alloc(interp, &interp->memory_stats.frames, 0);
+        interp->memory_stats.frames.bytes += interp->bytes_allocated - start_bytes;
+    }
+    return env;
+}
+
+// Binds a closure's parameters to an argument vector in a new frame on top of
+// the environment it closed over. A rest parameter's list is always on the
+// heap, since it's a value the body can keep.
+SExp *
+bind_arguments (Interp *interp, Closure *closure, int argc, SExp **argv, int on_stack) {
+    SExp *rest = &NIL;
+    if (closure->rest ? argc < closure->arity : argc != closure->arity) {
+        return raise_error(interp, "wrong number of arguments", closure->params);
+    }
+    if (!closure->rest)
+        return bind_frame(interp, closure->vars, argc, argv, &NIL, closure->env, on_stack);
+    while (argc > closure->arity)
+        rest = cons(interp, argv[--argc], rest);
+    return bind_frame(interp, closure->vars, argc, argv, frame_cons(interp, on_stack, rest, &NIL), closure->env, on_stack);
+}
+
+// Whether evaluating exp can capture the environment it's evaluated in, by
+// making a procedure or promise or through interaction-environment
+int
+captures_environment (SExp *exp) {
+    if (!is_pair(exp) || is_quoted(exp))
+        return 0;
+    if (is_lambda(exp) || is_delay(exp) || is_delay_force(exp) || is_cons_stream(exp)
+        || is_tagged_list(exp, "interaction-environment")
+        || (is_definition(exp) && is_pair(cdr(exp)) && is_pair(cadr(exp))))
+        return 1;
+    for (; is_pair(exp); exp = cdr(exp)) {
+        if (captures_environment(car(exp)))
+            return 1;
+    }
+    return 0;
+}
+
+void
+set_variable (Interp *interp, SExp *var, SExp *val, SExp *env) {
+    SExp *frame, *frame_vars, *frame_vals;
+    while (!is_nil(env)) {
+        frame = first_frame(env);
+        frame_vars = car(frame);
+        frame_vals = cdr(frame);
+        while (!is_nil(frame_vars)) {
             if (is_eq(var, car(frame_vars))) {
-                frame_vals->pair->car = val;
+                __atomic_store_n(&frame_vals->pair->car, val, __ATOMIC_RELEASE);
                 return;
             }
             frame_vars = cdr(frame_vars);
@@ -834,33 +1422,40 @@ set_variable (SExp *var, SExp *val, SExp *env) {
         }
         env = cdr(env);
     }
-    printf("Unable to set unbound variable "); print(var); printf("\n");
+    raise_error(interp, "unable to set unbound variable", var);
 }
 
+// A new binding goes into a copy of the frame's head that is swapped into env
+// with a compare-and-swap, so readers on other threads always see matching
+// variable and value lists. If another define got in first, look again.
 void
-define_variable (SExp *var, SExp *val, SExp *env) {
-    SExp *frame, *frame_vars, *frame_vals;
-    frame = car(env);
-    frame_vars = car(frame);
-    frame_vals = cdr(frame);
-    while (!is_nil(frame_vars)) {
-        if (is_eq(var, car(frame_vars))) {
-            frame_vals->pair->car = val;
-            return;
-        } else {
-            frame_vars = cdr(frame_vars);
-            frame_vals = cdr(frame_vals);
+define_variable (Interp *interp, SExp *var, SExp *val, SExp *env) {
+    SExp *frame, *frame_vars, *frame_vals, *new_frame;
+    if (env != interp->global_env)
+        __atomic_store_n(&var->atom->bound_locally, 1, __ATOMIC_RELAXED);
+    do {
+        frame = first_frame(env);
+        frame_vars = car(frame);
+        frame_vals = cdr(frame);
+        while (!is_nil(frame_vars)) {
+            if (is_eq(var, car(frame_vars))) {
+                __atomic_store_n(&frame_vals->pair->car, val, __ATOMIC_RELEASE);
+                return;
+            } else {
+                frame_vars = cdr(frame_vars);
+                frame_vals = cdr(frame_vals);
+            }
         }
-    }
-    add_binding_to_frame(var, val, frame);
+        new_frame = cons(interp, cons(interp, var, car(frame)), cons(interp, val, cdr(frame)));
+    } while (!__atomic_compare_exchange_n(&env->pair->car, &frame, new_frame, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 }
 
 SExp *
-eval_assignment (SExp *exp, SExp *env) {
+eval_assignment (Interp *interp, SExp *exp, SExp *env) {
     SExp *variable = cadr(exp);
     SExp *value = caddr(exp);
-    set_variable(variable, eval(value, env), env);
-    return new_symbol("ok");
+    set_variable(interp, variable, eval(interp, value, env), env);
+    return new_symbol(interp, "ok");
 }
 
 SExp *
@@ -873,439 +1468,4366 @@ definition_variable (SExp *exp) {
 }
 
 SExp *
-definition_value (SExp *exp) {
+definition_value (Interp *interp, SExp *exp) {
     if (is_symbol(cadr(exp))) {
         return caddr(exp);
     } else {
         SExp *params = cdadr(exp);
         SExp *body = cddr(exp);
-        SExp *lambda_body = cons(params, body);
-        return cons(new_symbol("lambda"), lambda_body);
+        SExp *lambda_body = cons(interp, params, body);
+        return cons(interp, new_symbol(interp, "lambda"), lambda_body);
     }
 }
 
 SExp *
-eval_definition (SExp *exp, SExp *env) {
-    define_variable(definition_variable(exp), eval(definition_value(exp), env), env);
-    return new_symbol("ok");
+eval_definition (Interp *interp, SExp *exp, SExp *env) {
+    SExp *variable = definition_variable(exp);
+    SExp *value = eval(interp, definition_value(interp, exp), env);
+    if (is_compound_procedure(value) && is_nil(procedure_name(value)))
+        value->closure->name = variable;
+    define_variable(interp, variable, value, env);
+    return new_symbol(interp, "ok");
 }
 
-SExp *
-list_of_values (SExp *exp, SExp *env) {
-    if (is_nil(exp)) {
-        return &NIL;
+// Evaluates each operand of an application into argv, returning the count
+int
+eval_operands (Interp *interp, SExp *operands, SExp *env, SExp **argv) {
+    int argc = 0;
+    while (!is_nil(operands)) {
+        argv[argc++] = eval(interp, car(operands), env);
+        operands = cdr(operands);
     }
-    return cons(eval(car(exp), env), list_of_values(cdr(exp), env));
+    return argc;
 }
 
 SExp *
-eval_sequence (SExp *seq, SExp *env) {
-    SExp *ret;
+eval_sequence (Interp *interp, SExp *seq, SExp *env) {
+    SExp *ret = &NIL;
     while (!is_nil(seq)) {
-        ret = eval(car(seq), env);
+        ret = eval(interp, car(seq), env);
         seq = cdr(seq);
     }
     return ret;
 }
 
+// The proper list of the variables in an improper parameter list
 SExp *
-make_procedure (SExp *exp, SExp *env) {
-    SExp *params = cadr(exp);
-    SExp *body = cddr(exp);
-    return cons(new_symbol("procedure"), cons(params, cons(body, cons(env, &NIL))));
+rest_parameter_vars (Interp *interp, SExp *params) {
+    if (is_symbol(params))
+        return cons(interp, params, &NIL);
+    return cons(interp, car(params), rest_parameter_vars(interp, cdr(params)));
+}
+
+typedef struct ClosureCell {
+    SExp sexp;
+    Closure closure;
+} ClosureCell;
+
+// A rest parameter is the symbol ending an improper parameter list, so
+// (lambda args ...) takes any number of arguments as the list args
+SExp *
+make_procedure (Interp *interp, SExp *exp, SExp *env) {
+    JitState *jit = jit_state(interp, exp);
+    ClosureCell *cell;
+    Closure *closure;
+
+    if (interp->bytes_allocated > interp->bytes_limit
+        && !refill_limit(interp, LIMIT_MEMORY, interp->bytes_allocated - interp->bytes_limit))
+        limit_exceeded(interp, LIMIT_MEMORY);
+    cell = malloc(sizeof(ClosureCell));
+    closure = &cell->closure;
+    interp->cells_allocated++;
+    count_alloc(interp, &interp->memory_stats.procedures, sizeof(ClosureCell));
+    cell->sexp.type = SEXP_TYPE_CLOSURE;
+    cell->sexp.closure = closure;
+    closure->params = cadr(exp);
+    closure->vars = jit->vars;
+    closure->body = cddr(exp);
+    closure->env = env;
+    closure->name = &NIL;
+    closure->arity = jit->arity;
+    closure->rest = jit->rest;
+    closure->escapes = jit->escapes;
+    closure->jit = jit;
+    return &cell->sexp;
+}
+
+// The name a compound procedure was first defined under, or () if anonymous
+SExp *
+procedure_name (SExp *procedure) {
+    return procedure->closure->name;
 }
 
 SExp *
-sequence_to_exp (SExp *seq) {
+sequence_to_exp (Interp *interp, SExp *seq) {
     if (is_nil(seq))
         return seq;
     if (is_nil(cdr(seq)))
         return car(seq);
-    return cons(new_symbol("begin"), seq);
+    return cons(interp, new_symbol(interp, "begin"), seq);
 }
 
 SExp *
-make_if (SExp *predicate, SExp *consequent, SExp *alternative) {
+make_if (Interp *interp, SExp *predicate, SExp *consequent, SExp *alternative) {
     if (alternative == NULL) {
-        return cons(new_symbol("if"), cons(predicate, cons(consequent, &NIL)));
+        return cons(interp, new_symbol(interp, "if"), cons(interp, predicate, cons(interp, consequent, &NIL)));
     } else {
-        return cons(new_symbol("if"), cons(predicate, cons(consequent, cons(alternative, &NIL))));
+        return cons(interp, new_symbol(interp, "if"), cons(interp, predicate, cons(interp, consequent, cons(interp, alternative, &NIL))));
     }
 }
 
 SExp *
-expand_clauses (SExp *clauses) {
+expand_clauses (Interp *interp, SExp *clauses) {
     if (is_nil(clauses))
         return &FALSE;
     SExp *first = car(clauses);
     SExp *rest = cdr(clauses);
     if (is_tagged_list(first, "else")) {
         if (is_nil(rest)) {
-            return sequence_to_exp(cdr(first));
+            return sequence_to_exp(interp, cdr(first));
         } else {
-            printf("ERR: else clause isn't last in cond clauses\n");
-            return &NIL;
+            return raise_error(interp, "else clause isn't last in cond clauses", NULL);
         }
     } else {
         SExp *predicate = car(first);
-        SExp *consequent = sequence_to_exp(cdr(first));
-        SExp *alternative = expand_clauses(rest);
-        return make_if(predicate, consequent, alternative);
+        SExp *consequent = sequence_to_exp(interp, cdr(first));
+        SExp *alternative = expand_clauses(interp, rest);
+        return make_if(interp, predicate, consequent, alternative);
     }
 }
 
 SExp *
-cond_to_if (SExp *exp) {
-    return expand_clauses(cdr(exp));
+cond_to_if (Interp *interp, SExp *exp) {
+    return expand_clauses(interp, cdr(exp));
+}
+
+// The LetState for the let expression exp, kept in the cache of its head pair.
+// A let in a heap segment can't keep one, so it's worked out into scratch.
+LetState *
+let_state (Interp *interp, SExp *exp, LetState *scratch) {
+    LetState *let = __atomic_load_n((LetState **)&exp->pair->cache, __ATOMIC_ACQUIRE);
+    LetState *expected = NULL;
+    SExp *vars = &NIL, **tail = &vars;
+    SExp *bindings;
+    if (let != NULL)
+        return let;
+    for (bindings = cadr(exp); is_pair(bindings); bindings = cdr(bindings)) {
+        if (!is_pair(car(bindings)) || !is_symbol(caar(bindings)) || !is_pair(cdar(bindings)))
+            raise_error(interp, "malformed let binding", car(bindings));
+        __atomic_store_n(&caar(bindings)->atom->bound_locally, 1, __ATOMIC_RELAXED);
+        *tail = cons(interp, caar(bindings), &NIL);
+        tail = &(*tail)->pair->cdr;
+    }
+    if (in_segment(exp->pair)) {
+        let = scratch;
+    } else {
+        let = malloc(sizeof(LetState));
+        if (let == NULL) {
+            printf("ERR: out of memory\n");
+            exit(1);
+        }
+    }
+    let->vars = vars;
+    let->escapes = captures_environment(cddr(exp));
+    if (let == scratch)
+        return let;
+    if (!__atomic_compare_exchange_n((LetState **)&exp->pair->cache, &expected, let, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(let);
+        return expected;
+    }
+    return let;
 }
 
-// SExp transform from:
-//   (let ((var val) ...) <let_body_seq>)
-// to
-//   ((lambda (<let vars>) <let_body_seq>) <let_vals>)
 SExp *
-let_to_lambda (SExp *exp) {
-    // (let (<let_env> (<let_body_seq>)))
-    SExp *let_env = cadr(exp);
-    SExp *let_body_seq = cddr(exp);
+eval_let (Interp *interp, SExp *exp, SExp *env) {
+    LetState scratch, *let = let_state(interp, exp, &scratch);
+    SExp *body = cddr(exp);
+    SExp *bindings, *vals = &NIL, **tail = &vals;
+    int on_stack = !let->escapes;
+    size_t frame_top = interp->frame_top;
+    SExp *ret;
 
-    // separate vars from vals from bindings like ((var val) ...)
-    SExp *let_vars = &NIL;
-    SExp *let_vals = &NIL;
-    while (!is_nil(let_env)) {
-        let_vars = cons(caar(let_env), let_vars);
-        let_vals = cons(cadar(let_env), let_vals);
-        let_env = cdr(let_env);
+    for (bindings = cadr(exp); is_pair(bindings); bindings = cdr(bindings)) {
+        *tail = frame_cons(interp, on_stack, eval(interp, cadar(bindings), env), &NIL);
+        tail = &(*tail)->pair->cdr;
     }
-
-    SExp *lambda_body = cons(let_vars, let_body_seq);
-    SExp *lambda_exp = cons(new_symbol("lambda"), lambda_body);
-    return cons(lambda_exp, let_vals);
+    ret = eval_sequence(interp, body, bind_frame(interp, let->vars, 0, NULL, vals, env, on_stack));
+    interp->frame_top = frame_top;
+    return ret;
 }
 
 // (and a b c) => (if a (if b (if c c)))
 SExp *
-and_to_if (SExp *exp) {
+and_to_if (Interp *interp, SExp *exp) {
     if (is_nil(exp))
         return &TRUE;
     SExp *first = car(exp);
     SExp *rest = cdr(exp);
     if (is_nil(rest)) {
-        return make_if(first, first, NULL);
+        return make_if(interp, first, first, NULL);
     } else {
-        return make_if(first, and_to_if(rest), NULL);
+        return make_if(interp, first, and_to_if(interp, rest), NULL);
     }
 }
 
 // (or a b c) => (if a a (if b b (if c c)))
 SExp *
-or_to_if (SExp *exp) {
+or_to_if (Interp *interp, SExp *exp) {
     if (is_nil(exp))
         return &FALSE;
     SExp *first = car(exp);
     SExp *rest = cdr(exp);
-    return make_if(first, first, or_to_if(rest));
+    return make_if(interp, first, first, or_to_if(interp, rest));
 }
 
 SExp *
-bool_to_if (SExp *exp) {
+bool_to_if (Interp *interp, SExp *exp) {
     if (is_and(exp))
-        return and_to_if(cdr(exp));
+        return and_to_if(interp, cdr(exp));
     else
-        return or_to_if(cdr(exp));
+        return or_to_if(interp, cdr(exp));
 }
 
 SExp *
-apply (SExp *procedure, SExp *arguments) {
-    if (is_primitive_procedure(procedure)) {
-        return apply_primitive_procedure(procedure, arguments);
-    } else if (is_compound_procedure(procedure)) {
-        SExp *params = cadr(procedure);
-        SExp *body = caddr(procedure);
-        SExp *env = cadddr(procedure);
-        return eval_sequence(body, extend_environment(params, arguments, env));
-    }
-    printf("Unknown procedure type in apply: "); print(procedure); printf("\n");
-    exit(1);
+apply (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    SExp *ret;
+    if (--interp->fuel < 0 && !refill_limit(interp, LIMIT_FUEL, -interp->fuel))
+        return limit_exceeded(interp, LIMIT_FUEL);
+    if (++interp->depth > interp->max_depth)
+        return limit_exceeded(interp, LIMIT_DEPTH);
+    if (interp->profiling)
+        ret = profile_apply(interp, procedure, argc, argv);
+    else
+        ret = apply_procedure(interp, procedure, argc, argv);
+    interp->depth--;
+    return ret;
 }
 
-#define tail_call(new_exp, new_env) { exp = new_exp; env = new_env; goto eval_begin; }
+// Calls a closure with its frame on the frame stack, popping it afterwards.
+// Kept apart from apply_procedure so the C stack only grows by this small frame
+// while the body runs.
+SExp *
+apply_on_frame_stack (Interp *interp, Closure *closure, JitState *jit, int argc, SExp **argv) {
+    size_t frame_top = interp->frame_top;
+    SExp *env = bind_arguments(interp, closure, argc, argv, 1);
+    SExp *ret = jit != NULL ? jit->entry(interp, argv, env) : eval_sequence(interp, closure->body, env);
+    interp->frame_top = frame_top;
+    return ret;
+}
 
 SExp *
-eval (SExp *exp, SExp *env) {
-eval_begin:
-    if (is_self_evaluating(exp)) return exp;
-    if (is_variable(exp)) return lookup_variable_value(exp, env);
-    if (is_quoted(exp)) return cadr(exp); // (quote (exp ()))
-    if (is_assignment(exp)) return eval_assignment(exp, env);
-    if (is_definition(exp)) return eval_definition(exp, env);
-    if (is_if(exp)) {
-        SExp *predicate = cadr(exp);
-        SExp *consequent = caddr(exp);
-        SExp *alternative = is_nil(cdddr(exp)) ? &FALSE : cadddr(exp);
-        if (is_true(eval(predicate, env))) {
-            tail_call(consequent, env);
-        } else {
-            tail_call(alternative, env);
-        }
+apply_procedure (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    if (is_primitive_procedure(procedure)) {
+        return apply_primitive_procedure(interp, procedure, argc, argv);
+    } else if (is_compound_procedure(procedure)) {
+        Closure *closure = procedure->closure;
+        JitState *jit = jit_tier_up(interp, closure);
+        // compiled code open-codes calls the profiler would count
+        if (jit != NULL && (argc != jit->n_args || interp->profiling))
+            jit = NULL;
+        if (jit != NULL && !jit->needs_env)
+            return jit->entry(interp, argv, closure->env);
+        if (!closure->escapes)
+            return apply_on_frame_stack(interp, closure, jit, argc, argv);
+        if (jit != NULL)
+            return jit->entry(interp, argv, bind_arguments(interp, closure, argc, argv, 0));
+        return eval_sequence(interp, closure->body, bind_arguments(interp, closure, argc, argv, 0));
+    } else if (is_compiled_procedure(procedure)) {
+        return apply_compiled(interp, procedure, argc, argv);
     }
-    if (is_and(exp) || is_or(exp)) tail_call(bool_to_if(exp), env);
-    if (is_lambda(exp)) return make_procedure(exp, env);
-    if (is_let(exp)) tail_call(let_to_lambda(exp), env);
-    if (is_begin(exp)) return eval_sequence(cdr(exp), env);
-    if (is_cond(exp)) tail_call(cond_to_if(exp), env);
-    if (is_application(exp)) {
-        if (is_tagged_list(exp, "interaction-environment")) {
-            return env;
-        }
+    return raise_error(interp, "not a procedure", procedure);
+}
 
-        SExp *procedure, *arguments;
+// ERRORS
 
-        arguments = list_of_values(cdr(exp), env);
+void
+push_error_handler (Interp *interp, ErrorHandler *handler, SExp *procedure) {
+    handler->procedure = procedure;
+    handler->raised = NULL;
+    handler->parent = interp->handler;
+    handler->saved_current = current_interp;
+    handler->profile_stack = interp->profile_stack;
+    handler->profiling = interp->profiling;
+    handler->frame_top = interp->frame_top;
+    handler->depth = interp->depth;
+    interp->handler = handler;
+    current_interp = interp;
+}
 
-        if (is_tagged_list(exp, "apply")) {
-            procedure = cadr(exp);
-            arguments = cadr(arguments);
-            exp = cons(procedure, arguments);
-            tail_call(cons(procedure, arguments), env);
-        } else if (is_tagged_list(exp, "eval")) {
-            tail_call(car(arguments), cadr(arguments));
-        } else {
-            procedure = eval(car(exp), env);
-        }
+void
+pop_error_handler (Interp *interp, ErrorHandler *handler) {
+    interp->handler = handler->parent;
+    current_interp = handler->saved_current;
+}
 
-        return apply(procedure, arguments);
+// Puts the interpreter back the way it was when handler was installed, closing
+// the profiler frames of the calls being unwound
+void
+unwind_to_handler (Interp *interp, ErrorHandler *handler) {
+    pop_error_handler(interp, handler);
+    interp->profiling = handler->profiling;
+    interp->frame_top = handler->frame_top;
+    interp->depth = handler->depth;
+    while (interp->profile_stack != handler->profile_stack) {
+        interp->profile_stack->entry->active--;
+        interp->profile_stack = interp->profile_stack->parent;
     }
-    printf("ERR: Unknown expression type: "); print(exp); printf("\n");
-    return &NIL;
 }
 
-// MAIN
+SExp *
+new_error_object (Interp *interp, SExp *message, SExp *irritants) {
+    count_alloc(interp, &interp->memory_stats.errors, sizeof(ErrorObject));
+    ErrorObject *error = malloc(sizeof(ErrorObject));
+    error->message = message;
+    error->irritants = irritants;
+    SExp *ret = new_sexp(interp);
+    ret->type = SEXP_TYPE_ERROR;
+    ret->error = error;
+    return ret;
+}
 
 void
-print (SExp *exp) {
-    if (!is_finite(exp)) {
-        printf("(<circular list>)");
-    } else if (is_atom(exp)) {
-        Atom *a = exp->atom;
-        if (is_number(exp)) {
-            printf("%ld", a->number_value);
-        } else if (is_boolean(exp)) {
-            if (a->number_value)
-                printf("#t");
-            else
-                printf("#f");
-        } else if (is_character(exp)) {
-            if (a->character_value == ' ') {
-                printf("#\\space");
-            } else if (a->character_value == '\n') {
-                printf("#\\newline");
-            } else {
-                printf("#\\%c", a->character_value);
-            }
-        } else if (is_string(exp)) {
-            printf("\"%s\"", a->string_value);
-        } else if (is_symbol(exp)) {
-            printf("%s", a->string_value);
-        } else {
-            printf("ERR: Unable to print invalid sexp");
-        }
-    } else if (is_compound_procedure(exp)) {
-        SExp *params = cadr(exp);
-        SExp *body = caddr(exp);
-        printf("(compound-procedure "); print(params); printf(" "); print(body); printf(" '<procedure-env>)");
-    } else if (is_nil(exp)) {
-        printf("()");
-    } else if (is_list(exp)) {
-        printf("(");
-        while (1) {
-            print(car(exp));
-            if (is_nil(cdr(exp))) {
-                printf(")");
-                break;
-            } else {
-                printf(" ");
-            }
-            exp = cdr(exp);
+print_error (FILE *out, SExp *obj) {
+    SExp *irritant;
+    if (is_error_object(obj)) {
+        fprintf(out, "ERR: %s", obj->error->message->atom->string_value.chars);
+        for (irritant = obj->error->irritants; is_pair(irritant); irritant = cdr(irritant)) {
+            fprintf(out, " "); write_sexp(out, car(irritant));
         }
-    } else if (is_pair(exp)) {
-        printf("("); print(exp->pair->car); printf(" . "); print(exp->pair->cdr); printf(")");
-    } else if (is_primitive_procedure(exp)) {
-        printf("#<primitive>");
     } else {
-        printf("ERR: Unable to print invalid sexp");
+        fprintf(out, "ERR: uncaught exception: "); write_sexp(out, obj);
     }
+    fprintf(out, "\n");
 }
 
 SExp *
-new_env () {
-    return extend_environment(&NIL, &NIL, &NIL);
+raise_object (Interp *interp, SExp *obj, int continuable) {
+    ErrorHandler *handler = interp->handler;
+    SExp *ret;
+
+    if (handler == NULL) {
+        print_error(stdout, obj);
+        exit(1);
+    }
+    if (handler->procedure == NULL) {
+        unwind_to_handler(interp, handler);
+        handler->raised = obj;
+        longjmp(handler->jmp, 1);
+    }
+    // a handler procedure runs with only the handlers outside it installed
+    interp->handler = handler->parent;
+    ret = apply(interp, handler->procedure, 1, &obj);
+    if (continuable) {
+        interp->handler = handler;
+        return ret;
+    }
+    return raise_error(interp, "handler returned from non-continuable raise", obj);
 }
 
 SExp *
-new_symbol_table (SExp *env) {
-    return caar(env);
+raise_error (Interp *interp, const char *message, SExp *irritant) {
+    if (interp == NULL || interp->handler == NULL) {
+        // nobody can catch it, so report it and give up
+        printf("ERR: %s", message);
+        if (irritant != NULL) {
+            printf(" "); print(irritant);
+        }
+        printf("\n");
+        exit(1);
+    }
+    SExp *irritants = irritant != NULL ? cons(interp, irritant, &NIL) : &NIL;
+    return raise_object(interp, new_error_object(interp, new_string(interp, message, strlen(message)), irritants), 0);
 }
 
+// (error message irritant ...)
 SExp *
-find_symbol_match (SExp *symbol, SExp *symbol_table) {
-    if (is_nil(symbol_table))
-        return NULL;
-    if (strcmp(symbol->atom->string_value, car(symbol_table)->atom->string_value) == 0)
-        return car(symbol_table);
-    return find_symbol_match(symbol, cdr(symbol_table));
+error_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *irritants = &NIL;
+    if (!is_string(argv[0]))
+        return raise_error(interp, "error requires a message string", argv[0]);
+    while (argc > 1)
+        irritants = cons(interp, argv[--argc], irritants);
+    return raise_object(interp, new_error_object(interp, argv[0], irritants), 0);
 }
 
-// Build a list of the unique symbols present in a given expression
 SExp *
-build_symbol_table (SExp *exp, SExp *symbol_table) {
-    if (is_symbol(exp)) {
-        SExp *existing_symbol = find_symbol_match(exp, symbol_table);
-        if (existing_symbol == NULL) {
-            return cons(exp, symbol_table);
-        }
-    } else if (is_pair(exp)) {
-        symbol_table = build_symbol_table(car(exp), symbol_table);
-        return build_symbol_table(cdr(exp), symbol_table);
-    }
-    return symbol_table;
+raise_proc (Interp *interp, int argc, SExp **argv) {
+    return raise_object(interp, argv[0], 0);
 }
 
-// Deduplicates any unique symbol pointers from the expression tree
 SExp *
-prune_symbols (SExp *exp, SExp *symbol_table) {
-    if (is_symbol(exp)) {
-        SExp *existing_symbol = find_symbol_match(exp, symbol_table);
-        if (existing_symbol != NULL) {
-            return existing_symbol;
-        }
-    } else if (is_pair(exp)) {
-        return cons(prune_symbols(car(exp), symbol_table), prune_symbols(cdr(exp), symbol_table));
-    }
-    return exp;
+raise_continuable_proc (Interp *interp, int argc, SExp **argv) {
+    return raise_object(interp, argv[0], 1);
 }
 
+// (with-exception-handler handler thunk) calls thunk with handler installed
 SExp *
-null_env_proc (SExp *exp) {
-    return new_env();
+with_exception_handler_proc (Interp *interp, int argc, SExp **argv) {
+    ErrorHandler handler;
+    SExp *ret;
+    if (!is_procedure(argv[0]) || !is_procedure(argv[1]))
+        return raise_error(interp, "with-exception-handler requires a handler and a thunk", NULL);
+    push_error_handler(interp, &handler, argv[0]);
+    ret = apply(interp, argv[1], 0, NULL);
+    pop_error_handler(interp, &handler);
+    return ret;
 }
 
 SExp *
-init_scheme_env () {
-    SExp *env = new_env();
+error_object_message_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_error_object(argv[0]))
+        return raise_error(interp, "error-object-message requires an error object", argv[0]);
+    return argv[0]->error->message;
+}
 
-    // list functions
-    define_variable(new_symbol("length"), new_primitive_proc(length_proc), env);
-    define_variable(new_symbol("cons"), new_primitive_proc(cons_proc), env);
-    define_variable(new_symbol("car"), new_primitive_proc(car_proc), env);
-    define_variable(new_symbol("cdr"), new_primitive_proc(cdr_proc), env);
-    define_variable(new_symbol("set-car!"), new_primitive_proc(set_car_proc), env);
-    define_variable(new_symbol("set-cdr!"), new_primitive_proc(set_cdr_proc), env);
-    define_variable(new_symbol("list"), new_primitive_proc(list_proc), env);
+SExp *
+error_object_irritants_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_error_object(argv[0]))
+        return raise_error(interp, "error-object-irritants requires an error object", argv[0]);
+    return argv[0]->error->irritants;
+}
 
-    // integer functions
-    define_variable(new_symbol("+"), new_primitive_proc(add_proc), env);
-    define_variable(new_symbol("*"), new_primitive_proc(mult_proc), env);
-    define_variable(new_symbol("="), new_primitive_proc(num_eq_proc), env);
-    define_variable(new_symbol("<"), new_primitive_proc(lt_proc), env);
-    define_variable(new_symbol("<="), new_primitive_proc(lte_proc), env);
-    define_variable(new_symbol(">"), new_primitive_proc(gt_proc), env);
-    define_variable(new_symbol(">="), new_primitive_proc(gte_proc), env);
-    define_variable(new_symbol("remainder"), new_primitive_proc(remainder_proc), env);
-    define_variable(new_symbol("quotient"), new_primitive_proc(quotient_proc), env);
+// (guard (var clause ...) body ...) evaluates body, and if that raises binds
+// what was raised to var and tries the cond-style clauses in turn. When none
+// of them match it is raised again.
+SExp *
+eval_guard (Interp *interp, SExp *exp, SExp *env) {
+    SExp *var = caadr(exp);
+    SExp *clauses = cdadr(exp);
+    SExp *clause, *value, *ret;
+    ErrorHandler handler;
+
+    if (!is_symbol(var))
+        return raise_error(interp, "guard requires a variable", var);
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) == 0) {
+        ret = eval_sequence(interp, cddr(exp), env);
+        pop_error_handler(interp, &handler);
+        return ret;
+    }
 
-    // type definition functions
-    define_variable(new_symbol("null?"), new_primitive_proc(nil_proc), env);
-    define_variable(new_symbol("boolean?"), new_primitive_proc(boolean_proc), env);
-    define_variable(new_symbol("symbol?"), new_primitive_proc(symbol_proc), env);
-    define_variable(new_symbol("integer?"), new_primitive_proc(number_proc), env);
-    define_variable(new_symbol("character?"), new_primitive_proc(character_proc), env);
-    define_variable(new_symbol("pair?"), new_primitive_proc(pair_proc), env);
-    define_variable(new_symbol("string?"), new_primitive_proc(string_proc), env);
-    define_variable(new_symbol("procedure?"), new_primitive_proc(primitive_procedure_proc), env);
-    define_variable(new_symbol("eq?"), new_primitive_proc(poly_eq_proc), env);
-    define_variable(new_symbol("list?"), new_primitive_proc(is_list_proc), env);
-    define_variable(new_symbol("finite?"), new_primitive_proc(is_finite_proc), env);
-
-    define_variable(new_symbol("string->symbol"), new_primitive_proc(str_to_sym_proc), env);
+    __atomic_store_n(&var->atom->bound_locally, 1, __ATOMIC_RELAXED);
+    env = extend_environment(interp, cons(interp, var, &NIL), cons(interp, handler.raised, &NIL), env);
+    for (; !is_nil(clauses); clauses = cdr(clauses)) {
+        clause = car(clauses);
+        if (is_tagged_list(clause, "else"))
+            return eval_sequence(interp, cdr(clause), env);
+        value = eval(interp, car(clause), env);
+        if (is_false(value))
+            continue;
+        if (is_nil(cdr(clause)))
+            return value;
+        if (is_tagged_list(cdr(clause), "=>")) {
+            SExp *receiver = eval(interp, caddr(clause), env);
+            return apply(interp, receiver, 1, &value);
+        }
+        return eval_sequence(interp, cdr(clause), env);
+    }
+    return raise_object(interp, handler.raised, 0);
+}
 
-    // apply and eval are special, since we'll use tail call elimination to
-    // obviate the need for an actual procedure call
-    define_variable(new_symbol("apply"), new_primitive_proc(NULL), env);
-    define_variable(new_symbol("eval"), new_primitive_proc(NULL), env);
+// LIMITS
 
-    // environment functions
-    define_variable(new_symbol("null-environment"), new_primitive_proc(null_env_proc), env);
-    // interaction-environment requires no proc, since it needs to steal the
-    // current env from eval
-    define_variable(new_symbol("interaction-environment"), new_primitive_proc(NULL), env);
+void
+clear_limits (Interp *interp) {
+    interp->budget = NULL;
+    interp->fuel = LONG_MAX;
+    interp->bytes_limit = ULONG_MAX;
+    interp->max_depth = LONG_MAX;
+}
 
-    // I/O functions
-    define_variable(new_symbol("load"), new_primitive_proc(load_proc), env);
-    define_variable(new_symbol("print"), new_primitive_proc(print_proc), env);
+SExp *
+limit_exceeded (Interp *interp, LimitKind kind) {
+    interp->limit_hit = interp->limit_errors[kind];
+    return raise_object(interp, interp->limit_hit, 0);
+}
 
-    return env;
+void
+make_limit_errors (Interp *interp) {
+    static const char *messages[N_LIMITS] = {
+        [LIMIT_FUEL] = "out of fuel",
+        [LIMIT_MEMORY] = "memory limit exceeded",
+        [LIMIT_DEPTH] = "maximum recursion depth exceeded",
+    };
+    int i;
+
+    for (i = 0; i < N_LIMITS; i++) {
+        if (interp->limit_errors[i] == NULL)
+            interp->limit_errors[i] = new_error_object(interp, new_string(interp, messages[i], strlen(messages[i])), &NIL);
+    }
 }
 
 void
-run_repl () {
-    SExp *program, *result;
+hold_budget (Budget *budget) {
+    if (budget != NULL)
+        __atomic_add_fetch(&budget->refs, 1, __ATOMIC_RELAXED);
+}
 
-    printf("Welcome to Lithp\n");
-    while (1) {
-        printf("> ");
-        program = parser__parse_program(stdin, 1);
-        if (program == NULL)
-            continue;
-        global_symbol_table = build_symbol_table(program, global_symbol_table);
-        program = prune_symbols(program, global_symbol_table);
+void
+release_budget (Budget *budget) {
+    while (budget != NULL && __atomic_sub_fetch(&budget->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        Budget *outer = budget->outer;
+        free(budget);
+        budget = outer;
+    }
+}
 
-        result = eval(program, global_env);
-        if (result == NULL) {
-            printf("ERR: eval returned null\n");
-            exit(1);
-        }
+// Takes up to want of kind out of budget and every budget it's nested in,
+// returning how much it got. Any that has less than need left runs dry.
+long
+budget_take (Budget *budget, LimitKind kind, long need, long want) {
+    long left, got, taken;
+    if (budget == NULL)
+        return want;
+    left = __atomic_load_n(&budget->left[kind], __ATOMIC_RELAXED);
+    do {
+        got = left < want ? left : want;
+    } while (got > 0 && !__atomic_compare_exchange_n(&budget->left[kind], &left, left - got, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (got < need)
+        __atomic_or_fetch(&budget->dry, 1 << kind, __ATOMIC_RELAXED);
+    if (got <= 0)
+        return 0;
+    taken = budget_take(budget->outer, kind, need, got);
+    if (taken < got)
+        __atomic_add_fetch(&budget->left[kind], got - taken, __ATOMIC_RELAXED);
+    return taken;
+}
 
-        print(result); printf("\n");
+// Puts n of kind back into budget and every budget it's nested in
+void
+budget_give (Budget *budget, LimitKind kind, long n) {
+    for (; budget != NULL; budget = budget->outer)
+        __atomic_add_fetch(&budget->left[kind], n, __ATOMIC_RELAXED);
+}
+
+int
+budget_dry (Budget *budget) {
+    for (; budget != NULL; budget = budget->outer) {
+        if (__atomic_load_n(&budget->dry, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+int
+refill_limit (Interp *interp, LimitKind kind, unsigned long need) {
+    long got;
+    if (interp->budget == NULL)
+        return 0;
+    if (kind == LIMIT_FUEL) {
+        got = budget_take(interp->budget, kind, need, need + FUEL_SLICE);
+        interp->fuel += got;
+    } else {
+        got = budget_take(interp->budget, kind, need, need + BYTES_SLICE);
+        interp->bytes_limit += got;
     }
+    return (unsigned long)got >= need;
 }
 
+// Has the interpreter spend out of budget from now on, first putting back
+// what's left of the slices it took from the one before
 void
-load_and_run (char *filename) {
-    SExp *program;
-    FILE *in;
+set_budget (Interp *interp, Budget *budget) {
+    if (interp->fuel > 0)
+        budget_give(interp->budget, LIMIT_FUEL, interp->fuel);
+    if (interp->bytes_limit > interp->bytes_allocated)
+        budget_give(interp->budget, LIMIT_MEMORY, interp->bytes_limit - interp->bytes_allocated);
+    interp->budget = budget;
+    interp->fuel = budget != NULL ? 0 : LONG_MAX;
+    interp->bytes_limit = budget != NULL ? interp->bytes_allocated : ULONG_MAX;
+}
 
-    in = fopen(filename, "r");
+// Holds the interpreter to fuel more calls, bytes more bytes and depth more
+// levels of nesting on top of the limits already set, ignoring any that are
+// negative
+void
+push_limits (Interp *interp, long fuel, long bytes, long depth) {
+    make_limit_errors(interp);
+    if (fuel >= 0 || bytes >= 0) {
+        Budget *budget = malloc(sizeof(Budget));
+        if (budget == NULL) {
+            printf("ERR: out of memory\n");
+            exit(1);
+        }
+        budget->left[LIMIT_FUEL] = fuel >= 0 ? fuel : LONG_MAX;
+        budget->left[LIMIT_MEMORY] = bytes >= 0 ? bytes : LONG_MAX;
+        budget->dry = 0;
+        budget->refs = 1;
+        budget->outer = interp->budget;
+        hold_budget(budget->outer);
+        set_budget(interp, budget);
+    }
+    if (depth >= 0 && depth < interp->max_depth - interp->depth)
+        interp->max_depth = interp->depth + depth;
+}
 
-    if (in == NULL) {
-        printf("ERR: Couldn't read file %s\n", filename);
+// Undoes the budget push_limits set, going back to outer; the caller puts
+// back max_depth
+void
+pop_limits (Interp *interp, Budget *outer) {
+    Budget *budget = interp->budget;
+    if (budget == outer)
         return;
-    }
+    set_budget(interp, outer);
+    release_budget(budget);
+}
 
-    program = parser__parse_program(in, 0);
+long
+limit_arg (Interp *interp, SExp *arg) {
+    if (is_false(arg))
+        return -1;
+    if (!is_number(arg) || arg->atom->number_value < 0)
+        raise_error(interp, "call-with-limits requires limits that are non-negative numbers or #f", arg);
+    return arg->atom->number_value;
+}
 
-    if (program == NULL) {
-        printf("ERR: Parser error for %s\n", filename);
-    } else {
-        global_symbol_table = build_symbol_table(program, global_symbol_table);
-        program = prune_symbols(program, global_symbol_table);
-        eval(program, global_env);
+// (call-with-limits fuel bytes thunk [depth]) calls thunk with at most fuel
+// calls, bytes allocated and, if given, calls nested depth deep; #f means no
+// limit beyond those already set. The fuel and bytes thunk used, and any
+// futures it made, come out of the caller's. Going over a limit raises its
+// error from call-with-limits, even if thunk caught it.
+SExp *
+call_with_limits_proc (Interp *interp, int argc, SExp **argv) {
+    Budget *outer = interp->budget;
+    long saved_max_depth = interp->max_depth;
+    SExp *saved_hit = interp->limit_hit, *hit, *ret = NULL;
+    long fuel, bytes, depth;
+    ErrorHandler handler;
+
+    if (!is_procedure(argv[2]))
+        return raise_error(interp, "call-with-limits requires a thunk", argv[2]);
+    fuel = limit_arg(interp, argv[0]);
+    bytes = limit_arg(interp, argv[1]);
+    depth = argc > 3 ? limit_arg(interp, argv[3]) : -1;
+    push_limits(interp, fuel, bytes, depth);
+    interp->limit_hit = NULL;
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) == 0) {
+        ret = apply(interp, argv[2], 0, NULL);
+        pop_error_handler(interp, &handler);
     }
 
-    fclose(in);
+    pop_limits(interp, outer);
+    interp->max_depth = saved_max_depth;
+    hit = interp->limit_hit;
+    // an outer limit the thunk used up stays hit
+    if (saved_hit == NULL && budget_dry(outer))
+        saved_hit = hit;
+    interp->limit_hit = saved_hit;
+    if (hit != NULL)
+        return raise_object(interp, hit, 0);
+    if (handler.raised != NULL)
+        return raise_object(interp, handler.raised, 0);
+    return ret;
+}
+
+// PROFILER
+
+
+unsigned long long
+monotonic_ns () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t
+profile_slot (ProfileEntry **entries, size_t capacity, const void *key) {
+    size_t i = ((size_t)key >> 4) & (capacity - 1);
+    while (entries[i] != NULL && entries[i]->key != key)
+        i = (i + 1) & (capacity - 1);
+    return i;
 }
 
-int main (int n_args, char **argv) {
-    global_env = init_scheme_env();
-    global_symbol_table = new_symbol_table(global_env);
+void
+profile_grow (Interp *interp) {
+    size_t i, old_capacity = interp->profile_capacity;
+    ProfileEntry **old_entries = interp->profile_entries;
+
+    interp->profile_capacity = old_capacity ? old_capacity * 2 : 256;
+    interp->profile_entries = calloc(interp->profile_capacity, sizeof(ProfileEntry*));
+    for (i = 0; i < old_capacity; i++) {
+        if (old_entries[i] != NULL)
+            interp->profile_entries[profile_slot(interp->profile_entries, interp->profile_capacity, old_entries[i]->key)] = old_entries[i];
+    }
+    free(old_entries);
+}
 
-    // load the prelude for non-C standard procedures
-    load_and_run("prelude.scm");
+// Primitives are keyed by their Primitive and compound procedures by the
+// symbol they were defined under; anonymous procedures share one entry
+ProfileEntry *
+profile_entry (Interp *interp, SExp *procedure) {
+    const void *key;
+    const char *name;
+    size_t i;
 
-    if (n_args == 1) {
-        run_repl();
+    if (is_primitive_procedure(procedure)) {
+        key = procedure->primitive;
+        name = procedure->primitive->name;
+    } else if (is_compound_procedure(procedure) && !is_nil(procedure_name(procedure))) {
+        key = procedure_name(procedure);
+        name = procedure_name(procedure)->atom->string_value.chars;
     } else {
-        load_and_run(argv[1]);
+        key = NULL;
+        name = "#<anonymous>";
     }
-    return 0;
+
+    if (2 * (interp->profile_count + 1) > interp->profile_capacity)
+        profile_grow(interp);
+    i = profile_slot(interp->profile_entries, interp->profile_capacity, key);
+    if (interp->profile_entries[i] == NULL) {
+        interp->profile_entries[i] = calloc(1, sizeof(ProfileEntry));
+        interp->profile_entries[i]->key = key;
+        interp->profile_entries[i]->name = name;
+        interp->profile_count++;
+    }
+    return interp->profile_entries[i];
 }
+
+SExp *
+profile_apply (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    ProfileEntry *entry = profile_entry(interp, procedure);
+    ProfileFrame frame = { interp->profile_stack, entry, 0, 0, 0 };
+    unsigned long start_cells = interp->cells_allocated;
+    unsigned long start_bytes = interp->bytes_allocated;
+    unsigned long long start = monotonic_ns();
+    SExp *ret;
+
+    entry->active++;
+    interp->profile_stack = &frame;
+    ret = apply_procedure(interp, procedure, argc, argv);
+    interp->profile_stack = frame.parent;
+    entry->active--;
+
+    unsigned long long elapsed = monotonic_ns() - start;
+    unsigned long cells = interp->cells_allocated - start_cells;
+    unsigned long bytes = interp->bytes_allocated - start_bytes;
+
+    entry->calls++;
+    if (entry->active == 0)
+        entry->inclusive_ns += elapsed;
+    entry->exclusive_ns += elapsed - frame.child_ns;
+    entry->cells += cells - frame.child_cells;
+    entry->bytes += bytes - frame.child_bytes;
+
+    if (frame.parent != NULL) {
+        frame.parent->child_ns += elapsed;
+        frame.parent->child_cells += cells;
+        frame.parent->child_bytes += bytes;
+    }
+    return ret;
+}
+
+int
+compare_profile_entries (const void *a, const void *b) {
+    const ProfileEntry *x = *(const ProfileEntry **)a;
+    const ProfileEntry *y = *(const ProfileEntry **)b;
+    if (x->exclusive_ns != y->exclusive_ns)
+        return x->exclusive_ns < y->exclusive_ns ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+void
+profile_report (Interp *interp, FILE *out) {
+    size_t i, n = 0;
+    ProfileEntry **sorted = malloc((interp->profile_count + 1) * sizeof(ProfileEntry*));
+
+    for (i = 0; i < interp->profile_capacity; i++) {
+        if (interp->profile_entries[i] != NULL)
+            sorted[n++] = interp->profile_entries[i];
+    }
+    qsort(sorted, n, sizeof(ProfileEntry*), compare_profile_entries);
+
+    fprintf(out, "%10s %12s %12s %12s %14s  %s\n", "calls", "incl ms", "excl ms", "cells", "bytes", "procedure");
+    for (i = 0; i < n; i++) {
+        fprintf(out, "%10lu %12.3f %12.3f %12lu %14lu  %s\n",
+                sorted[i]->calls,
+                sorted[i]->inclusive_ns / 1e6,
+                sorted[i]->exclusive_ns / 1e6,
+                sorted[i]->cells,
+                sorted[i]->bytes,
+                sorted[i]->name);
+    }
+    free(sorted);
+}
+
+void
+profile_reset (Interp *interp) {
+    size_t i;
+    for (i = 0; i < interp->profile_capacity; i++)
+        free(interp->profile_entries[i]);
+    free(interp->profile_entries);
+    interp->profile_entries = NULL;
+    interp->profile_capacity = 0;
+    interp->profile_count = 0;
+}
+
+// (with-profiling thunk) calls thunk with profiling enabled and prints a report
+// of just that call to stderr
+SExp *
+with_profiling_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *ret;
+    if (interp->profiling)
+        return apply(interp, argv[0], 0, NULL);
+
+    profile_reset(interp);
+    interp->profiling = 1;
+    ret = apply(interp, argv[0], 0, NULL);
+    interp->profiling = 0;
+    profile_report(interp, stderr);
+    return ret;
+}
+
+// MEMORY STATS
+
+const char *atom_type_names[N_ATOM_TYPES] = { "number", "boolean", "character", "string", "symbol" };
+
+#define N_MEMORY_COUNTERS (N_ATOM_TYPES + 13)
+
+typedef struct NamedCounter {
+    const char *name;
+    AllocCounter *counter;
+} NamedCounter;
+
+int
+memory_stats_counters (Interp *interp, NamedCounter *counters) {
+    int i, n = 0;
+    counters[n++] = (NamedCounter){ "sexp", &interp->memory_stats.sexps };
+    counters[n++] = (NamedCounter){ "pair", &interp->memory_stats.pairs };
+    for (i = 0; i < N_ATOM_TYPES; i++)
+        counters[n++] = (NamedCounter){ atom_type_names[i], &interp->memory_stats.atoms[i] };
+    counters[n++] = (NamedCounter){ "string-buffer", &interp->memory_stats.string_buffers };
+    counters[n++] = (NamedCounter){ "primitive", &interp->memory_stats.primitives };
+    counters[n++] = (NamedCounter){ "inline-cache", &interp->memory_stats.inline_caches };
+    counters[n++] = (NamedCounter){ "fold-guard", &interp->memory_stats.fold_guards };
+    counters[n++] = (NamedCounter){ "compound-procedure", &interp->memory_stats.procedures };
+    counters[n++] = (NamedCounter){ "frame", &interp->memory_stats.frames };
+    counters[n++] = (NamedCounter){ "future", &interp->memory_stats.futures };
+    counters[n++] = (NamedCounter){ "promise", &interp->memory_stats.promises };
+    counters[n++] = (NamedCounter){ "port", &interp->memory_stats.ports };
+    counters[n++] = (NamedCounter){ "error-object", &interp->memory_stats.errors };
+    counters[n++] = (NamedCounter){ "jit-code", &interp->memory_stats.jit_code };
+    return n;
+}
+
+// One line of name=total/live/bytes fields, so dumps are easy to grep and graph
+void
+print_memory_stats (Interp *interp, FILE *out) {
+    NamedCounter counters[N_MEMORY_COUNTERS];
+    int i, n = memory_stats_counters(interp, counters);
+
+    fprintf(out, "memstats: bytes=%lu", interp->bytes_allocated);
+    for (i = 0; i < n; i++) {
+        fprintf(out, " %s=%lu/%lu/%lu", counters[i].name,
+                counters[i].counter->total, counters[i].counter->live, counters[i].counter->bytes);
+    }
+    fprintf(out, "\n");
+}
+
+void
+maybe_dump_memory_stats (Interp *interp) {
+    unsigned long long now = monotonic_ns();
+    if (now - interp->memory_stats_last_dump_ns >= interp->memory_stats_interval_ns) {
+        interp->memory_stats_last_dump_ns = now;
+        print_memory_stats(interp, stderr);
+    }
+}
+
+void
+init_memory_stats (Interp *interp) {
+    char *interval = getenv("LITHP_MEMSTATS_INTERVAL");
+    if (interval != NULL && atof(interval) > 0) {
+        interp->memory_stats_interval_ns = atof(interval) * 1e9;
+        interp->memory_stats_last_dump_ns = monotonic_ns();
+    }
+}
+
+// (memory-stats) returns an alist of (kind total live bytes) entries
+SExp *
+memory_stats_proc (Interp *interp, int argc, SExp **argv) {
+    NamedCounter counters[N_MEMORY_COUNTERS];
+    AllocCounter snapshot[N_MEMORY_COUNTERS];
+    int i, n = memory_stats_counters(interp, counters);
+    SExp *ret = &NIL;
+
+    // building the result allocates, so copy the counters out first
+    for (i = 0; i < n; i++)
+        snapshot[i] = *counters[i].counter;
+    while (n > 0) {
+        AllocCounter *counter = &snapshot[--n];
+        SExp *entry = cons(interp, new_number(interp, counter->total),
+                           cons(interp, new_number(interp, counter->live),
+                                cons(interp, new_number(interp, counter->bytes), &NIL)));
+        ret = cons(interp, cons(interp, new_symbol(interp, counters[n].name), entry), ret);
+    }
+    return ret;
+}
+
+// FUTURES
+
+void
+work_queue_init (WorkQueue *queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->futures = NULL;
+    queue->head = queue->tail = queue->capacity = 0;
+}
+
+void
+work_queue_push (WorkQueue *queue, Future *future) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail - queue->head == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        Future **futures = malloc(capacity * sizeof(Future*));
+        size_t i;
+        for (i = queue->head; i < queue->tail; i++)
+            futures[i % capacity] = queue->futures[i % queue->capacity];
+        free(queue->futures);
+        queue->futures = futures;
+        queue->capacity = capacity;
+    }
+    queue->futures[queue->tail++ % queue->capacity] = future;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Takes the oldest future if from_head, otherwise the newest
+Future *
+work_queue_take (WorkQueue *queue, int from_head) {
+    Future *future = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head != queue->tail) {
+        if (from_head)
+            future = queue->futures[queue->head++ % queue->capacity];
+        else
+            future = queue->futures[--queue->tail % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return future;
+}
+
+Future *
+new_future (Interp *interp, SExp *procedure, SExp **args, SExp **results, int count) {
+    count_alloc(interp, &interp->memory_stats.futures, sizeof(Future));
+    Future *future = malloc(sizeof(Future));
+    future->procedure = procedure;
+    future->args = args;
+    future->results = results != NULL ? results : &future->value;
+    future->count = count;
+    future->value = &NIL;
+    future->error = NULL;
+    future->budget = interp->budget;
+    hold_budget(future->budget);
+    future->depth = interp->max_depth != LONG_MAX ? interp->max_depth - interp->depth : -1;
+    future->state = FUTURE_PENDING;
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->done, NULL);
+    return future;
+}
+
+// Runs future on the calling thread, unless another thread has already
+// claimed it. Returns whether it ran here. Anything raised is kept for
+// whoever touches it. Whichever thread runs it, it's held to the limits of
+// the thread that made it.
+int
+run_future (Interp *interp, Future *future) {
+    int pending = FUTURE_PENDING;
+    Budget *saved_budget = interp->budget;
+    long saved_max_depth = interp->max_depth;
+    SExp *saved_hit = interp->limit_hit;
+    ErrorHandler handler;
+    int i;
+    if (!__atomic_compare_exchange_n(&future->state, &pending, FUTURE_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    if (future->budget != NULL || future->depth >= 0)
+        make_limit_errors(interp);
+    set_budget(interp, future->budget);
+    interp->max_depth = future->depth >= 0 ? interp->depth + future->depth : LONG_MAX;
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) == 0) {
+        for (i = 0; i < future->count; i++) {
+            if (future->args == NULL)
+                future->results[i] = apply(interp, future->procedure, 0, NULL);
+            else
+                future->results[i] = apply(interp, future->procedure, 1, &future->args[i]);
+        }
+        pop_error_handler(interp, &handler);
+    } else {
+        future->error = handler.raised;
+    }
+    set_budget(interp, saved_budget);
+    interp->max_depth = saved_max_depth;
+    interp->limit_hit = saved_hit;
+    release_budget(future->budget);
+    pthread_mutex_lock(&future->lock);
+    __atomic_store_n(&future->state, FUTURE_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&future->done);
+    pthread_mutex_unlock(&future->lock);
+    return 1;
+}
+
+// Waits for future to finish, running it here if nobody has started it. A
+// touched future is then always either done or running on a thread that is
+// making progress, so touching can't starve the pool.
+void
+touch_future (Interp *interp, Future *future) {
+    if (__atomic_load_n(&future->state, __ATOMIC_ACQUIRE) == FUTURE_DONE)
+        return;
+    if (run_future(interp, future))
+        return;
+    pthread_mutex_lock(&future->lock);
+    while (__atomic_load_n(&future->state, __ATOMIC_ACQUIRE) != FUTURE_DONE)
+        pthread_cond_wait(&future->done, &future->lock);
+    pthread_mutex_unlock(&future->lock);
+}
+
+// A worker's own newest future, then anything submitted from outside the pool,
+// then the oldest future of each of the other workers in turn
+Future *
+find_work (Worker *worker) {
+    WorkerPool *pool = worker->pool;
+    int start = worker - pool->workers;
+    int i;
+    Future *future = work_queue_take(&worker->queue, 0);
+    if (future == NULL)
+        future = work_queue_take(&pool->injected, 1);
+    for (i = 1; future == NULL && i < pool->n_workers; i++)
+        future = work_queue_take(&pool->workers[(start + i) % pool->n_workers].queue, 1);
+    if (future != NULL)
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    return future;
+}
+
+void *
+worker_main (void *arg) {
+    Worker *worker = arg;
+    WorkerPool *pool = worker->pool;
+    while (1) {
+        Future *future = find_work(worker);
+        if (future != NULL) {
+            // futures touched before a worker got to them are skipped here
+            run_future(worker->interp, future);
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) <= 0)
+            pthread_cond_wait(&pool->work_available, &pool->idle_lock);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+WorkerPool *
+new_worker_pool (Interp *root) {
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    char *workers = getenv("LITHP_WORKERS");
+    long n_workers = workers != NULL ? atol(workers) : sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+    int i;
+
+    pool->n_workers = n_workers > 0 ? n_workers : 1;
+    pool->workers = calloc(pool->n_workers, sizeof(Worker));
+    work_queue_init(&pool->injected);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+
+    // workers steal from each other, so every queue exists before any starts
+    for (i = 0; i < pool->n_workers; i++) {
+        Worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->interp = new_child_interp(root);
+        worker->interp->worker = worker;
+        work_queue_init(&worker->queue);
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    for (i = 0; i < pool->n_workers; i++) {
+        Worker *worker = &pool->workers[i];
+        if (pthread_create(&worker->thread, &attr, worker_main, worker) != 0) {
+            printf("ERR: couldn't start worker thread\n");
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return pool;
+}
+
+WorkerPool *
+worker_pool (Interp *interp) {
+    Interp *root = interp->root;
+    if (root->pool == NULL)
+        root->pool = new_worker_pool(root);
+    return root->pool;
+}
+
+// Workers push onto their own deque; everyone else goes through the pool's
+void
+submit_future (Interp *interp, Future *future) {
+    WorkerPool *pool = worker_pool(interp);
+    work_queue_push(interp->worker != NULL ? &interp->worker->queue : &pool->injected, future);
+    pthread_mutex_lock(&pool->idle_lock);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// (future thunk) starts calling thunk on the worker pool
+SExp *
+future_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_procedure(argv[0])) {
+        return raise_error(interp, "future requires a procedure", argv[0]);
+    }
+    Future *future = new_future(interp, argv[0], NULL, NULL, 1);
+    submit_future(interp, future);
+    SExp *ret = new_sexp(interp);
+    ret->type = SEXP_TYPE_FUTURE;
+    ret->future = future;
+    return ret;
+}
+
+// (touch f) waits for the future f and returns its value; anything else is
+// returned as is
+SExp *
+touch_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_future(argv[0]))
+        return argv[0];
+    touch_future(interp, argv[0]->future);
+    if (argv[0]->future->error != NULL)
+        return raise_object(interp, argv[0]->future->error, 0);
+    return argv[0]->future->value;
+}
+
+// (pmap f list) maps f over list on the worker pool. The calling thread works
+// through the chunks too as it waits for them in order.
+SExp *
+pmap_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *procedure = argv[0], *list = argv[1], *ret = &NIL;
+    if (!is_procedure(procedure)) {
+        return raise_error(interp, "pmap requires a procedure", procedure);
+    }
+    if (!is_list(list)) {
+        return raise_error(interp, "pmap requires a list", list);
+    }
+    int n = length(list);
+    if (n == 0)
+        return &NIL;
+
+    WorkerPool *pool = worker_pool(interp);
+    int n_chunks = pool->n_workers * PMAP_CHUNKS_PER_WORKER;
+    if (n_chunks > n)
+        n_chunks = n;
+    SExp **args = malloc(2 * n * sizeof(SExp*));
+    SExp **results = args + n;
+    // chunks may still sit in a queue after they've been touched, so unlike
+    // args and results they're never freed
+    Future **chunks = malloc(n_chunks * sizeof(Future*));
+    SExp *error = NULL;
+    int i;
+
+    for (i = 0; i < n; i++, list = cdr(list))
+        args[i] = car(list);
+    for (i = 0; i < n_chunks; i++) {
+        int start = (long)n * i / n_chunks;
+        int end = (long)n * (i + 1) / n_chunks;
+        chunks[i] = new_future(interp, procedure, args + start, results + start, end - start);
+        submit_future(interp, chunks[i]);
+    }
+    for (i = 0; i < n_chunks; i++) {
+        touch_future(interp, chunks[i]);
+        if (error == NULL)
+            error = chunks[i]->error;
+    }
+    if (error == NULL) {
+        while (n > 0)
+            ret = cons(interp, results[--n], ret);
+    }
+
+    free(chunks);
+    free(args);
+    if (error != NULL)
+        return raise_object(interp, error, 0);
+    return ret;
+}
+
+// PARALLEL READER
+// A file of many top-level forms is split into chunks of whole forms, which
+// are parsed on the worker pool and joined back together in file order
+
+// Splits the n bytes of text into at most max_chunks runs of whole top-level
+// forms of about the same size, storing where each ends in ends. Cuts are made
+// after newlines outside any form, string or comment. Returns the number of
+// chunks.
+int
+split_top_level_forms (const char *text, size_t n, size_t *ends, int max_chunks) {
+    const char *p = text, *end = text + n;
+    size_t target = n / max_chunks;
+    int depth = 0, n_chunks = 0;
+
+    while ((p = scan_for(p, end, SCAN_STRUCTURE)) < end) {
+        switch (*p++) {
+            case '(':
+                depth++;
+                break;
+            case ')':
+                depth--;
+                break;
+            case '"':
+                while ((p = scan_for(p, end, SCAN_STRING)) < end && *p++ == '\\' && p < end)
+                    p++;
+                break;
+            case '\\':
+                // the character of a literal like #\(
+                if (p < end)
+                    p++;
+                break;
+            case ';':
+                // only a comment at the start of a token
+                if (p - 1 == text || is_delim(p[-2]))
+                    p = scan_for(p, end, SCAN_NEWLINE);
+                break;
+            case '\n':
+                if (depth == 0 && n_chunks < max_chunks - 1 && (size_t)(p - text) >= target * (n_chunks + 1))
+                    ends[n_chunks++] = p - text;
+                break;
+        }
+    }
+    ends[n_chunks++] = n;
+    return n_chunks;
+}
+
+// Parses a chunk of source, returning its forms with their symbols interned
+SExp *
+read_chunk_proc (Interp *interp, int argc, SExp **argv) {
+    String *source = &argv[0]->atom->string_value;
+    FILE *in = fmemopen(source->chars, source->length, "r");
+    SExp *program;
+
+    if (in == NULL)
+        return raise_error(interp, "couldn't read chunk", NULL);
+    program = parse_and_close(interp, in);
+    if (program == NULL)
+        return raise_error(interp, "parser error", NULL);
+    // skip the begin the parser wraps the forms in
+    return intern_symbols(interp, cdr(program));
+}
+
+SExp *
+read_all_parallel (Interp *interp, SExp *filename) {
+    int fd = open(filename->atom->string_value.chars, O_RDONLY);
+    struct stat st;
+    char *text;
+    size_t *ends;
+    int max_chunks, n_chunks, i;
+    SExp *chunks = &NIL, *chunk, *forms = &NIL, *last = NULL;
+    SExp *args[2];
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return raise_error(interp, "couldn't read file", filename);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return &NIL;
+    }
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+        return raise_error(interp, "couldn't read file", filename);
+
+    max_chunks = worker_pool(interp)->n_workers * PMAP_CHUNKS_PER_WORKER;
+    if (max_chunks > st.st_size / PARALLEL_READ_MIN_CHUNK + 1)
+        max_chunks = st.st_size / PARALLEL_READ_MIN_CHUNK + 1;
+    ends = malloc(max_chunks * sizeof(size_t));
+    n_chunks = split_top_level_forms(text, st.st_size, ends, max_chunks);
+    for (i = n_chunks - 1; i >= 0; i--) {
+        size_t start = i > 0 ? ends[i - 1] : 0;
+        chunks = cons(interp, new_string(interp, text + start, ends[i] - start), chunks);
+    }
+    free(ends);
+    munmap(text, st.st_size);
+
+    args[0] = new_primitive_proc(interp, "read-all-parallel", read_chunk_proc, 1, 1);
+    args[1] = chunks;
+    chunks = pmap_proc(interp, 2, args);
+
+    // the chunks' lists are fresh from the parser, so they're joined in place
+    for (chunk = chunks; !is_nil(chunk); chunk = cdr(chunk)) {
+        if (is_nil(car(chunk)))
+            continue;
+        if (last == NULL)
+            forms = car(chunk);
+        else
+            last->pair->cdr = car(chunk);
+        for (last = car(chunk); !is_nil(cdr(last)); last = cdr(last))
+            ;
+    }
+    return forms;
+}
+
+// (read-all-parallel filename) returns a list of the top-level forms in the
+// file, read on the worker pool
+SExp *
+read_all_parallel_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0]))
+        return raise_error(interp, "read-all-parallel requires a filename", argv[0]);
+    return read_all_parallel(interp, argv[0]);
+}
+
+// (apply proc args) spreads the list args into an argument vector. It's run
+// inline, so spends fuel like the apply of the primitive it stands in for.
+SExp *
+apply_list (Interp *interp, SExp *procedure, SExp *arguments) {
+    SExp *ret;
+    SExp *argv_buf[MAX_INLINE_ARGS];
+    SExp **argv = argv_buf;
+    int argc = 0;
+    int n_args = length(arguments);
+
+    if (--interp->fuel < 0 && !refill_limit(interp, LIMIT_FUEL, -interp->fuel))
+        return limit_exceeded(interp, LIMIT_FUEL);
+    if (n_args > MAX_INLINE_ARGS)
+        argv = malloc(n_args * sizeof(SExp*));
+    while (!is_nil(arguments)) {
+        argv[argc++] = car(arguments);
+        arguments = cdr(arguments);
+    }
+    ret = apply(interp, procedure, argc, argv);
+    if (argv != argv_buf)
+        free(argv);
+    return ret;
+}
+
+#define tail_call(new_exp, new_env) { exp = new_exp; env = new_env; goto eval_begin; }
+
+// Runs a call to an open-coded primitive without going through apply. The
+// common cases are computed here; anything else, like a type error, is left
+// to the primitive itself. Returns NULL without evaluating anything if the
+// call doesn't have the operand count the inline version handles.
+SExp *
+eval_open_coded (Interp *interp, SExp *procedure, SExp *operands, SExp *env) {
+    Primitive *primitive = procedure->primitive;
+    int argc = primitive->open_coded == OPEN_CODED_CONS || primitive->open_coded == OPEN_CODED_ADD
+        || primitive->open_coded == OPEN_CODED_NUM_EQ || primitive->open_coded == OPEN_CODED_LT ? 2 : 1;
+    SExp *argv[2];
+
+    if (!is_pair(operands) || (argc == 1 ? !is_nil(cdr(operands)) : !is_pair(cdr(operands)) || !is_nil(cddr(operands))))
+        return NULL;
+    argv[0] = eval(interp, car(operands), env);
+    if (argc == 2)
+        argv[1] = eval(interp, cadr(operands), env);
+
+    switch (primitive->open_coded) {
+        case OPEN_CODED_CAR:
+            if (is_pair(argv[0]))
+                return argv[0]->pair->car;
+            break;
+        case OPEN_CODED_CDR:
+            if (is_pair(argv[0]))
+                return argv[0]->pair->cdr;
+            break;
+        case OPEN_CODED_CONS:
+            return cons(interp, argv[0], argv[1]);
+        case OPEN_CODED_ADD:
+            if (is_number(argv[0]) && is_number(argv[1]))
+                return new_number(interp, argv[0]->atom->number_value + argv[1]->atom->number_value);
+            break;
+        case OPEN_CODED_NUM_EQ:
+            if (is_number(argv[0]) && is_number(argv[1]))
+                return new_boolean(argv[0]->atom->number_value == argv[1]->atom->number_value);
+            break;
+        case OPEN_CODED_LT:
+            if (is_number(argv[0]) && is_number(argv[1]))
+                return new_boolean(argv[0]->atom->number_value < argv[1]->atom->number_value);
+            break;
+        case OPEN_CODED_NULL:
+            return new_boolean(is_nil(argv[0]));
+        case OPEN_CODED_PAIR:
+            return new_boolean(is_pair(argv[0]));
+        default:
+            break;
+    }
+    return (primitive->proc)(interp, argc, argv);
+}
+
+SExp *
+eval (Interp *interp, SExp *exp, SExp *env) {
+eval_begin:
+    if (is_self_evaluating(exp)) return exp;
+    if (is_variable(exp)) return lookup_variable_value(interp, exp, env);
+    if (is_quoted(exp)) return cadr(exp); // (quote (exp ()))
+    if (is_assignment(exp)) return eval_assignment(interp, exp, env);
+    if (is_definition(exp)) return eval_definition(interp, exp, env);
+    if (is_if(exp)) {
+        SExp *predicate = cadr(exp);
+        SExp *consequent = caddr(exp);
+        SExp *alternative = is_nil(cdddr(exp)) ? &FALSE : cadddr(exp);
+        if (is_true(eval(interp, predicate, env))) {
+            tail_call(consequent, env);
+        } else {
+            tail_call(alternative, env);
+        }
+    }
+    if (is_and(exp) || is_or(exp)) tail_call(bool_to_if(interp, exp), env);
+    if (is_lambda(exp)) return make_procedure(interp, exp, env);
+    if (is_let(exp)) return eval_let(interp, exp, env);
+    if (is_begin(exp)) return eval_sequence(interp, cdr(exp), env);
+    if (is_cond(exp)) tail_call(cond_to_if(interp, exp), env);
+    if (is_guard(exp)) return eval_guard(interp, exp, env);
+    if (is_delay(exp) || is_delay_force(exp)) {
+        if (!is_pair(cdr(exp)))
+            return raise_error(interp, "delay requires an expression", exp);
+        return new_promise(interp, cadr(exp), env, NULL, is_delay_force(exp));
+    }
+    if (is_cons_stream(exp)) {
+        if (!is_pair(cdr(exp)) || !is_pair(cddr(exp)))
+            return raise_error(interp, "cons-stream requires two expressions", exp);
+        return cons(interp, eval(interp, cadr(exp), env), new_promise(interp, caddr(exp), env, NULL, 0));
+    }
+    if (is_folded(exp)) tail_call(folds_hold(exp) ? cadr(exp) : caddr(exp), env);
+    if (is_application(exp)) {
+        if (is_tagged_list(exp, "interaction-environment")) {
+            return env;
+        }
+
+        SExp *procedure, *ret;
+        SExp *argv_buf[MAX_INLINE_ARGS];
+        SExp **argv = argv_buf;
+        int argc = length(cdr(exp));
+
+        if (is_tagged_list(exp, "apply") || is_tagged_list(exp, "eval")) {
+            if (argc != 2)
+                return raise_error(interp, "wrong number of arguments", car(exp));
+            eval_operands(interp, cdr(exp), env, argv);
+            if (is_tagged_list(exp, "eval")) {
+                // a loop of evals makes no applies, so each spends fuel here
+                if (--interp->fuel < 0 && !refill_limit(interp, LIMIT_FUEL, -interp->fuel))
+                    return limit_exceeded(interp, LIMIT_FUEL);
+                tail_call(argv[0], argv[1]);
+            }
+            return apply_list(interp, argv[0], argv[1]);
+        }
+
+        // the operator goes first so open-coded calls can skip building argv
+        procedure = eval_operator(interp, exp, env);
+        if (is_primitive_procedure(procedure) && procedure->primitive->open_coded != OPEN_CODED_NONE
+            && !interp->profiling && (ret = eval_open_coded(interp, procedure, cdr(exp), env)) != NULL)
+            return ret;
+
+        if (argc > MAX_INLINE_ARGS)
+            argv = malloc(argc * sizeof(SExp*));
+        eval_operands(interp, cdr(exp), env, argv);
+        ret = apply(interp, procedure, argc, argv);
+        if (argv != argv_buf)
+            free(argv);
+        return ret;
+    }
+    return raise_error(interp, "unknown expression type", exp);
+}
+
+// OPTIMIZER
+// A pass over each parsed program before it's evaluated. Calls to pure
+// primitives on constant arguments are replaced by their results, if, cond,
+// and and or drop branches that a constant test rules out, and let bindings to
+// constants that are never assigned are substituted into the let body.
+//
+// A call is only folded when its operator names a pure primitive in the global
+// environment that no program seen so far binds or assigns anywhere. A later
+// program can still redefine it, so the result is kept as a folded expression
+// that falls back to the call once the global no longer holds the primitive.
+// An if whose test was folded is pruned the same way; cond, and, or and let
+// only use plain literals.
+
+int
+is_literal (SExp *exp) {
+    return is_self_evaluating(exp) || (is_quoted(exp) && is_pair(cdr(exp)));
+}
+
+SExp *
+literal_value (SExp *exp) {
+    return is_quoted(exp) ? cadr(exp) : exp;
+}
+
+SExp *
+make_literal (Interp *interp, SExp *value) {
+    if (is_self_evaluating(value))
+        return value;
+    return cons(interp, new_symbol(interp, "quote"), cons(interp, value, &NIL));
+}
+
+// Adds a cell to the ones guard checks, returning 0 if it's full
+int
+add_fold_cell (FoldGuard *guard, SExp *symbol, SExp *cell, SExp *procedure) {
+    int i;
+
+    for (i = 0; i < guard->n_cells; i++) {
+        if (guard->cells[i] == cell)
+            return 1;
+    }
+    if (guard->n_cells == FOLD_MAX_CELLS)
+        return 0;
+    guard->symbols[guard->n_cells] = symbol;
+    guard->cells[guard->n_cells] = cell;
+    guard->procedures[guard->n_cells] = procedure;
+    guard->n_cells++;
+    return 1;
+}
+
+SExp *
+make_folded (Interp *interp, SExp *optimized, SExp *original, FoldGuard *guard) {
+    SExp *ret = cons(interp, &FOLDED, cons(interp, optimized, cons(interp, original, &NIL)));
+    FoldGuard *copy = malloc(sizeof(FoldGuard));
+
+    count_alloc(interp, &interp->memory_stats.fold_guards, sizeof(FoldGuard));
+    *copy = *guard;
+    ret->pair->cache = copy;
+    return ret;
+}
+
+// Whether every global the folded expression exp assumed still holds the same
+// primitive
+int
+folds_hold (SExp *exp) {
+    FoldGuard *guard = exp->pair->cache;
+    int i;
+
+    for (i = 0; i < guard->n_cells; i++) {
+        if (car(guard->cells[i]) != guard->procedures[i])
+            return 0;
+    }
+    return 1;
+}
+
+// The value of a literal, or of a folded expression that reduced to one, or
+// NULL
+SExp *
+folded_value (SExp *exp) {
+    if (is_literal(exp))
+        return literal_value(exp);
+    if (is_folded(exp) && is_literal(cadr(exp)))
+        return literal_value(cadr(exp));
+    return NULL;
+}
+
+void
+mark_rebound (SExp *var) {
+    if (is_symbol(var))
+        var->atom->rebound = 1;
+}
+
+void
+mark_rebound_params (SExp *params) {
+    for (; is_pair(params); params = cdr(params))
+        mark_rebound(car(params));
+    mark_rebound(params);
+}
+
+// Marks every name that exp binds or assigns anywhere
+void
+mark_rebound_names (SExp *exp) {
+    SExp *binding;
+
+    if (!is_pair(exp) || is_quoted(exp))
+        return;
+    if ((is_definition(exp) || is_assignment(exp) || is_lambda(exp)) && is_pair(cdr(exp))) {
+        if (is_pair(cadr(exp)))
+            mark_rebound_params(cadr(exp));
+        else
+            mark_rebound(cadr(exp));
+    } else if ((is_let(exp) || is_guard(exp)) && is_pair(cdr(exp))) {
+        for (binding = cadr(exp); is_pair(binding); binding = cdr(binding)) {
+            if (is_pair(car(binding)))
+                mark_rebound(caar(binding));
+            else
+                mark_rebound(car(binding));
+        }
+    }
+    for (; is_pair(exp); exp = cdr(exp))
+        mark_rebound_names(car(exp));
+}
+
+// Whether exp, outside of quoted data, contains a set! or define of var
+int
+is_assigned_in (SExp *exp, SExp *var) {
+    if (!is_pair(exp) || is_quoted(exp))
+        return 0;
+    if ((is_assignment(exp) && is_pair(cdr(exp)) && cadr(exp) == var)
+        || (is_definition(exp) && is_pair(cdr(exp)) && definition_variable(exp) == var))
+        return 1;
+    for (; is_pair(exp); exp = cdr(exp)) {
+        if (is_assigned_in(car(exp), var))
+            return 1;
+    }
+    return 0;
+}
+
+int
+uses_interaction_environment (SExp *exp) {
+    if (!is_pair(exp) || is_quoted(exp))
+        return 0;
+    if (is_tagged_list(exp, "interaction-environment"))
+        return 1;
+    for (; is_pair(exp); exp = cdr(exp)) {
+        if (uses_interaction_environment(car(exp)))
+            return 1;
+    }
+    return 0;
+}
+
+// Whether body defines anything in its own frame
+int
+has_internal_definitions (SExp *body) {
+    for (; is_pair(body); body = cdr(body)) {
+        if (is_definition(car(body)))
+            return 1;
+        if (is_begin(car(body)) && has_internal_definitions(cdar(body)))
+            return 1;
+    }
+    return 0;
+}
+
+// constants is an alist from let-bound names to the literals they stand for;
+// this drops var from it, for a scope where var means something else
+SExp *
+shadow_constant (Interp *interp, SExp *constants, SExp *var) {
+    if (is_nil(constants))
+        return constants;
+    if (caar(constants) == var)
+        return shadow_constant(interp, cdr(constants), var);
+    return cons(interp, car(constants), shadow_constant(interp, cdr(constants), var));
+}
+
+SExp *
+shadow_params (Interp *interp, SExp *constants, SExp *params) {
+    for (; is_pair(params); params = cdr(params))
+        constants = shadow_constant(interp, constants, car(params));
+    if (is_symbol(params))
+        constants = shadow_constant(interp, constants, params);
+    return constants;
+}
+
+SExp *
+shadow_definitions (Interp *interp, SExp *constants, SExp *body) {
+    for (; is_pair(body); body = cdr(body)) {
+        if (is_definition(car(body)) && is_pair(cdar(body)))
+            constants = shadow_constant(interp, constants, definition_variable(car(body)));
+        else if (is_begin(car(body)))
+            constants = shadow_definitions(interp, constants, cdar(body));
+    }
+    return constants;
+}
+
+SExp * optimize_exp (Interp *interp, SExp *exp, SExp *constants);
+
+SExp *
+optimize_list (Interp *interp, SExp *list, SExp *constants) {
+    if (!is_pair(list))
+        return list;
+    SExp *first = optimize_exp(interp, car(list), constants);
+    return cons(interp, first, optimize_list(interp, cdr(list), constants));
+}
+
+// Optimizes each expression of a sequence, dropping constants whose value
+// would be thrown away
+SExp *
+optimize_sequence (Interp *interp, SExp *seq, SExp *constants) {
+    if (!is_pair(seq))
+        return seq;
+    SExp *first = optimize_exp(interp, car(seq), constants);
+    SExp *rest = optimize_sequence(interp, cdr(seq), constants);
+    if (is_pair(rest) && is_literal(first))
+        return rest;
+    return cons(interp, first, rest);
+}
+
+SExp *
+optimize_body (Interp *interp, SExp *params, SExp *body, SExp *constants) {
+    constants = shadow_params(interp, constants, params);
+    constants = shadow_definitions(interp, constants, body);
+    return optimize_sequence(interp, body, constants);
+}
+
+SExp *
+optimize_if (Interp *interp, SExp *exp, SExp *constants) {
+    if (!is_pair(cdr(exp)) || !is_pair(cddr(exp)))
+        return exp;
+    SExp *predicate = optimize_exp(interp, cadr(exp), constants);
+    SExp *consequent, *alternative = is_pair(cdddr(exp)) ? cadddr(exp) : NULL;
+
+    if (is_literal(predicate)) {
+        if (is_true(literal_value(predicate)))
+            return optimize_exp(interp, caddr(exp), constants);
+        return alternative == NULL ? &FALSE : optimize_exp(interp, alternative, constants);
+    }
+    consequent = optimize_exp(interp, caddr(exp), constants);
+    if (alternative != NULL)
+        alternative = optimize_exp(interp, alternative, constants);
+    exp = make_if(interp, predicate, consequent, alternative);
+    if (is_folded(predicate) && folded_value(predicate) != NULL) {
+        return make_folded(interp, is_true(folded_value(predicate)) ? consequent : alternative == NULL ? &FALSE : alternative,
+                           exp, predicate->pair->cache);
+    }
+    return exp;
+}
+
+SExp *
+optimize_clauses (Interp *interp, SExp *clauses, SExp *constants) {
+    SExp *clause, *test;
+
+    if (!is_pair(clauses))
+        return clauses;
+    clause = car(clauses);
+    // leave anything we don't understand, like (test) with no body, to eval
+    if (!is_pair(clause) || !is_pair(cdr(clause)))
+        return cons(interp, clause, optimize_clauses(interp, cdr(clauses), constants));
+    if (is_tagged_list(clause, "else"))
+        return cons(interp, cons(interp, car(clause), optimize_sequence(interp, cdr(clause), constants)), &NIL);
+
+    test = optimize_exp(interp, car(clause), constants);
+    if (is_literal(test)) {
+        if (is_false(literal_value(test)))
+            return optimize_clauses(interp, cdr(clauses), constants);
+        // every clause after an always-true one is dead
+        return cons(interp, cons(interp, new_symbol(interp, "else"), optimize_sequence(interp, cdr(clause), constants)), &NIL);
+    }
+    clause = cons(interp, test, optimize_sequence(interp, cdr(clause), constants));
+    return cons(interp, clause, optimize_clauses(interp, cdr(clauses), constants));
+}
+
+SExp *
+optimize_cond (Interp *interp, SExp *exp, SExp *constants) {
+    SExp *clauses = optimize_clauses(interp, cdr(exp), constants);
+    if (is_nil(clauses))
+        return &FALSE;
+    if (is_tagged_list(car(clauses), "else"))
+        return sequence_to_exp(interp, cdar(clauses));
+    return cons(interp, car(exp), clauses);
+}
+
+// In an and, constant true operands before the last are dropped and a constant
+// false one ends it; or is the same with true and false swapped
+SExp *
+optimize_bool (Interp *interp, SExp *exp, SExp *constants) {
+    int stops_on = is_or(exp);
+    SExp *operands = &NIL, *operand, *rest, *ret;
+
+    for (rest = cdr(exp); is_pair(rest); rest = cdr(rest)) {
+        operand = optimize_exp(interp, car(rest), constants);
+        if (is_literal(operand) && is_true(literal_value(operand)) == stops_on) {
+            operands = cons(interp, operand, operands);
+            break;
+        }
+        if (is_literal(operand) && is_pair(cdr(rest)))
+            continue;
+        operands = cons(interp, operand, operands);
+    }
+    if (is_nil(operands))
+        return stops_on ? &FALSE : &TRUE;
+    if (is_nil(cdr(operands)))
+        return car(operands);
+
+    ret = &NIL;
+    for (; !is_nil(operands); operands = cdr(operands))
+        ret = cons(interp, car(operands), ret);
+    return cons(interp, car(exp), ret);
+}
+
+// Bindings to constants that the body never assigns are substituted into it,
+// and dropped if nothing could still look them up by name
+SExp *
+optimize_let (Interp *interp, SExp *exp, SExp *constants) {
+    SExp *binding, *var, *value, *body, *kept = &NIL, *bindings = &NIL;
+    SExp *inner = constants;
+    int droppable;
+
+    if (!is_pair(cdr(exp)) || !is_pair(cddr(exp)))
+        return exp;
+    body = cddr(exp);
+    droppable = !has_internal_definitions(body) && !uses_interaction_environment(body);
+
+    for (binding = cadr(exp); is_pair(binding); binding = cdr(binding)) {
+        if (!is_pair(car(binding)) || !is_pair(cdar(binding)))
+            return exp;
+        var = caar(binding);
+        value = optimize_exp(interp, cadar(binding), constants);
+        inner = shadow_constant(interp, inner, var);
+        if (is_literal(value) && !is_assigned_in(body, var)) {
+            inner = cons(interp, cons(interp, var, value), inner);
+            if (droppable)
+                continue;
+        }
+        kept = cons(interp, cons(interp, var, cons(interp, value, &NIL)), kept);
+    }
+
+    body = optimize_body(interp, &NIL, body, inner);
+    if (is_nil(kept))
+        return sequence_to_exp(interp, body);
+    for (; !is_nil(kept); kept = cdr(kept))
+        bindings = cons(interp, car(kept), bindings);
+    return cons(interp, car(exp), cons(interp, bindings, body));
+}
+
+SExp *
+optimize_guard (Interp *interp, SExp *exp, SExp *constants) {
+    SExp *clause, *clauses = &NIL, *spec, *inner, *ret;
+
+    if (!is_pair(cdr(exp)) || !is_pair(cadr(exp)))
+        return exp;
+    spec = cadr(exp);
+    inner = shadow_constant(interp, constants, car(spec));
+    for (clause = cdr(spec); is_pair(clause); clause = cdr(clause)) {
+        if (is_tagged_list(car(clause), "else"))
+            clauses = cons(interp, cons(interp, caar(clause), optimize_sequence(interp, cdar(clause), inner)), clauses);
+        else if (is_tagged_list(cdar(clause), "=>"))
+            clauses = cons(interp, cons(interp, optimize_exp(interp, caar(clause), inner), cons(interp, cadar(clause), optimize_list(interp, cddar(clause), inner))), clauses);
+        else
+            clauses = cons(interp, optimize_list(interp, car(clause), inner), clauses);
+    }
+    ret = &NIL;
+    for (; !is_nil(clauses); clauses = cdr(clauses))
+        ret = cons(interp, car(clauses), ret);
+    spec = cons(interp, car(spec), ret);
+    return cons(interp, car(exp), cons(interp, spec, optimize_sequence(interp, cddr(exp), constants)));
+}
+
+// Calls the primitive exp applies, if it's pure and all of its operands are
+// constants, and returns its result as a literal. Anything it raises is left
+// to be raised when exp is evaluated.
+SExp *
+fold_application (Interp *interp, SExp *exp) {
+    SExp *operator = car(exp), *operand, *cell, *procedure, *result;
+    SExp *argv[MAX_INLINE_ARGS];
+    FoldGuard guard;
+    int argc = 0, i;
+    ErrorHandler handler;
+
+    if (!is_symbol(operator) || operator->atom->rebound
+        || __atomic_load_n(&operator->atom->bound_locally, __ATOMIC_RELAXED))
+        return exp;
+    cell = lookup_global_cell(interp, operator);
+    if (cell == NULL)
+        return exp;
+    procedure = car(cell);
+    if (!is_primitive_procedure(procedure) || !procedure->primitive->pure)
+        return exp;
+    guard.n_cells = 0;
+    add_fold_cell(&guard, operator, cell, procedure);
+    for (operand = cdr(exp); is_pair(operand); operand = cdr(operand)) {
+        if (argc == MAX_INLINE_ARGS || (argv[argc++] = folded_value(car(operand))) == NULL)
+            return exp;
+        if (is_folded(car(operand))) {
+            FoldGuard *inner = car(operand)->pair->cache;
+            for (i = 0; i < inner->n_cells; i++) {
+                if (!add_fold_cell(&guard, inner->symbols[i], inner->cells[i], inner->procedures[i]))
+                    return exp;
+            }
+        }
+    }
+    if (!is_nil(operand))
+        return exp;
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0)
+        return exp;
+    result = apply_primitive_procedure(interp, procedure, argc, argv);
+    pop_error_handler(interp, &handler);
+    return make_folded(interp, make_literal(interp, result), exp, &guard);
+}
+
+SExp *
+optimize_exp (Interp *interp, SExp *exp, SExp *constants) {
+    SExp *constant;
+
+    if (is_symbol(exp)) {
+        for (constant = constants; !is_nil(constant); constant = cdr(constant)) {
+            if (caar(constant) == exp)
+                return cdar(constant);
+        }
+        return exp;
+    }
+    if (!is_pair(exp) || is_quoted(exp))
+        return exp;
+    if (is_if(exp))
+        return optimize_if(interp, exp, constants);
+    if (is_cond(exp))
+        return optimize_cond(interp, exp, constants);
+    if (is_and(exp) || is_or(exp))
+        return optimize_bool(interp, exp, constants);
+    if (is_let(exp))
+        return optimize_let(interp, exp, constants);
+    if (is_guard(exp))
+        return optimize_guard(interp, exp, constants);
+    if (is_begin(exp))
+        return cons(interp, car(exp), optimize_sequence(interp, cdr(exp), constants));
+    if (is_lambda(exp) && is_pair(cdr(exp)))
+        return cons(interp, car(exp), cons(interp, cadr(exp), optimize_body(interp, cadr(exp), cddr(exp), constants)));
+    if (is_definition(exp) && is_pair(cdr(exp))) {
+        if (is_pair(cadr(exp)))
+            return cons(interp, car(exp), cons(interp, cadr(exp), optimize_body(interp, cdadr(exp), cddr(exp), constants)));
+        return cons(interp, car(exp), cons(interp, cadr(exp), optimize_list(interp, cddr(exp), constants)));
+    }
+    if (is_assignment(exp) && is_pair(cdr(exp)))
+        return cons(interp, car(exp), cons(interp, cadr(exp), optimize_list(interp, cddr(exp), constants)));
+    return fold_application(interp, optimize_list(interp, exp, constants));
+}
+
+SExp *
+optimize (Interp *interp, SExp *program) {
+    if (!interp->optimize)
+        return program;
+    mark_rebound_names(program);
+    program = optimize_exp(interp, program, &NIL);
+    if (interp->dump_optimized) {
+        write_sexp(stderr, program);
+        fprintf(stderr, "\n");
+    }
+    return program;
+}
+
+// JIT
+// Compound procedures are interpreted until JitState.calls reaches the root's
+// jit_threshold, and are then compiled to x86-64. The compiled body follows the
+// interpreter's own steps, but parameters come straight from argv, if, and, or
+// and begin are branches, and calls to the open-coded primitives work on
+// fixnums inline. Anything else, like let or lambda, is handed back to eval,
+// and only then is the procedure given an environment frame at all.
+//
+// Compiled code runs as
+//     SExp *entry(Interp *interp, SExp **argv, SExp *env)
+// with interp in rbx, argv in r14 and env in r15 for the whole body. Values
+// being collected for a call live in slots below the saved registers, so a
+// slot range can be passed to apply as its argv.
+
+#define JIT_MAX_SLOTS 64
+#define JIT_MAX_PARAMS 16
+#define JIT_SAVED_BYTES 32
+#define JIT_FRAME_BYTES (JIT_MAX_SLOTS * 8)
+
+enum {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+enum {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xc,
+};
+
+typedef struct Assembler {
+    Interp *interp;
+    unsigned char *code;
+    size_t length;
+    size_t capacity;
+    SExp *params;
+    // slots in use by calls being compiled
+    int slots;
+    // whether the body needs its parameters bound in an environment frame
+    int needs_env;
+} Assembler;
+
+void
+emit_byte (Assembler *a, unsigned char byte) {
+    if (a->length == a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 1024;
+        a->code = realloc(a->code, a->capacity);
+    }
+    a->code[a->length++] = byte;
+}
+
+void
+emit_u32 (Assembler *a, uint32_t value) {
+    int i;
+    for (i = 0; i < 4; i++)
+        emit_byte(a, value >> (8 * i));
+}
+
+void
+emit_u64 (Assembler *a, uint64_t value) {
+    int i;
+    for (i = 0; i < 8; i++)
+        emit_byte(a, value >> (8 * i));
+}
+
+void
+emit_rex (Assembler *a, int reg, int base) {
+    emit_byte(a, 0x48 | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0));
+}
+
+// A [base + disp32] operand
+void
+emit_memory (Assembler *a, int reg, int base, int32_t disp) {
+    emit_byte(a, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        emit_byte(a, 0x24);
+    emit_u32(a, disp);
+}
+
+// mov reg, imm64
+void
+emit_mov_imm (Assembler *a, int reg, uint64_t value) {
+    emit_rex(a, 0, reg);
+    emit_byte(a, 0xb8 | (reg & 7));
+    emit_u64(a, value);
+}
+
+// mov dst, src
+void
+emit_mov (Assembler *a, int dst, int src) {
+    emit_rex(a, src, dst);
+    emit_byte(a, 0x89);
+    emit_byte(a, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+// mov dst, [base + disp]
+void
+emit_load (Assembler *a, int dst, int base, int32_t disp) {
+    emit_rex(a, dst, base);
+    emit_byte(a, 0x8b);
+    emit_memory(a, dst, base, disp);
+}
+
+// mov [base + disp], src
+void
+emit_store (Assembler *a, int base, int32_t disp, int src) {
+    emit_rex(a, src, base);
+    emit_byte(a, 0x89);
+    emit_memory(a, src, base, disp);
+}
+
+// lea dst, [base + disp]
+void
+emit_lea (Assembler *a, int dst, int base, int32_t disp) {
+    emit_rex(a, dst, base);
+    emit_byte(a, 0x8d);
+    emit_memory(a, dst, base, disp);
+}
+
+// cmp dword [base + disp], imm8
+void
+emit_cmp_mem32 (Assembler *a, int base, int32_t disp, int8_t value) {
+    if (base >= 8)
+        emit_byte(a, 0x41);
+    emit_byte(a, 0x83);
+    emit_memory(a, 7, base, disp);
+    emit_byte(a, value);
+}
+
+// cmp x, y
+void
+emit_cmp (Assembler *a, int x, int y) {
+    emit_rex(a, y, x);
+    emit_byte(a, 0x39);
+    emit_byte(a, 0xc0 | (y & 7) << 3 | (x & 7));
+}
+
+// add dst, src
+void
+emit_add (Assembler *a, int dst, int src) {
+    emit_rex(a, src, dst);
+    emit_byte(a, 0x01);
+    emit_byte(a, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+void
+emit_call (Assembler *a, const void *function) {
+    emit_mov_imm(a, RAX, (uint64_t)function);
+    emit_byte(a, 0xff);
+    emit_byte(a, 0xd0);
+}
+
+// Emits a jump with its target left blank, returning where to patch it
+size_t
+emit_jump (Assembler *a, int condition) {
+    if (condition < 0) {
+        emit_byte(a, 0xe9);
+    } else {
+        emit_byte(a, 0x0f);
+        emit_byte(a, 0x80 | condition);
+    }
+    emit_u32(a, 0);
+    return a->length - 4;
+}
+
+void
+patch_jump (Assembler *a, size_t at, size_t target) {
+    uint32_t rel = target - (at + 4);
+    memcpy(a->code + at, &rel, 4);
+}
+
+int32_t
+slot_offset (int slot) {
+    return -JIT_SAVED_BYTES - JIT_FRAME_BYTES + 8 * slot;
+}
+
+// Jumps to the returned patch site unless rax holds a number, leaving its
+// value in reg
+size_t
+emit_unbox_number (Assembler *a, int reg, size_t *not_atom) {
+    emit_cmp_mem32(a, RAX, offsetof(SExp, type), SEXP_TYPE_ATOM);
+    *not_atom = emit_jump(a, CC_NE);
+    emit_load(a, RAX, RAX, offsetof(SExp, atom));
+    emit_cmp_mem32(a, RAX, offsetof(Atom, type), ATOM_TYPE_NUMBER);
+    size_t not_number = emit_jump(a, CC_NE);
+    emit_load(a, reg, RAX, offsetof(Atom, number_value));
+    return not_number;
+}
+
+void
+emit_boolean_result (Assembler *a, int condition, size_t *done) {
+    emit_mov_imm(a, RAX, (uint64_t)&TRUE);
+    *done = emit_jump(a, condition);
+    emit_mov_imm(a, RAX, (uint64_t)&FALSE);
+}
+
+int
+param_index (Assembler *a, SExp *symbol) {
+    SExp *param;
+    int i = 0;
+    for (param = a->params; is_pair(param); param = cdr(param), i++) {
+        if (car(param) == symbol)
+            return i;
+    }
+    return -1;
+}
+
+void compile_exp (Assembler *a, SExp *exp);
+
+// Leaves exp to the interpreter, in an environment with the parameters bound
+void
+compile_fallback (Assembler *a, SExp *exp) {
+    a->needs_env = 1;
+    emit_mov(a, RDI, RBX);
+    emit_mov_imm(a, RSI, (uint64_t)exp);
+    emit_mov(a, RDX, R15);
+    emit_call(a, eval);
+}
+
+void
+compile_sequence (Assembler *a, SExp *seq) {
+    if (is_nil(seq))
+        emit_mov_imm(a, RAX, (uint64_t)&NIL);
+    for (; is_pair(seq); seq = cdr(seq))
+        compile_exp(a, car(seq));
+}
+
+// Branches to where is_false(rax) would be true
+size_t
+emit_jump_if_false (Assembler *a) {
+    emit_mov_imm(a, RCX, (uint64_t)&TRUE);
+    emit_cmp(a, RAX, RCX);
+    size_t is_true = emit_jump(a, CC_E);
+    emit_mov(a, RDI, RAX);
+    emit_call(a, is_false);
+    emit_byte(a, 0x85);
+    emit_byte(a, 0xc0);
+    size_t ret = emit_jump(a, CC_NE);
+    patch_jump(a, is_true, a->length);
+    return ret;
+}
+
+void
+compile_if (Assembler *a, SExp *exp) {
+    compile_exp(a, cadr(exp));
+    size_t to_alternative = emit_jump_if_false(a);
+    compile_exp(a, caddr(exp));
+    size_t done = emit_jump(a, -1);
+    patch_jump(a, to_alternative, a->length);
+    if (is_nil(cdddr(exp)))
+        emit_mov_imm(a, RAX, (uint64_t)&FALSE);
+    else
+        compile_exp(a, cadddr(exp));
+    patch_jump(a, done, a->length);
+}
+
+// The optimized expression, behind a check of each cell the fold assumed, with
+// the original after it for when one has changed
+void
+compile_folded (Assembler *a, SExp *exp) {
+    FoldGuard *guard = exp->pair->cache;
+    size_t changed[FOLD_MAX_CELLS], done;
+    int i;
+
+    for (i = 0; i < guard->n_cells; i++) {
+        emit_mov_imm(a, RAX, (uint64_t)&guard->cells[i]->pair->car);
+        emit_load(a, RAX, RAX, 0);
+        emit_mov_imm(a, RCX, (uint64_t)guard->procedures[i]);
+        emit_cmp(a, RAX, RCX);
+        changed[i] = emit_jump(a, CC_NE);
+    }
+    compile_exp(a, cadr(exp));
+    done = emit_jump(a, -1);
+    for (i = 0; i < guard->n_cells; i++)
+        patch_jump(a, changed[i], a->length);
+    compile_exp(a, caddr(exp));
+    patch_jump(a, done, a->length);
+}
+
+// Each operand but the last stops an and if it's false, and an or if it isn't
+void
+compile_bool (Assembler *a, SExp *exp) {
+    size_t exits[JIT_MAX_SLOTS];
+    int n_exits = 0, i, slot = a->slots - 1;
+    SExp *operand;
+
+    if (is_nil(cdr(exp))) {
+        emit_mov_imm(a, RAX, (uint64_t)(is_and(exp) ? &TRUE : &FALSE));
+        return;
+    }
+    for (operand = cdr(exp); is_pair(operand); operand = cdr(operand)) {
+        compile_exp(a, car(operand));
+        if (is_nil(cdr(operand)))
+            break;
+        emit_store(a, RBP, slot_offset(slot), RAX);
+        size_t to_false = emit_jump_if_false(a);
+        if (is_and(exp)) {
+            exits[n_exits++] = to_false;
+        } else {
+            emit_load(a, RAX, RBP, slot_offset(slot));
+            exits[n_exits++] = emit_jump(a, -1);
+            patch_jump(a, to_false, a->length);
+        }
+    }
+    size_t done = emit_jump(a, -1);
+    for (i = 0; i < n_exits; i++)
+        patch_jump(a, exits[i], a->length);
+    if (is_and(exp))
+        emit_load(a, RAX, RBP, slot_offset(slot));
+    patch_jump(a, done, a->length);
+}
+
+// The global primitive exp's operator names if it is open-coded, checked again
+// each time the call runs
+Primitive *
+open_coded_operator (Assembler *a, SExp *exp, SExp **cell) {
+    SExp *operator = car(exp);
+    if (!is_symbol(operator) || param_index(a, operator) >= 0)
+        return NULL;
+    *cell = lookup_global_cell(a->interp, operator);
+    if (*cell == NULL || !is_primitive_procedure(car(*cell)))
+        return NULL;
+    return car(*cell)->primitive->open_coded != OPEN_CODED_NONE ? car(*cell)->primitive : NULL;
+}
+
+void
+compile_application (Assembler *a, SExp *exp) {
+    SExp *operator = car(exp), *operand, *cell = NULL;
+    Primitive *primitive = open_coded_operator(a, exp, &cell);
+    int base = a->slots, argc = 0, param = -1;
+    size_t generic[3], fallback[4], done[4];
+    int n_generic = 0, n_fallback = 0, n_done = 0, i;
+
+    for (operand = cdr(exp); is_pair(operand); operand = cdr(operand))
+        argc++;
+    if (!is_nil(operand) || base + argc + 1 > JIT_MAX_SLOTS
+        || (is_symbol(operator) && (is_tagged_list(exp, "interaction-environment")
+                                    || is_tagged_list(exp, "apply") || is_tagged_list(exp, "eval")))) {
+        compile_fallback(a, exp);
+        return;
+    }
+    if (is_symbol(operator))
+        param = param_index(a, operator);
+    if (!is_symbol(operator)) {
+        compile_fallback(a, exp);
+        return;
+    }
+
+    a->slots += argc;
+    for (operand = cdr(exp), i = 0; is_pair(operand); operand = cdr(operand), i++) {
+        compile_exp(a, car(operand));
+        emit_store(a, RBP, slot_offset(base + i), RAX);
+    }
+    a->slots = base;
+
+    int binary = primitive != NULL && (primitive->open_coded == OPEN_CODED_CONS || primitive->open_coded == OPEN_CODED_ADD
+                                       || primitive->open_coded == OPEN_CODED_NUM_EQ || primitive->open_coded == OPEN_CODED_LT);
+    if (primitive != NULL && argc == (binary ? 2 : 1)) {
+        // the same checks eval_operator makes before trusting its cache
+        emit_mov_imm(a, RAX, (uint64_t)&operator->atom->bound_locally);
+        emit_cmp_mem32(a, RAX, 0, 0);
+        generic[n_generic++] = emit_jump(a, CC_NE);
+        emit_mov_imm(a, RAX, (uint64_t)&a->interp->root->detached_environments);
+        emit_cmp_mem32(a, RAX, 0, 0);
+        generic[n_generic++] = emit_jump(a, CC_NE);
+        emit_mov_imm(a, RAX, (uint64_t)&cell->pair->car);
+        emit_load(a, RAX, RAX, 0);
+        emit_mov_imm(a, RCX, (uint64_t)car(cell));
+        emit_cmp(a, RAX, RCX);
+        generic[n_generic++] = emit_jump(a, CC_NE);
+
+        emit_load(a, RAX, RBP, slot_offset(base));
+        switch (primitive->open_coded) {
+            case OPEN_CODED_ADD:
+            case OPEN_CODED_NUM_EQ:
+            case OPEN_CODED_LT:
+                fallback[n_fallback] = emit_unbox_number(a, RCX, &fallback[n_fallback + 1]);
+                n_fallback += 2;
+                emit_mov(a, RSI, RCX);
+                emit_load(a, RAX, RBP, slot_offset(base + 1));
+                fallback[n_fallback] = emit_unbox_number(a, RDX, &fallback[n_fallback + 1]);
+                n_fallback += 2;
+                if (primitive->open_coded == OPEN_CODED_ADD) {
+                    emit_add(a, RSI, RDX);
+                    emit_mov(a, RDI, RBX);
+                    emit_call(a, new_number);
+                    done[n_done++] = emit_jump(a, -1);
+                } else {
+                    emit_cmp(a, RSI, RDX);
+                    emit_boolean_result(a, primitive->open_coded == OPEN_CODED_LT ? CC_L : CC_E, &done[n_done++]);
+                    done[n_done++] = emit_jump(a, -1);
+                }
+                break;
+            case OPEN_CODED_CAR:
+            case OPEN_CODED_CDR:
+                emit_cmp_mem32(a, RAX, offsetof(SExp, type), SEXP_TYPE_PAIR);
+                fallback[n_fallback++] = emit_jump(a, CC_NE);
+                emit_load(a, RAX, RAX, offsetof(SExp, pair));
+                emit_load(a, RAX, RAX, primitive->open_coded == OPEN_CODED_CAR ? offsetof(Pair, car) : offsetof(Pair, cdr));
+                done[n_done++] = emit_jump(a, -1);
+                break;
+            case OPEN_CODED_NULL:
+            case OPEN_CODED_PAIR:
+                emit_cmp_mem32(a, RAX, offsetof(SExp, type), primitive->open_coded == OPEN_CODED_NULL ? SEXP_TYPE_NIL : SEXP_TYPE_PAIR);
+                emit_boolean_result(a, CC_E, &done[n_done++]);
+                done[n_done++] = emit_jump(a, -1);
+                break;
+            case OPEN_CODED_CONS:
+                emit_mov(a, RDI, RBX);
+                emit_mov(a, RSI, RAX);
+                emit_load(a, RDX, RBP, slot_offset(base + 1));
+                emit_call(a, cons);
+                done[n_done++] = emit_jump(a, -1);
+                break;
+            default:
+                break;
+        }
+
+        // not fixnums or not a pair: let the primitive raise the error
+        for (i = 0; i < n_fallback; i++)
+            patch_jump(a, fallback[i], a->length);
+        emit_mov_imm(a, RSI, (uint64_t)car(cell));
+        emit_mov_imm(a, RDX, argc);
+        emit_lea(a, RCX, RBP, slot_offset(base));
+        emit_mov(a, RDI, RBX);
+        emit_call(a, apply);
+        done[n_done++] = emit_jump(a, -1);
+        for (i = 0; i < n_generic; i++)
+            patch_jump(a, generic[i], a->length);
+    }
+
+    if (param >= 0) {
+        emit_load(a, RAX, R14, 8 * param);
+    } else {
+        emit_mov(a, RDI, RBX);
+        emit_mov_imm(a, RSI, (uint64_t)exp);
+        emit_mov(a, RDX, R15);
+        emit_call(a, eval_operator);
+    }
+    emit_mov(a, RSI, RAX);
+    emit_mov_imm(a, RDX, argc);
+    emit_lea(a, RCX, RBP, slot_offset(base));
+    emit_mov(a, RDI, RBX);
+    emit_call(a, apply);
+    for (i = 0; i < n_done; i++)
+        patch_jump(a, done[i], a->length);
+}
+
+void
+compile_exp (Assembler *a, SExp *exp) {
+    int param;
+
+    if (is_self_evaluating(exp) || is_nil(exp)) {
+        emit_mov_imm(a, RAX, (uint64_t)exp);
+    } else if (is_symbol(exp)) {
+        if ((param = param_index(a, exp)) >= 0) {
+            emit_load(a, RAX, R14, 8 * param);
+        } else {
+            emit_mov(a, RDI, RBX);
+            emit_mov_imm(a, RSI, (uint64_t)exp);
+            emit_mov(a, RDX, R15);
+            emit_call(a, lookup_variable_value);
+        }
+    } else if (!is_pair(exp)) {
+        compile_fallback(a, exp);
+    } else if (is_quoted(exp) && is_pair(cdr(exp))) {
+        emit_mov_imm(a, RAX, (uint64_t)cadr(exp));
+    } else if (is_folded(exp)) {
+        compile_folded(a, exp);
+    } else if (is_if(exp) && is_pair(cdr(exp)) && is_pair(cddr(exp))) {
+        compile_if(a, exp);
+    } else if (is_cond(exp)) {
+        compile_exp(a, cond_to_if(a->interp, exp));
+    } else if ((is_and(exp) || is_or(exp)) && a->slots < JIT_MAX_SLOTS && length(cdr(exp)) <= JIT_MAX_SLOTS) {
+        a->slots++;
+        compile_bool(a, exp);
+        a->slots--;
+    } else if (is_begin(exp)) {
+        compile_sequence(a, cdr(exp));
+    } else if (is_quoted(exp) || is_assignment(exp) || is_definition(exp) || is_lambda(exp)
+               || is_let(exp) || is_guard(exp) || is_if(exp)
+               || is_delay(exp) || is_delay_force(exp) || is_cons_stream(exp)) {
+        compile_fallback(a, exp);
+    } else {
+        compile_application(a, exp);
+    }
+}
+
+// Compiles a procedure body to executable memory, or returns NULL if it can't
+JitEntry
+jit_compile (Interp *interp, SExp *params, SExp *body, int *needs_env, int *n_args) {
+#if defined(__x86_64__)
+    // on the heap, since a longjmp back here would leave a local copy's
+    // fields indeterminate
+    Assembler *a;
+    SExp *param;
+    ErrorHandler handler;
+    void *code;
+    size_t size;
+    int n_params = 0;
+
+    for (param = params; is_pair(param); param = cdr(param)) {
+        // compiled code reads parameters from argv, so it can't see them change
+        if (!is_symbol(car(param)) || is_assigned_in(body, car(param)) || ++n_params > JIT_MAX_PARAMS)
+            return NULL;
+    }
+    if (!is_nil(param) || is_nil(body) || uses_interaction_environment(body))
+        return NULL;
+    a = calloc(1, sizeof(Assembler));
+    if (a == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    a->interp = interp;
+    a->params = params;
+
+    // push rbp; mov rbp, rsp; push rbx, r13, r14, r15; sub rsp, JIT_FRAME_BYTES
+    emit_byte(a, 0x55);
+    emit_mov(a, RBP, RSP);
+    emit_byte(a, 0x53);
+    emit_byte(a, 0x41); emit_byte(a, 0x55);
+    emit_byte(a, 0x41); emit_byte(a, 0x56);
+    emit_byte(a, 0x41); emit_byte(a, 0x57);
+    emit_rex(a, 0, RSP);
+    emit_byte(a, 0x81);
+    emit_byte(a, 0xec);
+    emit_u32(a, JIT_FRAME_BYTES);
+    emit_mov(a, RBX, RDI);
+    emit_mov(a, R14, RSI);
+    emit_mov(a, R15, RDX);
+
+    // cond_to_if raises on a malformed cond
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        free(a->code);
+        free(a);
+        return NULL;
+    }
+    compile_sequence(a, body);
+    pop_error_handler(interp, &handler);
+
+    // lea rsp, [rbp - JIT_SAVED_BYTES]; pop r15, r14, r13, rbx, rbp; ret
+    emit_lea(a, RSP, RBP, -JIT_SAVED_BYTES);
+    emit_byte(a, 0x41); emit_byte(a, 0x5f);
+    emit_byte(a, 0x41); emit_byte(a, 0x5e);
+    emit_byte(a, 0x41); emit_byte(a, 0x5d);
+    emit_byte(a, 0x5b);
+    emit_byte(a, 0x5d);
+    emit_byte(a, 0xc3);
+
+    size = (a->length + 4095) & ~(size_t)4095;
+    code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(a->code);
+        free(a);
+        return NULL;
+    }
+    memcpy(code, a->code, a->length);
+    free(a->code);
+    *needs_env = a->needs_env;
+    free(a);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        return NULL;
+    }
+    count_alloc(interp, &interp->memory_stats.jit_code, size);
+    *n_args = n_params;
+    return (JitEntry)code;
+#else
+    return NULL;
+#endif
+}
+
+// The JitState for procedures made from the lambda expression exp
+JitState *
+jit_state (Interp *interp, SExp *exp) {
+    JitState *jit = __atomic_load_n((JitState **)&exp->pair->cache, __ATOMIC_ACQUIRE);
+    JitState *expected = NULL;
+    SExp *params = cadr(exp);
+    SExp *param;
+
+    if (jit != NULL)
+        return jit;
+    jit = calloc(1, sizeof(JitState));
+    if (jit == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    // with the JIT off procedures are never counted towards compiling
+    jit->status = interp->root->jit_threshold == 0 ? JIT_FAILED : JIT_COUNTING;
+    jit->vars = params;
+    for (param = params; is_pair(param); param = cdr(param)) {
+        if (is_symbol(car(param)))
+            __atomic_store_n(&car(param)->atom->bound_locally, 1, __ATOMIC_RELAXED);
+        jit->arity++;
+    }
+    if (is_symbol(param)) {
+        __atomic_store_n(&param->atom->bound_locally, 1, __ATOMIC_RELAXED);
+        jit->rest = 1;
+        jit->vars = rest_parameter_vars(interp, params);
+    }
+    jit->escapes = captures_environment(cddr(exp));
+    // a lambda in a heap segment can't keep one, so gets a new one each time
+    if (in_segment(exp->pair))
+        return jit;
+    if (!__atomic_compare_exchange_n((JitState **)&exp->pair->cache, &expected, jit, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(jit);
+        return expected;
+    }
+    return jit;
+}
+
+// Counts a call to procedure, compiling it once it's hot. Returns its JitState
+// once it has compiled code, or NULL while it should be interpreted.
+JitState *
+jit_tier_up (Interp *interp, Closure *closure) {
+    JitState *jit = closure->jit;
+    int status;
+
+    status = __atomic_load_n(&jit->status, __ATOMIC_ACQUIRE);
+    if (status == JIT_COMPILED)
+        return jit;
+    if (status != JIT_COUNTING
+        || __atomic_add_fetch(&jit->calls, 1, __ATOMIC_RELAXED) != interp->root->jit_threshold
+        || !__atomic_compare_exchange_n(&jit->status, &status, JIT_COMPILING, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return NULL;
+
+    jit->entry = jit_compile(interp, closure->params, closure->body, &jit->needs_env, &jit->n_args);
+    __atomic_store_n(&jit->status, jit->entry != NULL ? JIT_COMPILED : JIT_FAILED, __ATOMIC_RELEASE);
+    return jit->entry != NULL ? jit : NULL;
+}
+
+// COMPILED PROCEDURES
+// Runtime support for C generated by lithp --compile. A compiled procedure is
+// a C function plus the values of the variables it closed over. Calls in tail
+// position don't call their target directly: they leave it in the interpreter
+// and return TAIL_CALL to the apply_compiled loop, which makes the call
+// without growing the C stack.
+
+SExp TAIL_CALL = { SEXP_TYPE_NIL };
+
+SExp *
+new_compiled_procedure (Interp *interp, CompiledCode code, int n_free, SExp **free) {
+    size_t size = sizeof(CompiledProcedure) + n_free * sizeof(SExp*);
+    SExp *ret = new_sexp(interp);
+    count_alloc(interp, &interp->memory_stats.procedures, size);
+    ret->type = SEXP_TYPE_COMPILED_PROC;
+    ret->compiled = malloc(size);
+    ret->compiled->code = code;
+    ret->compiled->name = &NIL;
+    ret->compiled->n_free = n_free;
+    if (n_free > 0)
+        memcpy(ret->compiled->free, free, n_free * sizeof(SExp*));
+    return ret;
+}
+
+SExp *
+apply_compiled (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    SExp *args[MAX_TAIL_CALL_ARGS];
+    SExp *ret;
+
+    while (1) {
+        ret = procedure->compiled->code(interp, procedure, argc, argv);
+        if (ret != &TAIL_CALL)
+            return ret;
+        // each tail call spends fuel like the apply it stands in for
+        if (--interp->fuel < 0 && !refill_limit(interp, LIMIT_FUEL, -interp->fuel))
+            return limit_exceeded(interp, LIMIT_FUEL);
+        procedure = interp->tail_procedure;
+        argc = interp->tail_argc;
+        memcpy(args, interp->tail_argv, argc * sizeof(SExp*));
+        argv = args;
+    }
+}
+
+// A call in tail position. Only compiled procedures go through the loop in
+// apply_compiled; anything else is called right away.
+SExp *
+compiled_tail_call (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    if (!is_compiled_procedure(procedure) || argc > MAX_TAIL_CALL_ARGS || interp->profiling)
+        return apply(interp, procedure, argc, argv);
+    interp->tail_procedure = procedure;
+    interp->tail_argc = argc;
+    memcpy(interp->tail_argv, argv, argc * sizeof(SExp*));
+    return &TAIL_CALL;
+}
+
+SExp *
+compiled_arity_error (Interp *interp, SExp *procedure, int argc) {
+    return raise_error(interp, "wrong number of arguments", procedure->compiled->name);
+}
+
+// The value of a global, looking up its binding on first use. Global bindings
+// are never removed, so once found the binding can be kept in *cell.
+SExp *
+compiled_global (Interp *interp, SExp **cell, SExp *symbol) {
+    SExp *found = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+    if (found == NULL) {
+        found = lookup_global_cell(interp, symbol);
+        if (found == NULL)
+            return raise_error(interp, "unbound variable", symbol);
+        __atomic_store_n(cell, found, __ATOMIC_RELEASE);
+    }
+    return car(found);
+}
+
+// Names value after the variable it's being defined as, if it's an unnamed
+// compiled procedure
+SExp *
+compiled_name (SExp *value, SExp *symbol) {
+    if (is_compiled_procedure(value) && is_nil(value->compiled->name))
+        value->compiled->name = symbol;
+    return value;
+}
+
+SExp *
+compiled_define (Interp *interp, SExp *symbol, SExp *value) {
+    define_variable(interp, symbol, compiled_name(value, symbol), interp->global_env);
+    return new_symbol(interp, "ok");
+}
+
+// (guard (var clause ...) body ...) with body as a thunk and the clauses as a
+// procedure of var, which re-raises if none of them apply
+SExp *
+compiled_guard (Interp *interp, SExp *body, SExp *clauses) {
+    ErrorHandler handler;
+    SExp *ret;
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) == 0) {
+        ret = apply(interp, body, 0, NULL);
+        pop_error_handler(interp, &handler);
+        return ret;
+    }
+    return apply(interp, clauses, 1, &handler.raised);
+}
+
+// Runs a compiled program's top level, reporting anything it raises
+int
+lithp_run_compiled (Interp *interp, SExp *(*toplevel)(Interp *interp)) {
+    ErrorHandler handler;
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        print_error(stdout, handler.raised);
+        return 1;
+    }
+    toplevel(interp);
+    pop_error_handler(interp, &handler);
+    return 0;
+}
+
+// PROMISES
+// (delay exp) and (cons-stream a b) hold off evaluating an expression until
+// it's forced. Streams are pairs whose cdr is a promise of the rest, and the
+// stream procedures here walk them in loops, so neither a long run of
+// elements stream-filter skips nor a long delay-force chain grows the C stack.
+
+SExp *
+new_promise (Interp *interp, SExp *exp, SExp *env, SExp *thunk, int chained) {
+    SExp *ret = new_sexp(interp);
+    count_alloc(interp, &interp->memory_stats.promises, sizeof(Promise));
+    ret->type = SEXP_TYPE_PROMISE;
+    ret->promise = malloc(sizeof(Promise));
+    ret->promise->value = NULL;
+    ret->promise->exp = exp;
+    ret->promise->env = env;
+    ret->promise->thunk = thunk;
+    ret->promise->chained = chained;
+    return ret;
+}
+
+// The value of promise, computing it the first time; anything else is
+// returned as is
+SExp *
+force (Interp *interp, SExp *promise) {
+    Promise *p;
+    SExp *value, *expected;
+
+    if (!is_promise(promise))
+        return promise;
+    while (1) {
+        p = __atomic_load_n(&promise->promise, __ATOMIC_ACQUIRE);
+        value = __atomic_load_n(&p->value, __ATOMIC_ACQUIRE);
+        if (value != NULL)
+            return value;
+        value = p->exp != NULL ? eval(interp, p->exp, p->env) : apply(interp, p->thunk, 0, NULL);
+        // a chained promise takes over the one it evaluated to and goes
+        // round again, rather than forcing it recursively
+        if (p->chained && is_promise(value)) {
+            if (__atomic_load_n(&p->value, __ATOMIC_ACQUIRE) == NULL)
+                __atomic_store_n(&promise->promise, __atomic_load_n(&value->promise, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            continue;
+        }
+        // forcing it again from inside exp, or on another thread, may have
+        // finished first, and then that value is the one kept
+        expected = NULL;
+        if (!__atomic_compare_exchange_n(&p->value, &expected, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return expected;
+        return value;
+    }
+}
+
+SExp *
+force_proc (Interp *interp, int argc, SExp **argv) {
+    return force(interp, argv[0]);
+}
+
+// (make-promise obj) is a promise already forced to obj, or obj itself if it's
+// a promise
+SExp *
+make_promise_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *ret;
+    if (is_promise(argv[0]))
+        return argv[0];
+    ret = new_promise(interp, NULL, NULL, NULL, 0);
+    ret->promise->value = argv[0];
+    return ret;
+}
+
+SExp *
+stream_car_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_pair(argv[0]))
+        return raise_error(interp, "stream-car requires a non-empty stream", argv[0]);
+    return car(argv[0]);
+}
+
+SExp *
+stream_cdr_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_pair(argv[0]))
+        return raise_error(interp, "stream-cdr requires a non-empty stream", argv[0]);
+    return force(interp, cdr(argv[0]));
+}
+
+// The rest of a stream made here is a promise of one of the *_rest procedures
+// below, which close over the procedure and the unforced rest of the stream
+// they were made from
+SExp *
+lazy_rest (Interp *interp, CompiledCode code, SExp *a, SExp *b) {
+    SExp *free[2] = { a, b };
+    return new_promise(interp, NULL, NULL, new_compiled_procedure(interp, code, 2, free), 0);
+}
+
+SExp * stream_map (Interp *interp, SExp *procedure, SExp *stream);
+SExp * stream_filter (Interp *interp, SExp *predicate, SExp *stream);
+SExp * stream_take (Interp *interp, long int n, SExp *stream);
+
+SExp *
+stream_map_rest (Interp *interp, SExp *self, int argc, SExp **argv) {
+    SExp **fv = self->compiled->free;
+    return stream_map(interp, fv[0], force(interp, fv[1]));
+}
+
+SExp *
+stream_map (Interp *interp, SExp *procedure, SExp *stream) {
+    SExp *arg;
+    if (is_nil(stream))
+        return &NIL;
+    if (!is_pair(stream))
+        return raise_error(interp, "stream-map requires a stream", stream);
+    arg = car(stream);
+    return cons(interp, apply(interp, procedure, 1, &arg), lazy_rest(interp, stream_map_rest, procedure, cdr(stream)));
+}
+
+SExp *
+stream_filter_rest (Interp *interp, SExp *self, int argc, SExp **argv) {
+    SExp **fv = self->compiled->free;
+    return stream_filter(interp, fv[0], force(interp, fv[1]));
+}
+
+SExp *
+stream_filter (Interp *interp, SExp *predicate, SExp *stream) {
+    SExp *arg;
+    for (; !is_nil(stream); stream = force(interp, cdr(stream))) {
+        if (!is_pair(stream))
+            return raise_error(interp, "stream-filter requires a stream", stream);
+        arg = car(stream);
+        if (is_true(apply(interp, predicate, 1, &arg)))
+            return cons(interp, arg, lazy_rest(interp, stream_filter_rest, predicate, cdr(stream)));
+    }
+    return &NIL;
+}
+
+SExp *
+stream_take_rest (Interp *interp, SExp *self, int argc, SExp **argv) {
+    SExp **fv = self->compiled->free;
+    return stream_take(interp, fv[0]->atom->number_value, fv[1]);
+}
+
+// stream may still be a promise, which is only forced if n asks for more
+SExp *
+stream_take (Interp *interp, long int n, SExp *stream) {
+    if (n <= 0)
+        return &NIL;
+    stream = force(interp, stream);
+    if (is_nil(stream))
+        return &NIL;
+    if (!is_pair(stream))
+        return raise_error(interp, "stream-take requires a stream", stream);
+    return cons(interp, car(stream), lazy_rest(interp, stream_take_rest, new_number(interp, n - 1), cdr(stream)));
+}
+
+SExp *
+stream_map_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_procedure(argv[0]))
+        return raise_error(interp, "stream-map requires a procedure", argv[0]);
+    return stream_map(interp, argv[0], argv[1]);
+}
+
+SExp *
+stream_filter_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_procedure(argv[0]))
+        return raise_error(interp, "stream-filter requires a procedure", argv[0]);
+    return stream_filter(interp, argv[0], argv[1]);
+}
+
+// (stream-take n stream) is a stream of at most the first n elements
+SExp *
+stream_take_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_number(argv[0]))
+        return raise_error(interp, "stream-take requires a number", argv[0]);
+    return stream_take(interp, argv[0]->atom->number_value, argv[1]);
+}
+
+// Forces every element of a finite stream into a list
+SExp *
+stream_to_list_proc (Interp *interp, int argc, SExp **argv) {
+    SExp *stream = argv[0], *ret = &NIL, *tail = NULL, *cell;
+    for (; !is_nil(stream); stream = force(interp, cdr(stream))) {
+        if (!is_pair(stream))
+            return raise_error(interp, "stream->list requires a stream", stream);
+        cell = cons(interp, car(stream), &NIL);
+        if (tail == NULL)
+            ret = cell;
+        else
+            tail->pair->cdr = cell;
+        tail = cell;
+    }
+    return ret;
+}
+
+// PRINTER
+// Printing is two passes. The first walks the datum once, marking every pair
+// it reaches and noting the ones reached more than once. The second writes it
+// out, giving each shared pair a datum label (#0=...) the first time and a
+// reference (#0#) after that, so cycles terminate and sharing shows. Output is
+// collected in a buffer and written out in bulk.
+
+#define PRINT_BUFFER_SIZE 65536
+
+typedef enum {
+    PRINT_UNSEEN,
+    PRINT_SEEN,
+    PRINT_SHARED,
+    PRINT_LABELED,
+} PrintState;
+
+// Pair marks are kept in a sparse bitmap over the address space: two bits of
+// PrintState for each 16-byte granule of a 1MB region. Pairs allocated close
+// together are marked close together, which a hash table keyed by pair
+// scatters all over memory.
+#define PRINT_REGION_SHIFT 20
+#define PRINT_REGION_GRANULES (1 << (PRINT_REGION_SHIFT - 4))
+#define PRINT_STATES_PER_WORD (4 * sizeof(unsigned long))
+
+typedef struct PrintRegion {
+    uintptr_t base;
+    unsigned long states[PRINT_REGION_GRANULES / PRINT_STATES_PER_WORD];
+} PrintRegion;
+
+typedef struct PrintLabel {
+    SExp *pair;
+    int label;
+} PrintLabel;
+
+typedef struct Printer {
+    FILE *out;
+    // write strings and characters as their bare contents, as display does
+    int display;
+    // open-addressed, keyed by region base
+    PrintRegion **regions;
+    size_t region_capacity;
+    size_t region_count;
+    PrintRegion *last_region;
+    // open-addressed, keyed by pair; only shared pairs get a label
+    PrintLabel *labels;
+    size_t label_capacity;
+    size_t label_count;
+    int n_shared;
+    // last, so only the fields above need clearing
+    size_t length;
+    char buf[PRINT_BUFFER_SIZE];
+} Printer;
+
+void
+printer_flush (Printer *printer) {
+    fwrite(printer->buf, 1, printer->length, printer->out);
+    printer->length = 0;
+}
+
+void
+printer_write (Printer *printer, const char *chars, size_t length) {
+    if (printer->length + length > PRINT_BUFFER_SIZE) {
+        printer_flush(printer);
+        if (length > PRINT_BUFFER_SIZE) {
+            fwrite(chars, 1, length, printer->out);
+            return;
+        }
+    }
+    memcpy(printer->buf + printer->length, chars, length);
+    printer->length += length;
+}
+
+void
+printer_puts (Printer *printer, const char *chars) {
+    printer_write(printer, chars, strlen(chars));
+}
+
+void
+printer_putc (Printer *printer, char c) {
+    if (printer->length == PRINT_BUFFER_SIZE)
+        printer_flush(printer);
+    printer->buf[printer->length++] = c;
+}
+
+void
+printer_number (Printer *printer, long value) {
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : value;
+    do {
+        digits[--i] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+        digits[--i] = '-';
+    printer_write(printer, digits + i, sizeof(digits) - i);
+}
+
+// Strings are written so the reader gives back the same characters
+void
+printer_string (Printer *printer, String *string) {
+    char escape[8];
+    size_t i, start = 0;
+
+    printer_putc(printer, '"');
+    for (i = 0; i < string->length; i++) {
+        unsigned char c = string->chars[i];
+        if (c >= ' ' && c != '"' && c != '\\' && c != 127)
+            continue;
+        printer_write(printer, string->chars + start, i - start);
+        start = i + 1;
+        if (c == '"' || c == '\\') {
+            escape[0] = '\\'; escape[1] = c; escape[2] = '\0';
+        } else if (c == '\n') {
+            strcpy(escape, "\\n");
+        } else if (c == '\t') {
+            strcpy(escape, "\\t");
+        } else if (c == '\r') {
+            strcpy(escape, "\\r");
+        } else {
+            snprintf(escape, sizeof(escape), "\\x%x;", c);
+        }
+        printer_puts(printer, escape);
+    }
+    printer_write(printer, string->chars + start, i - start);
+    printer_putc(printer, '"');
+}
+
+size_t
+printer_region_slot (PrintRegion **regions, size_t capacity, uintptr_t base) {
+    size_t i = base * 0x9e3779b97f4a7c15UL >> 32 & (capacity - 1);
+    while (regions[i] != NULL && regions[i]->base != base)
+        i = (i + 1) & (capacity - 1);
+    return i;
+}
+
+// The region holding pair, or NULL if it has no marks and create is false
+PrintRegion *
+printer_region (Printer *printer, SExp *pair, int create) {
+    uintptr_t base = (uintptr_t)pair >> PRINT_REGION_SHIFT;
+    size_t i;
+
+    if (printer->last_region != NULL && printer->last_region->base == base)
+        return printer->last_region;
+    if (create && 2 * (printer->region_count + 1) > printer->region_capacity) {
+        size_t capacity = printer->region_capacity ? printer->region_capacity * 2 : 16;
+        PrintRegion **regions = calloc(capacity, sizeof(PrintRegion*));
+        for (i = 0; i < printer->region_capacity; i++) {
+            if (printer->regions[i] != NULL)
+                regions[printer_region_slot(regions, capacity, printer->regions[i]->base)] = printer->regions[i];
+        }
+        free(printer->regions);
+        printer->regions = regions;
+        printer->region_capacity = capacity;
+    }
+    if (printer->region_capacity == 0)
+        return NULL;
+    i = printer_region_slot(printer->regions, printer->region_capacity, base);
+    if (printer->regions[i] == NULL) {
+        if (!create)
+            return NULL;
+        printer->regions[i] = calloc(1, sizeof(PrintRegion));
+        printer->regions[i]->base = base;
+        printer->region_count++;
+    }
+    printer->last_region = printer->regions[i];
+    return printer->last_region;
+}
+
+PrintState
+printer_state (Printer *printer, SExp *pair) {
+    PrintRegion *region = printer_region(printer, pair, 0);
+    size_t granule = ((uintptr_t)pair >> 4) & (PRINT_REGION_GRANULES - 1);
+    if (region == NULL)
+        return PRINT_UNSEEN;
+    return region->states[granule / PRINT_STATES_PER_WORD] >> (granule % PRINT_STATES_PER_WORD * 2) & 3;
+}
+
+void
+printer_set_state (Printer *printer, SExp *pair, PrintState state) {
+    PrintRegion *region = printer_region(printer, pair, 1);
+    size_t granule = ((uintptr_t)pair >> 4) & (PRINT_REGION_GRANULES - 1);
+    unsigned long *word = &region->states[granule / PRINT_STATES_PER_WORD];
+    int shift = granule % PRINT_STATES_PER_WORD * 2;
+    *word = (*word & ~(3UL << shift)) | (unsigned long)state << shift;
+}
+
+size_t
+printer_label_slot (PrintLabel *labels, size_t capacity, SExp *pair) {
+    size_t i = ((uintptr_t)pair >> 4) * 0x9e3779b97f4a7c15UL >> 32 & (capacity - 1);
+    while (labels[i].pair != NULL && labels[i].pair != pair)
+        i = (i + 1) & (capacity - 1);
+    return i;
+}
+
+// Returns the label for pair, giving it the next one if it has none yet
+int
+printer_label_of (Printer *printer, SExp *pair) {
+    size_t i;
+    if (2 * (printer->label_count + 1) > printer->label_capacity) {
+        size_t capacity = printer->label_capacity ? printer->label_capacity * 2 : 16;
+        PrintLabel *labels = calloc(capacity, sizeof(PrintLabel));
+        for (i = 0; i < printer->label_capacity; i++) {
+            if (printer->labels[i].pair != NULL)
+                labels[printer_label_slot(labels, capacity, printer->labels[i].pair)] = printer->labels[i];
+        }
+        free(printer->labels);
+        printer->labels = labels;
+        printer->label_capacity = capacity;
+    }
+    i = printer_label_slot(printer->labels, printer->label_capacity, pair);
+    if (printer->labels[i].pair == NULL) {
+        printer->labels[i].pair = pair;
+        printer->labels[i].label = printer->label_count++;
+    }
+    return printer->labels[i].label;
+}
+
+void
+printer_scan (Printer *printer, SExp *exp) {
+    size_t depth = 0, capacity = 64;
+    SExp **stack = malloc(capacity * sizeof(SExp*));
+    PrintState state;
+
+    stack[depth++] = exp;
+    while (depth > 0) {
+        exp = stack[--depth];
+        // walk down the cdrs, leaving the cars for later
+        while (is_pair(exp)) {
+            state = printer_state(printer, exp);
+            if (state != PRINT_UNSEEN) {
+                if (state == PRINT_SEEN) {
+                    printer_set_state(printer, exp, PRINT_SHARED);
+                    printer->n_shared++;
+                }
+                break;
+            }
+            printer_set_state(printer, exp, PRINT_SEEN);
+            if (depth + 2 > capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(SExp*));
+            }
+            stack[depth++] = exp->pair->car;
+            exp = exp->pair->cdr;
+        }
+        if (is_compound_procedure(exp)) {
+            if (depth + 2 > capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(SExp*));
+            }
+            stack[depth++] = exp->closure->params;
+            stack[depth++] = exp->closure->body;
+        }
+    }
+    free(stack);
+}
+
+// Writes a label definition or reference for a shared pair. Returns whether
+// the pair still has to be written out.
+int
+printer_label (Printer *printer, SExp *pair) {
+    PrintState state;
+    if (printer->n_shared == 0)
+        return 1;
+    state = printer_state(printer, pair);
+    if (state == PRINT_SEEN)
+        return 1;
+    printer_putc(printer, '#');
+    printer_number(printer, printer_label_of(printer, pair));
+    if (state == PRINT_LABELED) {
+        printer_putc(printer, '#');
+        return 0;
+    }
+    printer_set_state(printer, pair, PRINT_LABELED);
+    printer_putc(printer, '=');
+    return 1;
+}
+
+// Whether a list can carry on through pair rather than switching to dotted
+// notation, which it has to for a pair with a label
+int
+is_unlabeled_pair (Printer *printer, SExp *pair) {
+    return is_pair(pair) && (printer->n_shared == 0 || printer_state(printer, pair) == PRINT_SEEN);
+}
+
+void
+printer_write_sexp (Printer *printer, SExp *exp) {
+    if (is_atom(exp)) {
+        Atom *a = exp->atom;
+        if (is_number(exp)) {
+            printer_number(printer, a->number_value);
+        } else if (is_boolean(exp)) {
+            printer_puts(printer, a->number_value ? "#t" : "#f");
+        } else if (is_character(exp) && printer->display) {
+            printer_putc(printer, a->character_value);
+        } else if (is_character(exp)) {
+            if (a->character_value == ' ') {
+                printer_puts(printer, "#\\space");
+            } else if (a->character_value == '\n') {
+                printer_puts(printer, "#\\newline");
+            } else {
+                printer_puts(printer, "#\\");
+                printer_putc(printer, a->character_value);
+            }
+        } else if (is_string(exp) && printer->display) {
+            printer_write(printer, a->string_value.chars, a->string_value.length);
+        } else if (is_string(exp)) {
+            printer_string(printer, &a->string_value);
+        } else if (is_symbol(exp)) {
+            printer_write(printer, a->string_value.chars, a->string_value.length);
+        } else {
+            printer_puts(printer, "ERR: Unable to print invalid sexp");
+        }
+    } else if (is_compound_procedure(exp)) {
+        printer_puts(printer, "(compound-procedure ");
+        printer_write_sexp(printer, exp->closure->params);
+        printer_putc(printer, ' ');
+        printer_write_sexp(printer, exp->closure->body);
+        printer_puts(printer, " '<procedure-env>)");
+    } else if (is_nil(exp)) {
+        printer_puts(printer, "()");
+    } else if (is_pair(exp)) {
+        if (!printer_label(printer, exp))
+            return;
+        printer_putc(printer, '(');
+        printer_write_sexp(printer, exp->pair->car);
+        exp = exp->pair->cdr;
+        while (is_unlabeled_pair(printer, exp)) {
+            printer_putc(printer, ' ');
+            printer_write_sexp(printer, exp->pair->car);
+            exp = exp->pair->cdr;
+        }
+        if (!is_nil(exp)) {
+            printer_puts(printer, " . ");
+            printer_write_sexp(printer, exp);
+        }
+        printer_putc(printer, ')');
+    } else if (is_primitive_procedure(exp)) {
+        printer_puts(printer, "#<primitive>");
+    } else if (is_compiled_procedure(exp)) {
+        printer_puts(printer, "#<compiled-procedure ");
+        printer_write_sexp(printer, exp->compiled->name);
+        printer_putc(printer, '>');
+    } else if (is_future(exp)) {
+        printer_puts(printer, "#<future>");
+    } else if (is_promise(exp)) {
+        printer_puts(printer, "#<promise>");
+    } else if (is_port(exp)) {
+        printer_puts(printer, exp->port->input ? "#<input-port>" : "#<output-port>");
+    } else if (is_eof_object(exp)) {
+        printer_puts(printer, "#<eof>");
+    } else if (is_error_object(exp)) {
+        printer_puts(printer, "#<error ");
+        printer_string(printer, &exp->error->message->atom->string_value);
+        printer_putc(printer, '>');
+    } else {
+        printer_puts(printer, "ERR: Unable to print invalid sexp");
+    }
+}
+
+void
+print_sexp (FILE *out, SExp *exp, int display) {
+    Printer *printer = malloc(sizeof(Printer));
+    size_t i;
+
+    memset(printer, 0, offsetof(Printer, length));
+    printer->length = 0;
+    printer->out = out;
+    printer->display = display;
+    if (is_pair(exp))
+        printer_scan(printer, exp);
+    printer_write_sexp(printer, exp);
+    printer_flush(printer);
+
+    for (i = 0; i < printer->region_capacity; i++)
+        free(printer->regions[i]);
+    free(printer->regions);
+    free(printer->labels);
+    free(printer);
+}
+
+void
+write_sexp (FILE *out, SExp *exp) {
+    print_sexp(out, exp, 0);
+}
+
+void
+print (SExp *exp) {
+    write_sexp(stdout, exp);
+}
+
+// PORTS
+
+SExp *
+new_port (Interp *interp, FILE *file, int input) {
+    SExp *ret = new_sexp(interp);
+    count_alloc(interp, &interp->memory_stats.ports, sizeof(Port));
+    ret->type = SEXP_TYPE_PORT;
+    ret->port = calloc(1, sizeof(Port));
+    ret->port->file = file;
+    ret->port->input = input;
+    ret->port->reader.in = file;
+    // typed input shouldn't wait for a whole block
+    ret->port->reader.by_line = input && isatty(fileno(file));
+    return ret;
+}
+
+// The open port argv[i], or the current input or output port when there's no
+// such argument
+Port *
+port_arg (Interp *interp, int argc, SExp **argv, int i, int input) {
+    SExp *port = i < argc ? argv[i] : input ? interp->root->stdin_port : interp->root->stdout_port;
+    if (!is_port(port) || port->port->input != input)
+        raise_error(interp, input ? "expected an input port" : "expected an output port", port);
+    if (port->port->file == NULL)
+        raise_error(interp, "port is closed", port);
+    return port->port;
+}
+
+// What to write to for the open output port argv[i], or the current output
+// port when there's no such argument
+FILE *
+output_file (Interp *interp, int argc, SExp **argv, int i) {
+    Port *port = port_arg(interp, argc, argv, i, 0);
+    return port->is_stdout ? stdout : port->file;
+}
+
+SExp *
+open_file_port (Interp *interp, SExp *filename, int input) {
+    FILE *file;
+    SExp *ret;
+    if (!is_string(filename))
+        return raise_error(interp, "expected a filename", filename);
+    file = fopen(filename->atom->string_value.chars, input ? "r" : "w");
+    if (file == NULL)
+        return raise_error(interp, "couldn't open file", filename);
+    ret = new_port(interp, file, input);
+    if (input) {
+        setvbuf(file, NULL, _IONBF, 0);
+    } else {
+        ret->port->buffer = malloc(PORT_BUFFER_SIZE);
+        if (ret->port->buffer == NULL) {
+            printf("ERR: out of memory\n");
+            exit(1);
+        }
+        setvbuf(file, ret->port->buffer, _IOFBF, PORT_BUFFER_SIZE);
+    }
+    return ret;
+}
+
+SExp *
+open_input_file_proc (Interp *interp, int argc, SExp **argv) {
+    return open_file_port(interp, argv[0], 1);
+}
+
+SExp *
+open_output_file_proc (Interp *interp, int argc, SExp **argv) {
+    return open_file_port(interp, argv[0], 0);
+}
+
+// Closing an already closed port does nothing. The standard streams are only
+// flushed, so the process can still use them.
+SExp *
+close_port_proc (Interp *interp, int argc, SExp **argv) {
+    Port *port;
+    if (!is_port(argv[0]))
+        return raise_error(interp, "close-port requires a port", argv[0]);
+    port = argv[0]->port;
+    if (port->file == NULL)
+        return &NIL;
+    if (port->is_stdout)
+        fflush(stdout);
+    else if (port->file == stdin || port->file == stdout || port->file == stderr)
+        fflush(port->file);
+    else
+        fclose(port->file);
+    port->file = NULL;
+    free(port->buffer);
+    port->buffer = NULL;
+    port->reader.in = NULL;
+    free(port->reader.buf);
+    port->reader.buf = NULL;
+    port->reader.pos = port->reader.len = 0;
+    return &NIL;
+}
+
+SExp *
+current_input_port_proc (Interp *interp, int argc, SExp **argv) {
+    return interp->root->stdin_port;
+}
+
+SExp *
+current_output_port_proc (Interp *interp, int argc, SExp **argv) {
+    return interp->root->stdout_port;
+}
+
+// (read [port]) parses the next datum with the port's reader standing in for
+// the interpreter's, interning its symbols like a program's
+SExp *
+read_proc (Interp *interp, int argc, SExp **argv) {
+    Port *port = port_arg(interp, argc, argv, 0, 1);
+    Reader *saved = interp->reader;
+    SExp *datum;
+    char *token;
+    int failed;
+
+    interp->reader = &port->reader;
+    consume_whitespace(interp);
+    token = next_token(interp);
+    if (token == NULL) {
+        interp->reader = saved;
+        return &EOF_OBJECT;
+    }
+    datum = new_sexp(interp);
+    failed = parser__parse_sexp(interp, token, strlen(token), datum);
+    interp->reader = saved;
+    if (failed)
+        return raise_error(interp, "read couldn't parse a datum", NULL);
+    return intern_symbols(interp, datum);
+}
+
+SExp *
+read_char_proc (Interp *interp, int argc, SExp **argv) {
+    Reader *reader = &port_arg(interp, argc, argv, 0, 1)->reader;
+    if (!reader_has_input(reader))
+        return &EOF_OBJECT;
+    return new_character(interp, reader->buf[reader->pos++]);
+}
+
+SExp *
+peek_char_proc (Interp *interp, int argc, SExp **argv) {
+    Reader *reader = &port_arg(interp, argc, argv, 0, 1)->reader;
+    if (!reader_has_input(reader))
+        return &EOF_OBJECT;
+    return new_character(interp, reader->buf[reader->pos]);
+}
+
+// (read-line [port]) is the next line without its newline, scanning the buffer
+// for the newline a block at a time
+SExp *
+read_line_proc (Interp *interp, int argc, SExp **argv) {
+    Reader *reader = &port_arg(interp, argc, argv, 0, 1)->reader;
+    const char *start, *end;
+    SExp *line;
+
+    if (!reader_has_input(reader))
+        return &EOF_OBJECT;
+    start = reader->buf + reader->pos;
+    end = scan_for(start, reader->buf + reader->len, SCAN_NEWLINE);
+    line = new_string(interp, start, end - start);
+    reader->pos = end - reader->buf;
+    // a line running past the buffer is appended to a block at a time
+    while (reader->pos == reader->len && fill_read_buffer(reader, 0)) {
+        start = reader->buf + reader->pos;
+        end = scan_for(start, reader->buf + reader->len, SCAN_NEWLINE);
+        string_append_chars(interp, &line->atom->string_value, start, end - start);
+        reader->pos = end - reader->buf;
+    }
+    if (reader->pos < reader->len)
+        reader->pos++;
+    return line;
+}
+
+SExp *
+write_proc (Interp *interp, int argc, SExp **argv) {
+    print_sexp(output_file(interp, argc, argv, 1), argv[0], 0);
+    return &NIL;
+}
+
+SExp *
+display_proc (Interp *interp, int argc, SExp **argv) {
+    print_sexp(output_file(interp, argc, argv, 1), argv[0], 1);
+    return &NIL;
+}
+
+SExp *
+newline_proc (Interp *interp, int argc, SExp **argv) {
+    putc('\n', output_file(interp, argc, argv, 0));
+    return &NIL;
+}
+
+SExp *
+eof_object_proc (Interp *interp, int argc, SExp **argv) {
+    return &EOF_OBJECT;
+}
+
+// HEAP SEGMENTS
+// A segment is written by copying the datum's cells into a buffer in the order
+// they're reached, with pointers held as offsets into the buffer and every
+// pointer word noted, and then adding the base to those words. The copy is
+// made twice: the first finds the symbols, whose cells the second lays out
+// together before anything else.
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+typedef struct SegmentWriter {
+    char *buf;
+    size_t length;
+    size_t capacity;
+    size_t *pointers;
+    size_t n_pointers;
+    size_t pointers_capacity;
+    // the symbols copied, in the order they were reached
+    SExp **symbols;
+    size_t n_symbols;
+    size_t symbols_capacity;
+    // open-addressed, keyed by SExp, so shared structure and cycles are copied
+    // once
+    SExp **copied;
+    size_t *copied_at;
+    size_t copied_capacity;
+    size_t copied_count;
+    // the first thing reached that can't go in a segment
+    SExp *unsavable;
+    // every empty list shares one cell
+    size_t nil;
+} SegmentWriter;
+
+// Grows an array so it has room for one more element
+void *
+segment_grow (void *array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? *capacity * 2 : 256;
+    return realloc(array, *capacity * size);
+}
+
+// Returns the offset of size zeroed bytes at the end of the segment
+size_t
+segment_alloc (SegmentWriter *writer, size_t size) {
+    size_t at = (writer->length + 7) & ~(size_t)7;
+    if (at + size > writer->capacity) {
+        writer->capacity = writer->capacity ? writer->capacity * 2 : 1 << 16;
+        if (writer->capacity < at + size)
+            writer->capacity = at + size;
+        writer->buf = realloc(writer->buf, writer->capacity);
+    }
+    memset(writer->buf + writer->length, 0, at + size - writer->length);
+    writer->length = at + size;
+    return at;
+}
+
+// Points the word at offset word to offset target
+void
+segment_point (SegmentWriter *writer, size_t word, size_t target) {
+    *(size_t *)(writer->buf + word) = target;
+    writer->pointers = segment_grow(writer->pointers, &writer->pointers_capacity, writer->n_pointers, sizeof(size_t));
+    writer->pointers[writer->n_pointers++] = word;
+}
+
+size_t
+segment_copied_slot (SExp **copied, size_t capacity, SExp *exp) {
+    size_t i = ((uintptr_t)exp >> 4) * 0x9e3779b97f4a7c15UL >> 32 & (capacity - 1);
+    while (copied[i] != NULL && copied[i] != exp)
+        i = (i + 1) & (capacity - 1);
+    return i;
+}
+
+// The slot exp's copy is or would be noted in, making room for it first
+size_t
+segment_copied_lookup (SegmentWriter *writer, SExp *exp) {
+    size_t i, j;
+    if (2 * (writer->copied_count + 1) > writer->copied_capacity) {
+        size_t capacity = writer->copied_capacity ? writer->copied_capacity * 2 : 1024;
+        SExp **copied = calloc(capacity, sizeof(SExp*));
+        size_t *copied_at = malloc(capacity * sizeof(size_t));
+        for (i = 0; i < writer->copied_capacity; i++) {
+            if (writer->copied[i] != NULL) {
+                j = segment_copied_slot(copied, capacity, writer->copied[i]);
+                copied[j] = writer->copied[i];
+                copied_at[j] = writer->copied_at[i];
+            }
+        }
+        free(writer->copied);
+        free(writer->copied_at);
+        writer->copied = copied;
+        writer->copied_at = copied_at;
+        writer->copied_capacity = capacity;
+    }
+    return segment_copied_slot(writer->copied, writer->copied_capacity, exp);
+}
+
+// Copies the atom of exp and points the SExp at offset cell to it
+void
+segment_copy_atom (SegmentWriter *writer, size_t cell, SExp *exp) {
+    size_t body = segment_alloc(writer, sizeof(Atom)), chars;
+    Atom *atom;
+
+    segment_point(writer, cell + offsetof(SExp, atom), body);
+    atom = (Atom *)(writer->buf + body);
+    atom->type = exp->atom->type;
+    if (is_string(exp) || is_symbol(exp)) {
+        chars = segment_alloc(writer, exp->atom->string_value.length + 1);
+        memcpy(writer->buf + chars, exp->atom->string_value.chars, exp->atom->string_value.length + 1);
+        atom = (Atom *)(writer->buf + body);
+        atom->string_value.length = exp->atom->string_value.length;
+        atom->string_value.capacity = exp->atom->string_value.length + 1;
+        segment_point(writer, body + offsetof(Atom, string_value.chars), chars);
+    } else {
+        atom->number_value = exp->atom->number_value;
+        atom->character_value = exp->atom->character_value;
+    }
+}
+
+// Copies exp's own cells, leaving a pair's car and cdr for the caller
+size_t
+segment_copy_cell (SegmentWriter *writer, SExp *exp) {
+    size_t cell;
+
+    if (is_nil(exp) && writer->nil != 0)
+        return writer->nil;
+    cell = segment_alloc(writer, sizeof(SExp));
+    if (is_nil(exp))
+        writer->nil = cell;
+    ((SExp *)(writer->buf + cell))->type = exp->type;
+    if (is_pair(exp)) {
+        segment_point(writer, cell + offsetof(SExp, pair), segment_alloc(writer, sizeof(Pair)));
+    } else if (is_atom(exp)) {
+        segment_copy_atom(writer, cell, exp);
+        if (is_symbol(exp)) {
+            writer->symbols = segment_grow(writer->symbols, &writer->symbols_capacity, writer->n_symbols, sizeof(SExp *));
+            writer->symbols[writer->n_symbols++] = exp;
+        }
+    } else if (!is_nil(exp) && writer->unsavable == NULL) {
+        writer->unsavable = exp;
+    }
+    return cell;
+}
+
+// Copies n symbols with their cells side by side, returning the offset of the
+// first
+size_t
+segment_copy_symbols (SegmentWriter *writer, SExp **symbols, size_t n) {
+    size_t first = segment_alloc(writer, n * sizeof(SExp)), cell, slot, i;
+
+    for (i = 0; i < n; i++) {
+        cell = first + i * sizeof(SExp);
+        slot = segment_copied_lookup(writer, symbols[i]);
+        writer->copied[slot] = symbols[i];
+        writer->copied_at[slot] = cell;
+        writer->copied_count++;
+        ((SExp *)(writer->buf + cell))->type = SEXP_TYPE_ATOM;
+        segment_copy_atom(writer, cell, symbols[i]);
+    }
+    return first;
+}
+
+// Returns the offset of exp's copy, copying it first if it hasn't been yet.
+// Lists are followed down their cdrs iteratively.
+size_t
+segment_copy (SegmentWriter *writer, SExp *exp) {
+    size_t first = 0, link = 0, cell, pair, slot;
+    int copied;
+
+    while (1) {
+        slot = segment_copied_lookup(writer, exp);
+        copied = writer->copied[slot] != NULL;
+        if (copied) {
+            cell = writer->copied_at[slot];
+        } else {
+            // noted before the car is copied, so cycles through it end here
+            writer->copied[slot] = exp;
+            writer->copied_count++;
+            cell = writer->copied_at[slot] = segment_copy_cell(writer, exp);
+        }
+        if (link != 0)
+            segment_point(writer, link, cell);
+        else
+            first = cell;
+        if (copied || !is_pair(exp))
+            return first;
+
+        pair = (size_t)((SExp *)(writer->buf + cell))->pair;
+        segment_point(writer, pair + offsetof(Pair, car), segment_copy(writer, car(exp)));
+        link = pair + offsetof(Pair, cdr);
+        exp = cdr(exp);
+    }
+}
+
+void
+free_segment_writer (SegmentWriter *writer) {
+    free(writer->buf);
+    free(writer->pointers);
+    free(writer->symbols);
+    free(writer->copied);
+    free(writer->copied_at);
+}
+
+void
+save_segment (Interp *interp, SExp *filename, SExp *datum) {
+    SegmentWriter writer = { 0 };
+    SegmentHeader *header;
+    SExp **symbols;
+    size_t i, n_symbols, at;
+    uint64_t hash = 14695981039346656037UL;
+    uintptr_t base;
+    FILE *out;
+    int written;
+
+    segment_alloc(&writer, sizeof(SegmentHeader));
+    segment_copy(&writer, datum);
+    if (writer.unsavable != NULL) {
+        datum = writer.unsavable;
+        free_segment_writer(&writer);
+        raise_error(interp, "can't save in a segment", datum);
+    }
+    symbols = writer.symbols;
+    n_symbols = writer.n_symbols;
+    writer.symbols = NULL;
+    free_segment_writer(&writer);
+
+    memset(&writer, 0, sizeof(writer));
+    segment_alloc(&writer, sizeof(SegmentHeader));
+    at = segment_copy_symbols(&writer, symbols, n_symbols);
+    free(symbols);
+    segment_point(&writer, offsetof(SegmentHeader, root), segment_copy(&writer, datum));
+    header = (SegmentHeader *)writer.buf;
+    header->symbols = at;
+    header->n_symbols = n_symbols;
+    at = segment_alloc(&writer, writer.n_pointers * sizeof(size_t));
+    memcpy(writer.buf + at, writer.pointers, writer.n_pointers * sizeof(size_t));
+    header = (SegmentHeader *)writer.buf;
+    header->pointers = at;
+    header->n_pointers = writer.n_pointers;
+
+    // FNV-1a picks the slot, so different segments are unlikely to want the
+    // same one
+    for (i = sizeof(SegmentHeader); i < writer.length; i++)
+        hash = (hash ^ (unsigned char)writer.buf[i]) * 1099511628211UL;
+    base = SEGMENT_BASE + hash % SEGMENT_SLOTS * SEGMENT_SLOT_SIZE;
+    for (i = 0; i < writer.n_pointers; i++)
+        *(uintptr_t *)(writer.buf + writer.pointers[i]) += base;
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->layout = SEGMENT_LAYOUT;
+    header->base = base;
+    header->size = writer.length;
+
+    out = fopen(filename->atom->string_value.chars, "w");
+    written = out != NULL && fwrite(writer.buf, 1, writer.length, out) == writer.length;
+    if (out != NULL && fclose(out) != 0)
+        written = 0;
+    free_segment_writer(&writer);
+    if (!written)
+        raise_error(interp, "couldn't write file", filename);
+}
+
+// Whether count entries of size bytes at offset at lie within the segment
+int
+segment_table_fits (SegmentHeader *header, size_t at, size_t count, size_t size) {
+    return at <= header->size && count <= (header->size - at) / size;
+}
+
+static MappedSegment *mapped_segments;
+
+// Whether cell lies in a loaded segment, and so mustn't be written
+int
+in_segment (const void *cell) {
+    MappedSegment *mapped;
+
+    for (mapped = __atomic_load_n(&mapped_segments, __ATOMIC_ACQUIRE); mapped != NULL; mapped = mapped->next) {
+        if ((const char *)cell >= mapped->start && (const char *)cell < mapped->start + mapped->size)
+            return 1;
+    }
+    return 0;
+}
+
+void
+add_mapped_segment (const char *start, size_t size) {
+    MappedSegment *mapped = malloc(sizeof(MappedSegment));
+
+    if (mapped == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    mapped->start = start;
+    mapped->size = size;
+    mapped->next = __atomic_load_n(&mapped_segments, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&mapped_segments, &mapped->next, mapped, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+SExp *
+load_segment (Interp *interp, SExp *filename) {
+    int fd = open(filename->atom->string_value.chars, O_RDONLY);
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    SegmentHeader header;
+    size_t *pointers;
+    char *segment, *first, *last;
+    SExp *symbol;
+    size_t i;
+    int relocated;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return raise_error(interp, "couldn't read file", filename);
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) != 0
+        || header.layout != SEGMENT_LAYOUT
+        || header.size != (size_t)st.st_size
+        || !segment_table_fits(&header, header.pointers, header.n_pointers, sizeof(size_t))
+        || !segment_table_fits(&header, header.symbols, header.n_symbols, sizeof(SExp))) {
+        close(fd);
+        return raise_error(interp, "not a heap segment", filename);
+    }
+
+    segment = mmap((void *)header.base, header.size, PROT_READ, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    relocated = segment == MAP_FAILED || segment != (char *)header.base;
+    if (relocated) {
+        if (segment != MAP_FAILED)
+            munmap(segment, header.size);
+        segment = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (segment == MAP_FAILED)
+        return raise_error(interp, "couldn't map segment", filename);
+
+    if (relocated) {
+        pointers = (size_t *)(segment + header.pointers);
+        for (i = 0; i < header.n_pointers; i++) {
+            if (pointers[i] > header.size - sizeof(uintptr_t)) {
+                munmap(segment, header.size);
+                return raise_error(interp, "not a heap segment", filename);
+            }
+            *(uintptr_t *)(segment + pointers[i]) += (uintptr_t)segment - header.base;
+        }
+    }
+
+    // only the pages of the symbol cells are made writable
+    first = segment + header.symbols;
+    last = first + header.n_symbols * sizeof(SExp);
+    first = (char *)((uintptr_t)first & ~(uintptr_t)(page - 1));
+    if (!relocated && header.n_symbols > 0 && mprotect(first, last - first, PROT_READ | PROT_WRITE) != 0) {
+        munmap(segment, header.size);
+        return raise_error(interp, "couldn't map segment", filename);
+    }
+    for (i = 0; i < header.n_symbols; i++) {
+        symbol = (SExp *)(segment + header.symbols) + i;
+        symbol->atom = lithp_symbol(interp, symbol->atom->string_value.chars)->atom;
+    }
+    if ((relocated || header.n_symbols > 0) && mprotect(segment, header.size, PROT_READ) != 0) {
+        munmap(segment, header.size);
+        return raise_error(interp, "couldn't map segment", filename);
+    }
+    add_mapped_segment(segment, header.size);
+    return ((SegmentHeader *)segment)->root;
+}
+
+// (save-segment filename datum) writes datum to a heap segment file
+SExp *
+save_segment_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0]))
+        return raise_error(interp, "save-segment requires a filename", argv[0]);
+    save_segment(interp, argv[0], argv[1]);
+    return &NIL;
+}
+
+// (load-segment filename) maps a heap segment and returns its datum
+SExp *
+load_segment_proc (Interp *interp, int argc, SExp **argv) {
+    if (!is_string(argv[0]))
+        return raise_error(interp, "load-segment requires a filename", argv[0]);
+    return load_segment(interp, argv[0]);
+}
+
+// SYMBOLS
+
+uint64_t
+hash_name (const String *name) {
+    uint64_t hash = 14695981039346656037UL;
+    size_t i;
+
+    for (i = 0; i < name->length; i++)
+        hash = (hash ^ (unsigned char)name->chars[i]) * 1099511628211UL;
+    return hash;
+}
+
+// The slot holding the symbol named name, or the empty one it would go in
+SExp **
+symbol_slot (SymbolSlots *slots, const String *name) {
+    size_t mask = slots->capacity - 1, i = hash_name(name) & mask;
+    SExp *entry;
+    String *other;
+
+    for (; (entry = __atomic_load_n(&slots->entries[i], __ATOMIC_ACQUIRE)) != NULL; i = (i + 1) & mask) {
+        other = &entry->atom->string_value;
+        if (other->length == name->length && memcmp(other->chars, name->chars, name->length) == 0)
+            break;
+    }
+    return &slots->entries[i];
+}
+
+SymbolSlots *
+new_symbol_slots (size_t capacity) {
+    SymbolSlots *slots = calloc(1, sizeof(SymbolSlots) + capacity * sizeof(SExp *));
+
+    if (slots == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    slots->capacity = capacity;
+    return slots;
+}
+
+// Called with the lock held
+void
+grow_symbol_table (SymbolTable *table) {
+    SymbolSlots *old = table->slots, *slots = new_symbol_slots(old->capacity * 2);
+    size_t i;
+
+    for (i = 0; i < old->capacity; i++) {
+        if (old->entries[i] != NULL)
+            *symbol_slot(slots, &old->entries[i]->atom->string_value) = old->entries[i];
+    }
+    __atomic_store_n(&table->slots, slots, __ATOMIC_RELEASE);
+}
+
+// A table holding the symbols bound in env's first frame
+SymbolTable *
+new_symbol_table (SExp *env) {
+    SymbolTable *table = calloc(1, sizeof(SymbolTable));
+    SExp *var;
+
+    if (table == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&table->lock, NULL);
+    table->slots = new_symbol_slots(1024);
+    for (var = caar(env); is_pair(var); var = cdr(var)) {
+        if ((table->count + 1) * 2 > table->slots->capacity)
+            grow_symbol_table(table);
+        *symbol_slot(table->slots, &car(var)->atom->string_value) = car(var);
+        table->count++;
+    }
+    return table;
+}
+
+// The symbol interned under symbol's name, which is symbol itself if it's the
+// first with that name
+SExp *
+intern_symbol (Interp *interp, SExp *symbol) {
+    SymbolTable *table = interp->root->symbols;
+    const String *name = &symbol->atom->string_value;
+    SExp **slot = symbol_slot(__atomic_load_n(&table->slots, __ATOMIC_ACQUIRE), name);
+    SExp *interned = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (interned != NULL)
+        return interned;
+    pthread_mutex_lock(&table->lock);
+    // another thread may have added it, or grown the table, since
+    slot = symbol_slot(table->slots, name);
+    interned = *slot;
+    if (interned == NULL) {
+        if ((table->count + 1) * 2 > table->slots->capacity) {
+            grow_symbol_table(table);
+            slot = symbol_slot(table->slots, name);
+        }
+        __atomic_store_n(slot, symbol, __ATOMIC_RELEASE);
+        table->count++;
+        interned = symbol;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return interned;
+}
+
+// Points every symbol in exp at the interned one of its name. exp is updated
+// in place and returned.
+SExp *
+intern_symbols (Interp *interp, SExp *exp) {
+    SExp *pair;
+
+    if (is_symbol(exp))
+        return intern_symbol(interp, exp);
+    for (pair = exp; is_pair(pair); pair = cdr(pair)) {
+        pair->pair->car = intern_symbols(interp, car(pair));
+        if (is_symbol(cdr(pair)))
+            pair->pair->cdr = intern_symbol(interp, cdr(pair));
+    }
+    return exp;
+}
+
+// MAIN
+
+SExp *
+new_env (Interp *interp) {
+    return extend_environment(interp, &NIL, &NIL, &NIL);
+}
+
+SExp *
+null_env_proc (Interp *interp, int argc, SExp **argv) {
+    __atomic_add_fetch(&interp->root->detached_environments, 1, __ATOMIC_RELAXED);
+    return new_env(interp);
+}
+
+Primitive *
+define_primitive (Interp *interp, SExp *env, const char *name, Proc proc, int min_args, int max_args) {
+    SExp *primitive = new_primitive_proc(interp, name, proc, min_args, max_args);
+    define_variable(interp, new_symbol(interp, name), primitive, env);
+    return primitive->primitive;
+}
+
+// A primitive without side effects whose result depends only on its arguments,
+// so the optimizer may call it ahead of time
+Primitive *
+define_pure_primitive (Interp *interp, SExp *env, const char *name, Proc proc, int min_args, int max_args) {
+    Primitive *primitive = define_primitive(interp, env, name, proc, min_args, max_args);
+    primitive->pure = 1;
+    return primitive;
+}
+
+SExp *
+init_scheme_env (Interp *interp) {
+    SExp *env = new_env(interp);
+    // so define_variable knows these are global bindings
+    interp->global_env = env;
+
+    // list functions
+    define_primitive(interp, env, "length", length_proc, 1, 1);
+    define_primitive(interp, env, "cons", cons_proc, 2, 2)->open_coded = OPEN_CODED_CONS;
+    define_primitive(interp, env, "car", car_proc, 1, 1)->open_coded = OPEN_CODED_CAR;
+    define_primitive(interp, env, "cdr", cdr_proc, 1, 1)->open_coded = OPEN_CODED_CDR;
+    define_primitive(interp, env, "set-car!", set_car_proc, 2, 2);
+    define_primitive(interp, env, "set-cdr!", set_cdr_proc, 2, 2);
+    define_primitive(interp, env, "list", list_proc, 0, VARIADIC);
+
+    // integer functions
+    define_pure_primitive(interp, env, "+", add_proc, 0, VARIADIC)->open_coded = OPEN_CODED_ADD;
+    define_pure_primitive(interp, env, "*", mult_proc, 0, VARIADIC);
+    define_pure_primitive(interp, env, "=", num_eq_proc, 2, VARIADIC)->open_coded = OPEN_CODED_NUM_EQ;
+    define_pure_primitive(interp, env, "<", lt_proc, 2, VARIADIC)->open_coded = OPEN_CODED_LT;
+    define_pure_primitive(interp, env, "<=", lte_proc, 2, VARIADIC);
+    define_pure_primitive(interp, env, ">", gt_proc, 2, VARIADIC);
+    define_pure_primitive(interp, env, ">=", gte_proc, 2, VARIADIC);
+    define_pure_primitive(interp, env, "remainder", remainder_proc, 2, 2);
+    define_pure_primitive(interp, env, "quotient", quotient_proc, 2, 2);
+
+    // type definition functions
+    define_pure_primitive(interp, env, "null?", nil_proc, 1, 1)->open_coded = OPEN_CODED_NULL;
+    define_pure_primitive(interp, env, "boolean?", boolean_proc, 1, 1);
+    define_pure_primitive(interp, env, "symbol?", symbol_proc, 1, 1);
+    define_pure_primitive(interp, env, "integer?", number_proc, 1, 1);
+    define_pure_primitive(interp, env, "character?", character_proc, 1, 1);
+    define_pure_primitive(interp, env, "pair?", pair_proc, 1, 1)->open_coded = OPEN_CODED_PAIR;
+    define_pure_primitive(interp, env, "string?", string_proc, 1, 1);
+    define_pure_primitive(interp, env, "procedure?", procedure_proc, 1, 1);
+    define_pure_primitive(interp, env, "eq?", eq_proc, 2, 2);
+    define_pure_primitive(interp, env, "eqv?", eq_proc, 2, 2);
+    define_primitive(interp, env, "equal?", equal_proc, 2, 2);
+    define_primitive(interp, env, "list?", is_list_proc, 1, 1);
+    define_pure_primitive(interp, env, "finite?", is_finite_proc, 1, 1);
+
+    // string functions
+    define_primitive(interp, env, "string->symbol", str_to_sym_proc, 1, 1);
+    define_primitive(interp, env, "symbol->string", sym_to_str_proc, 1, 1);
+    define_primitive(interp, env, "string-length", string_length_proc, 1, 1);
+    define_primitive(interp, env, "string-ref", string_ref_proc, 2, 2);
+    define_primitive(interp, env, "substring", substring_proc, 2, 3);
+    define_primitive(interp, env, "string-append", string_append_proc, 0, VARIADIC);
+    define_primitive(interp, env, "string-append!", string_append_bang_proc, 1, VARIADIC);
+    define_primitive(interp, env, "make-string", make_string_proc, 1, 2);
+    define_primitive(interp, env, "string=?", string_eq_proc, 1, VARIADIC);
+    define_primitive(interp, env, "number->string", num_to_str_proc, 1, 2);
+    define_primitive(interp, env, "string->number", str_to_num_proc, 1, 2);
+
+    // apply and eval are special, since we'll use tail call elimination to
+    // obviate the need for an actual procedure call
+    define_primitive(interp, env, "apply", NULL, 2, 2);
+    define_primitive(interp, env, "eval", NULL, 2, 2);
+
+    // environment functions
+    define_primitive(interp, env, "null-environment", null_env_proc, 0, 1);
+    // interaction-environment requires no proc, since it needs to steal the
+    // current env from eval
+    define_primitive(interp, env, "interaction-environment", NULL, 0, 0);
+
+    // I/O functions
+    define_primitive(interp, env, "load", load_proc, 1, 2);
+    define_primitive(interp, env, "read-all-parallel", read_all_parallel_proc, 1, 1);
+    define_primitive(interp, env, "save-segment", save_segment_proc, 2, 2);
+    define_primitive(interp, env, "load-segment", load_segment_proc, 1, 1);
+    define_primitive(interp, env, "print", print_proc, 1, 1);
+
+    // ports
+    interp->stdin_port = new_port(interp, stdin, 1);
+    interp->stdout_port = new_port(interp, stdout, 0);
+    interp->stdout_port->port->is_stdout = 1;
+    define_primitive(interp, env, "open-input-file", open_input_file_proc, 1, 1);
+    define_primitive(interp, env, "open-output-file", open_output_file_proc, 1, 1);
+    define_primitive(interp, env, "close-port", close_port_proc, 1, 1);
+    define_primitive(interp, env, "current-input-port", current_input_port_proc, 0, 0);
+    define_primitive(interp, env, "current-output-port", current_output_port_proc, 0, 0);
+    define_primitive(interp, env, "read", read_proc, 0, 1);
+    define_primitive(interp, env, "read-char", read_char_proc, 0, 1);
+    define_primitive(interp, env, "peek-char", peek_char_proc, 0, 1);
+    define_primitive(interp, env, "read-line", read_line_proc, 0, 1);
+    define_primitive(interp, env, "write", write_proc, 1, 2);
+    define_primitive(interp, env, "display", display_proc, 1, 2);
+    define_primitive(interp, env, "newline", newline_proc, 0, 1);
+    define_primitive(interp, env, "eof-object", eof_object_proc, 0, 0);
+    define_primitive(interp, env, "eof-object?", eof_object_pred_proc, 1, 1);
+
+    define_primitive(interp, env, "with-profiling", with_profiling_proc, 1, 1);
+    define_primitive(interp, env, "memory-stats", memory_stats_proc, 0, 0);
+
+    // futures
+    define_primitive(interp, env, "future", future_proc, 1, 1);
+    define_primitive(interp, env, "touch", touch_proc, 1, 1);
+    define_primitive(interp, env, "future?", future_pred_proc, 1, 1);
+    define_primitive(interp, env, "pmap", pmap_proc, 2, 2);
+
+    // promises and streams
+    define_primitive(interp, env, "force", force_proc, 1, 1);
+    define_primitive(interp, env, "make-promise", make_promise_proc, 1, 1);
+    define_primitive(interp, env, "promise?", promise_pred_proc, 1, 1);
+    define_pure_primitive(interp, env, "stream-null?", nil_proc, 1, 1);
+    define_primitive(interp, env, "stream-car", stream_car_proc, 1, 1);
+    define_primitive(interp, env, "stream-cdr", stream_cdr_proc, 1, 1);
+    define_primitive(interp, env, "stream-map", stream_map_proc, 2, 2);
+    define_primitive(interp, env, "stream-filter", stream_filter_proc, 2, 2);
+    define_primitive(interp, env, "stream-take", stream_take_proc, 2, 2);
+    define_primitive(interp, env, "stream->list", stream_to_list_proc, 1, 1);
+    define_variable(interp, new_symbol(interp, "the-empty-stream"), &NIL, env);
+
+    // errors
+    define_primitive(interp, env, "error", error_proc, 1, VARIADIC);
+    define_primitive(interp, env, "raise", raise_proc, 1, 1);
+    define_primitive(interp, env, "raise-continuable", raise_continuable_proc, 1, 1);
+    define_primitive(interp, env, "with-exception-handler", with_exception_handler_proc, 2, 2);
+    define_primitive(interp, env, "error-object?", error_object_proc, 1, 1);
+    define_primitive(interp, env, "error-object-message", error_object_message_proc, 1, 1);
+    define_primitive(interp, env, "error-object-irritants", error_object_irritants_proc, 1, 1);
+    define_primitive(interp, env, "call-with-limits", call_with_limits_proc, 3, 4);
+
+    return env;
+}
+
+void
+run_repl (Interp *interp) {
+    SExp *program, *result;
+    ErrorHandler handler;
+
+    printf("Welcome to Lithp\n");
+    while (1) {
+        printf("> ");
+        push_error_handler(interp, &handler, NULL);
+        if (setjmp(handler.jmp) != 0) {
+            // keep everything loaded so far and read the next expression
+            print_error(stdout, handler.raised);
+            continue;
+        }
+        program = parser__parse_program(interp, stdin, 1);
+        if (program == NULL) {
+            pop_error_handler(interp, &handler);
+            continue;
+        }
+        program = optimize(interp, intern_symbols(interp, program));
+
+        result = eval(interp, program, interp->global_env);
+        pop_error_handler(interp, &handler);
+
+        print(result); printf("\n");
+    }
+}
+
+// Parses all of in and closes it, even if the reader raises an error
+SExp *
+parse_and_close (Interp *interp, FILE *in) {
+    ErrorHandler handler;
+    SExp *program;
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        fclose(in);
+        return raise_object(interp, handler.raised, 0);
+    }
+    program = parser__parse_program(interp, in, 0);
+    pop_error_handler(interp, &handler);
+    fclose(in);
+    return program;
+}
+
+// Parses everything in `in`, closes it and evaluates it in env, returning the
+// value of the last expression, or NULL on a parse error
+SExp *
+run_program (Interp *interp, FILE *in, SExp *env) {
+    SExp *program = parse_and_close(interp, in);
+
+    if (program == NULL)
+        return NULL;
+    program = optimize(interp, intern_symbols(interp, program));
+    return eval(interp, program, env);
+}
+
+// run_program on a string rather than a file
+SExp *
+eval_string (Interp *interp, const char *source, SExp *env) {
+    size_t length = strlen(source);
+    FILE *in;
+
+    // fmemopen won't open an empty buffer
+    if (length == 0)
+        return &NIL;
+    in = fmemopen((void *)source, length, "r");
+    if (in == NULL)
+        return raise_error(interp, "couldn't read source string", NULL);
+    return run_program(interp, in, env);
+}
+
+// Runs a file at the top level, reporting rather than raising any error.
+// Returns nonzero if the file couldn't be read or parsed or raised an error.
+int
+load_and_run (Interp *interp, const char *filename) {
+    ErrorHandler handler;
+    FILE *in;
+
+    in = fopen(filename, "r");
+
+    if (in == NULL) {
+        printf("ERR: Couldn't read file %s\n", filename);
+        return 1;
+    }
+
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        print_error(stdout, handler.raised);
+        return 1;
+    }
+    if (run_program(interp, in, interp->global_env) == NULL) {
+        pop_error_handler(interp, &handler);
+        printf("ERR: Parser error for %s\n", filename);
+        return 1;
+    }
+    pop_error_handler(interp, &handler);
+    return 0;
+}
+
+// Creates an interpreter with its own global environment and symbol table.
+// The prelude isn't loaded; callers decide what to run in it.
+Interp *
+new_interp () {
+    Interp *interp = calloc(1, sizeof(Interp));
+    if (interp == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    interp->root = interp;
+    interp->optimize = 1;
+    interp->jit_threshold = JIT_DEFAULT_THRESHOLD;
+    clear_limits(interp);
+    init_memory_stats(interp);
+    interp->global_env = init_scheme_env(interp);
+    interp->symbols = new_symbol_table(interp->global_env);
+    return interp;
+}
+
+// An interpreter that evaluates in root's environment but allocates and keeps
+// its statistics separately, for running root's code on another thread
+Interp *
+new_child_interp (Interp *root) {
+    Interp *interp = calloc(1, sizeof(Interp));
+    if (interp == NULL) {
+        printf("ERR: out of memory\n");
+        exit(1);
+    }
+    interp->root = root;
+    interp->optimize = root->optimize;
+    clear_limits(interp);
+    interp->global_env = root->global_env;
+    return interp;
+}
+
+// EMBEDDING
+// The lithp_ functions are the interface for hosts linking against liblithp
+
+Interp *
+lithp_new (const char *prelude_path) {
+    Interp *interp = new_interp();
+    if (prelude_path != NULL)
+        load_and_run(interp, prelude_path);
+    return interp;
+}
+
+SExp *
+lithp_eval_string (Interp *interp, const char *source) {
+    ErrorHandler handler;
+    SExp *ret;
+
+    interp->last_error = NULL;
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        interp->last_error = handler.raised;
+        return NULL;
+    }
+    ret = eval_string(interp, source, interp->global_env);
+    pop_error_handler(interp, &handler);
+    return ret;
+}
+
+SExp *
+lithp_eval_file (Interp *interp, const char *path) {
+    ErrorHandler handler;
+    FILE *in = fopen(path, "r");
+    SExp *ret;
+
+    if (in == NULL) {
+        printf("ERR: Couldn't read file %s\n", path);
+        return NULL;
+    }
+    interp->last_error = NULL;
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        interp->last_error = handler.raised;
+        return NULL;
+    }
+    ret = run_program(interp, in, interp->global_env);
+    pop_error_handler(interp, &handler);
+    return ret;
+}
+
+// Symbols made outside the reader have to be interned too, or programs would
+// refer to a different symbol of the same name
+SExp *
+lithp_symbol (Interp *interp, const char *name) {
+    return intern_symbol(interp, new_symbol(interp, name));
+}
+
+void
+lithp_define (Interp *interp, const char *name, SExp *value) {
+    define_variable(interp, lithp_symbol(interp, name), value, interp->global_env);
+}
+
+void
+lithp_define_primitive (Interp *interp, const char *name, Proc proc, int min_args, int max_args) {
+    lithp_define(interp, name, new_primitive_proc(interp, name, proc, min_args, max_args));
+}
+
+SExp *
+lithp_lookup (Interp *interp, const char *name) {
+    SExp *cell = lookup_global_cell(interp, lithp_symbol(interp, name));
+    return cell != NULL ? car(cell) : NULL;
+}
+
+SExp *
+lithp_apply (Interp *interp, SExp *procedure, int argc, SExp **argv) {
+    ErrorHandler handler;
+    SExp *ret;
+
+    interp->last_error = NULL;
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) != 0) {
+        interp->last_error = handler.raised;
+        return NULL;
+    }
+    ret = apply(interp, procedure, argc, argv);
+    pop_error_handler(interp, &handler);
+    return ret;
+}
+
+void
+lithp_set_limits (Interp *interp, long fuel, long bytes, long depth) {
+    pop_limits(interp, NULL);
+    interp->max_depth = LONG_MAX;
+    interp->limit_hit = NULL;
+    push_limits(interp, fuel, bytes, depth);
+}
+
+SExp *
+lithp_last_error (Interp *interp) {
+    return interp->last_error;
+}
+
+const char *
+lithp_error_message (SExp *error) {
+    if (!is_error_object(error))
+        return NULL;
+    return error->error->message->atom->string_value.chars;
+}
+
+SExp * lithp_nil () { return &NIL; }
+SExp * lithp_boolean (int value) { return value ? &TRUE : &FALSE; }
+SExp * lithp_number (Interp *interp, long value) { return new_number(interp, value); }
+SExp * lithp_string (Interp *interp, const char *chars) { return new_string(interp, chars, strlen(chars)); }
+SExp * lithp_cons (Interp *interp, SExp *car, SExp *cdr) { return cons(interp, car, cdr); }
+
+int
+lithp_get_number (SExp *exp, long *value) {
+    if (!is_number(exp))
+        return 0;
+    *value = exp->atom->number_value;
+    return 1;
+}
+
+const char *
+lithp_get_string (SExp *exp) {
+    if (!is_string(exp) && !is_symbol(exp))
+        return NULL;
+    return exp->atom->string_value.chars;
+}
+
+int lithp_is_true (SExp *exp) { return is_true(exp); }
+int lithp_is_nil (SExp *exp) { return is_nil(exp); }
+int lithp_is_pair (SExp *exp) { return is_pair(exp); }
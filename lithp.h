@@ -1,3 +1,11 @@
+#ifndef LITHP_H
+#define LITHP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
+
 #define MAX_STRING_SIZE 1024
 
 typedef enum {
@@ -6,14 +14,29 @@ typedef enum {
     ATOM_TYPE_CHARACTER,
     ATOM_TYPE_STRING,
     ATOM_TYPE_SYMBOL,
+    N_ATOM_TYPES,
 } AtomType;
 
+// Strings and symbol names are length-tracked, NUL-terminated heap buffers.
+// Strings are mutable and grow geometrically, so appending is amortized O(1).
+typedef struct String {
+    size_t length;
+    size_t capacity;
+    char *chars;
+} String;
+
 typedef struct Atom {
     AtomType type;
+    // symbols only: set once the name is bound in a non-global frame, after
+    // which call sites naming it can no longer assume it resolves globally
+    int bound_locally;
+    // symbols only: set once the optimizer sees a program bind or assign the
+    // name anywhere, after which calls naming it are never folded
+    int rebound;
     union {
         long int number_value;
         char character_value;
-        char string_value[MAX_STRING_SIZE];
+        String string_value;
     };
 } Atom;
 
@@ -22,6 +45,13 @@ typedef enum {
     SEXP_TYPE_PAIR,
     SEXP_TYPE_NIL,
     SEXP_TYPE_PRIMITIVE_PROC,
+    SEXP_TYPE_FUTURE,
+    SEXP_TYPE_ERROR,
+    SEXP_TYPE_COMPILED_PROC,
+    SEXP_TYPE_CLOSURE,
+    SEXP_TYPE_PROMISE,
+    SEXP_TYPE_PORT,
+    SEXP_TYPE_EOF,
 } SExpType;
 
 typedef struct SExp {
@@ -29,32 +59,568 @@ typedef struct SExp {
     union {
         struct Atom* atom;
         struct Pair* pair;
-        struct SExp* (*proc)(struct SExp *arguments);
+        struct Primitive* primitive;
+        struct Future* future;
+        struct ErrorObject* error;
+        struct CompiledProcedure* compiled;
+        struct Closure* closure;
+        struct Promise* promise;
+        struct Port* port;
     };
 } SExp;
 
-typedef SExp * (*Proc)(SExp *arguments);
+struct Interp;
+
+// Primitives receive their evaluated arguments as a vector. The caller checks
+// argc against the arity declared at registration before calling proc.
+typedef SExp * (*Proc)(struct Interp *interp, int argc, SExp **argv);
+
+#define VARIADIC -1
+
+// applications with at most this many arguments evaluate them into a buffer on
+// the C stack rather than the heap
+#define MAX_INLINE_ARGS 8
+
+// Core primitives that eval runs inline at a call site rather than through
+// apply, as long as the operator still evaluates to the primitive itself
+typedef enum {
+    OPEN_CODED_NONE,
+    OPEN_CODED_CAR,
+    OPEN_CODED_CDR,
+    OPEN_CODED_CONS,
+    OPEN_CODED_ADD,
+    OPEN_CODED_NUM_EQ,
+    OPEN_CODED_LT,
+    OPEN_CODED_NULL,
+    OPEN_CODED_PAIR,
+} OpenCoded;
+
+typedef struct Primitive {
+    Proc proc;
+    const char *name;
+    int min_args;
+    int max_args;
+    // no side effects and the result depends only on the arguments
+    int pure;
+    OpenCoded open_coded;
+} Primitive;
+
+// Procedures compiled to C by lithp --compile. self is the procedure being
+// called, whose free holds the values of the variables it closed over.
+typedef SExp * (*CompiledCode)(struct Interp *interp, SExp *self, int argc, SExp **argv);
+
+typedef struct CompiledProcedure {
+    CompiledCode code;
+    SExp *name;
+    int n_free;
+    SExp *free[];
+} CompiledProcedure;
+
+// Tail calls with more arguments than this are made as ordinary calls
+#define MAX_TAIL_CALL_ARGS 16
+
+// A compound procedure, made by evaluating a lambda expression. It's allocated
+// in one block with the SExp that points to it.
+typedef struct Closure {
+    // the lambda's parameters as written, and as the proper list of variables
+    // its frames bind when the last one is a rest parameter
+    SExp *params;
+    SExp *vars;
+    SExp *body;
+    SExp *env;
+    // the name it was first defined under, or () if anonymous
+    SExp *name;
+    // required arguments, and whether a rest parameter takes any more
+    int arity;
+    int rest;
+    // whether a frame the body is evaluated in can outlive the call
+    int escapes;
+    // shared by every closure made from the same lambda expression
+    struct JitState *jit;
+} Closure;
 
 typedef struct Pair {
     SExp *car;
     SExp *cdr;
+    // evaluator cache for this cons: an InlineCache when it is a call site in
+    // a program, the JitState of a lambda expression, the LetState of a let,
+    // or the FoldGuard of an expression the optimizer folded
+    void *cache;
 } Pair;
 
-SExp NIL = { SEXP_TYPE_NIL };
-Atom _true_atom = { ATOM_TYPE_BOOLEAN, { 1 } };
-SExp TRUE = { SEXP_TYPE_ATOM, { &_true_atom } };
-Atom _false_atom = { ATOM_TYPE_BOOLEAN, { 0 } };
-SExp FALSE = { SEXP_TYPE_ATOM, { &_false_atom } };
+// Environment frames that can't outlive the call making them are built from
+// cells on a per-interpreter stack, reserved on first use, and popped when the
+// call returns. Frames that don't fit go on the heap.
+#define FRAME_STACK_CELLS (1 << 18)
+
+typedef struct FrameCell {
+    SExp sexp;
+    Pair pair;
+} FrameCell;
+
+// Monomorphic inline cache for a call site whose operator is a global. cell is
+// the global binding (a pair whose car holds the value). Global bindings are
+// updated in place and never removed, so an entry never goes stale and can be
+// shared between threads once it has been published.
+typedef struct InlineCache {
+    SExp *cell;
+} InlineCache;
+
+// Expressions the optimizer folds are kept as (folded optimized original),
+// which evaluates optimized while each of the global cells still holds the
+// primitive it did when the fold was made, and original once any doesn't
+#define FOLD_MAX_CELLS 8
+
+typedef struct FoldGuard {
+    int n_cells;
+    SExp *symbols[FOLD_MAX_CELLS];
+    SExp *cells[FOLD_MAX_CELLS];
+    SExp *procedures[FOLD_MAX_CELLS];
+} FoldGuard;
+
+// Worked out once for a let expression: the variables it binds, and whether
+// the frame its body is evaluated in can outlive the let
+typedef struct LetState {
+    SExp *vars;
+    int escapes;
+} LetState;
+
+// JIT
+
+// Procedures are compiled after this many calls; 0 turns the JIT off
+#if defined(__x86_64__)
+#define JIT_DEFAULT_THRESHOLD 1000
+#else
+#define JIT_DEFAULT_THRESHOLD 0
+#endif
+
+typedef SExp *(*JitEntry)(struct Interp *interp, SExp **argv, SExp *env);
+
+typedef enum {
+    JIT_COUNTING,
+    JIT_COMPILING,
+    JIT_COMPILED,
+    JIT_FAILED,
+} JitStatus;
+
+// Shared by a lambda expression and every procedure made from it. vars, arity,
+// rest and escapes are worked out from it once, when it is first evaluated. entry, needs_env and n_args are set before status becomes
+// JIT_COMPILED.
+typedef struct JitState {
+    SExp *vars;
+    int arity;
+    int rest;
+    int escapes;
+    unsigned long calls;
+    int status;
+    JitEntry entry;
+    // whether entry needs the arguments bound in an environment frame, rather
+    // than just the procedure's own environment
+    int needs_env;
+    int n_args;
+} JitState;
 
-SExp * new_sexp ();
-Pair * new_pair ();
-Atom * new_atom ();
-SExp * new_symbol (const char* symbol_string);
+// PROFILER
+
+typedef struct ProfileEntry {
+    const void *key;
+    const char *name;
+    unsigned long calls;
+    unsigned long long inclusive_ns;
+    unsigned long long exclusive_ns;
+    unsigned long cells;
+    unsigned long bytes;
+    // number of activations currently on the stack, so recursive calls only
+    // count towards inclusive time once
+    int active;
+} ProfileEntry;
+
+// One per profiled call in progress, linked through the C stack
+typedef struct ProfileFrame {
+    struct ProfileFrame *parent;
+    ProfileEntry *entry;
+    unsigned long long child_ns;
+    unsigned long child_cells;
+    unsigned long child_bytes;
+} ProfileFrame;
+
+// MEMORY STATS
+
+typedef struct AllocCounter {
+    unsigned long total;
+    unsigned long live;
+    unsigned long bytes;
+} AllocCounter;
+
+// Per-kind allocation counters. Procedures and frames are built out of pairs,
+// so their bytes are also included in the sexp and pair counters.
+typedef struct MemoryStats {
+    AllocCounter sexps;
+    AllocCounter pairs;
+    AllocCounter atoms[N_ATOM_TYPES];
+    AllocCounter string_buffers;
+    AllocCounter primitives;
+    AllocCounter inline_caches;
+    AllocCounter fold_guards;
+    AllocCounter procedures;
+    AllocCounter frames;
+    AllocCounter futures;
+    AllocCounter promises;
+    AllocCounter ports;
+    AllocCounter errors;
+    AllocCounter jit_code;
+} MemoryStats;
+
+// With LITHP_MEMSTATS_INTERVAL set (in seconds), the clock is checked every
+// MEMORY_STATS_CHECK_MASK + 1 cells and the stats dumped to stderr when due
+#define MEMORY_STATS_CHECK_MASK 0xffff
+
+// FUTURES
+
+typedef enum {
+    FUTURE_PENDING,
+    FUTURE_RUNNING,
+    FUTURE_DONE,
+} FutureState;
+
+// A unit of work for the worker pool. It applies procedure to each of count
+// args, storing the results, or calls it with no arguments when args is NULL.
+// Whichever thread first claims a pending future runs it.
+typedef struct Future {
+    SExp *procedure;
+    SExp **args;
+    SExp **results;
+    int count;
+    // the result of a (future thunk)
+    SExp *value;
+    // the submitter's budget, which the future's calls and allocations are
+    // charged to, and how much deeper than where it was made it may nest calls,
+    // or -1 for no limit
+    struct Budget *budget;
+    long depth;
+    // what was raised if running it failed, re-raised when it is touched
+    SExp *error;
+    int state;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} Future;
+
+// A worker's deque: the owner pushes and pops at the tail, and thieves take
+// from the head, so stolen work is the oldest and usually the largest.
+// Indices only grow; slots are taken modulo capacity.
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    Future **futures;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} WorkQueue;
+
+typedef struct Worker {
+    pthread_t thread;
+    struct WorkerPool *pool;
+    struct Interp *interp;
+    WorkQueue queue;
+} Worker;
+
+// A fixed-size pool, one worker per core unless LITHP_WORKERS says otherwise
+typedef struct WorkerPool {
+    int n_workers;
+    Worker *workers;
+    // futures submitted by threads that aren't pool workers
+    WorkQueue injected;
+    // futures sitting in any queue; idle workers sleep while it's zero
+    long queued;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+} WorkerPool;
+
+// worker threads recurse on the C stack just like the main thread
+#define WORKER_STACK_SIZE (8 * 1024 * 1024)
+
+// pmap splits its list into this many chunks per worker, so stragglers can
+// be stolen without paying the scheduling cost for every element
+#define PMAP_CHUNKS_PER_WORKER 4
+
+// read-all-parallel doesn't split files into chunks smaller than this
+#define PARALLEL_READ_MIN_CHUNK (1 << 16)
+
+// PROMISES
+
+// What (delay exp) makes: exp is evaluated in env, or thunk called when exp is
+// NULL, the first time the promise is forced. value stays NULL until then, and
+// once set is never changed, so threads racing to force it all get the value
+// that was stored first. A chained promise, from delay-force, evaluates to
+// another promise whose value becomes its own.
+typedef struct Promise {
+    SExp *value;
+    SExp *exp;
+    SExp *env;
+    SExp *thunk;
+    int chained;
+} Promise;
+
+// ERRORS
+
+// What (error message irritant ...) raises
+typedef struct ErrorObject {
+    SExp *message;
+    SExp *irritants;
+} ErrorObject;
+
+// An entry in an interpreter's chain of error handlers, which lives in the C
+// stack frame of whatever installed it. Raising to an escape handler (one with
+// no procedure) longjmps back to its setjmp with raised set; a handler
+// procedure from with-exception-handler is called where the raise happened.
+// Installing a handler is the only cost when nothing is raised.
+typedef struct ErrorHandler {
+    jmp_buf jmp;
+    SExp *procedure;
+    SExp *raised;
+    struct ErrorHandler *parent;
+    // restored when unwinding to this handler
+    struct Interp *saved_current;
+    ProfileFrame *profile_stack;
+    int profiling;
+    size_t frame_top;
+    long depth;
+} ErrorHandler;
+
+// LIMITS
+// An interpreter can be held to a budget of calls (fuel), a ceiling on the
+// bytes it has allocated and a maximum depth of nested calls. Every apply
+// spends one unit of fuel and every new cell checks the byte ceiling, so a
+// check is a decrement or a compare and a branch. Going over raises one of the
+// interpreter's limit errors, which are made before any limit is set so that
+// raising them allocates nothing. A limit that has run out stays run out, so
+// code that catches the error can't carry on calling or allocating; the limits
+// only lift when the call-with-limits or host that set them is done.
+
+typedef enum {
+    LIMIT_FUEL,
+    LIMIT_MEMORY,
+    LIMIT_DEPTH,
+    N_LIMITS,
+} LimitKind;
+
+// The fuel and bytes a call-with-limits or host allows, shared by the threads
+// running futures made under it. An interpreter takes a slice at a time out of
+// its budget and every budget that one is nested in, and only touches them
+// again once it has spent the slice, so a limit is still just a decrement in
+// the common case. left is indexed by LIMIT_FUEL and LIMIT_MEMORY, and has
+// LONG_MAX for no limit; dry says which ones something has asked more of than
+// was left. Budgets are freed when the last interpreter, future or nested
+// budget holding them lets go.
+typedef struct Budget {
+    long left[LIMIT_DEPTH];
+    int dry;
+    long refs;
+    struct Budget *outer;
+} Budget;
+
+#define FUEL_SLICE 4096
+#define BYTES_SLICE (64 * 1024)
+
+// READER
+
+// Input is read a block at a time into buf, which the tokenizer scans in place
+#define READ_BUFFER_SIZE (1 << 16)
+
+typedef struct Reader {
+    FILE *in;
+    // read a line at a time instead, so interactive input isn't waited on
+    int by_line;
+    // READ_BUFFER_SIZE plus room for a token carried over from the last block
+    char *buf;
+    size_t pos;
+    size_t len;
+} Reader;
+
+// PORTS
+// An input port reads through a Reader of its own, which the datum reader,
+// read-char and read-line all scan in place; its FILE is unbuffered, since
+// the Reader already reads a block at a time. An output port's FILE gets a
+// PORT_BUFFER_SIZE buffer, which write and display fill in bulk. A port must
+// only be used by one thread at a time.
+
+#define PORT_BUFFER_SIZE (1 << 20)
+
+typedef struct Port {
+    // NULL once the port is closed
+    FILE *file;
+    int input;
+    // the standard output port writes to whatever stdout is when it's used,
+    // since a host may point stdout elsewhere for a while
+    int is_stdout;
+    // an output file's buffer, freed when it's closed
+    char *buffer;
+    Reader reader;
+} Port;
+
+// SYMBOLS
+// Every symbol a program reads is replaced by the one interned under its name,
+// so symbols can be compared by pointer. The table belongs to the root
+// interpreter and is shared by all of its children, so the same name read on
+// any thread is the same symbol. It is an open-addressed hash table that only
+// grows. Lookups don't lock: entries are published with a release store, and
+// a grown table replaces the old slots whole, which are never freed since a
+// reader may still be probing them. Inserts and growth take the lock.
+
+typedef struct SymbolSlots {
+    size_t capacity;
+    SExp *entries[];
+} SymbolSlots;
+
+typedef struct SymbolTable {
+    pthread_mutex_t lock;
+    size_t count;
+    SymbolSlots *slots;
+} SymbolTable;
+
+// INTERPRETER
+
+// All mutable interpreter state lives in an Interp, so independent
+// interpreters can run concurrently on separate threads. The only objects they
+// share are NIL, TRUE and FALSE, which are never written.
+//
+// Pool workers each get an Interp of their own that evaluates in the root
+// interpreter's environment; frames and inline caches are published with
+// atomic stores so they can be read while another thread defines into them.
+typedef struct Interp {
+    // the interpreter owning the environment; itself unless a pool worker
+    struct Interp *root;
+    // created on first use, and only on the root
+    WorkerPool *pool;
+    // the worker this interpreter belongs to, if any
+    Worker *worker;
+
+    // innermost error handler, or NULL if an error should end the process
+    ErrorHandler *handler;
+    // what the last failed lithp_ call raised
+    SExp *last_error;
+
+    // reader state; the REPL keeps its own reader, since its unread input
+    // has to outlive the files loaded by the expressions it reads
+    Reader *reader;
+    Reader file_reader;
+    Reader repl_reader;
+    char token_buf[MAX_STRING_SIZE];
+    char peek_buf[MAX_STRING_SIZE];
+
+    SExp *global_env;
+    // only the root's is used
+    SymbolTable *symbols;
+    // what current-input-port and current-output-port return; only the root's
+    // are used
+    SExp *stdin_port;
+    SExp *stdout_port;
+    // number of environments created with null-environment, which aren't
+    // rooted at global_env and so can't use the global inline caches; only
+    // the root's count is used
+    int detached_environments;
+
+    // allocation totals since the interpreter was created
+    unsigned long cells_allocated;
+    unsigned long bytes_allocated;
+    MemoryStats memory_stats;
+    unsigned long long memory_stats_interval_ns;
+    unsigned long long memory_stats_last_dump_ns;
+
+    // run each program through the optimizer before evaluating it, and dump
+    // the optimized program to stderr
+    int optimize;
+    int dump_optimized;
+    // calls before a compound procedure is compiled, or 0 for no JIT; only
+    // the root's is used
+    unsigned long jit_threshold;
+
+    // calls left, the ceiling on bytes_allocated, and how deeply calls are
+    // nested against the most they may be; all unlimited unless set. The fuel
+    // and bytes are what's left of a slice taken from budget.
+    Budget *budget;
+    long fuel;
+    unsigned long bytes_limit;
+    long depth;
+    long max_depth;
+    // what going over each limit raises, made on first use, and the one
+    // raised since the innermost limits were set, if any
+    SExp *limit_errors[N_LIMITS];
+    SExp *limit_hit;
+
+    // the call a compiled procedure made in tail position, for apply_compiled
+    SExp *tail_procedure;
+    int tail_argc;
+    SExp *tail_argv[MAX_TAIL_CALL_ARGS];
+
+    FrameCell *frame_stack;
+    size_t frame_top;
+
+    int profiling;
+    ProfileFrame *profile_stack;
+    // open-addressed table of entries; entries themselves never move, so a
+    // call in progress can hold on to its entry while the table grows
+    ProfileEntry **profile_entries;
+    size_t profile_capacity;
+    size_t profile_count;
+} Interp;
+
+Interp * new_interp ();
+Interp * new_child_interp (Interp *root);
+
+// Escape handlers are installed with
+//     push_error_handler(interp, &handler, NULL);
+//     if (setjmp(handler.jmp) == 0) {
+//         ... code that may raise ...
+//         pop_error_handler(interp, &handler);
+//     } else {
+//         ... handler.raised was raised, and the handler is already popped ...
+//     }
+void push_error_handler (Interp *interp, ErrorHandler *handler, SExp *procedure);
+void pop_error_handler (Interp *interp, ErrorHandler *handler);
+// Neither returns unless a continuable raise is handled; raise_error only
+// returns an SExp so primitives can return its result
+SExp * raise_object (Interp *interp, SExp *obj, int continuable);
+SExp * raise_error (Interp *interp, const char *message, SExp *irritant);
+SExp * limit_exceeded (Interp *interp, LimitKind kind);
+// Takes need more of kind, and another slice, from the interpreter's budget
+// once it has spent its slice; returns whether it got need
+int refill_limit (Interp *interp, LimitKind kind, unsigned long need);
+void print_error (FILE *out, SExp *obj);
+
+unsigned long long monotonic_ns ();
+SExp * profile_apply (Interp *interp, SExp *proc, int argc, SExp **argv);
+void profile_report (Interp *interp, FILE *out);
+void print_memory_stats (Interp *interp, FILE *out);
+void maybe_dump_memory_stats (Interp *interp);
+
+extern SExp NIL;
+extern SExp TRUE;
+extern SExp FALSE;
+// what reading past the end of a port returns
+extern SExp EOF_OBJECT;
+// the head of a folded expression, which no program can name
+extern SExp FOLDED;
+
+SExp * new_sexp (Interp *interp);
+Pair * new_pair (Interp *interp);
+void discard_pair (Interp *interp, Pair *pair);
+Atom * new_atom (Interp *interp, AtomType type);
+SExp * new_symbol (Interp *interp, const char* symbol_string);
+SExp * new_string (Interp *interp, const char *chars, size_t length);
+SExp * new_character (Interp *interp, char value);
 SExp * car (SExp *exp);
 SExp * cdr (SExp *exp);
-SExp * cons (SExp *car, SExp *cdr);
+SExp * cons (Interp *interp, SExp *car, SExp *cdr);
+
+void string_init (Interp *interp, String *string, const char *chars, size_t length);
+void string_reserve (Interp *interp, String *string, size_t capacity);
+void string_append_chars (Interp *interp, String *string, const char *chars, size_t length);
+
+int string_equal (String *a, String *b);
 
 int is_eq (SExp *a, SExp *b);
+int is_eqv (SExp *a, SExp *b);
+int is_equal (SExp *a, SExp *b);
 int is_nil (SExp *exp);
 
 #define caar(obj)   car(car(obj))
@@ -88,31 +654,215 @@ int is_nil (SExp *exp);
 
 // PARSE
 
+// Classes of bytes the reader scans for
+typedef enum {
+    // ends a token: space, parentheses, newline, double quote, backslash, NUL
+    SCAN_DELIM = 1,
+    // space or newline
+    SCAN_SPACE = 2,
+    SCAN_NEWLINE = 4,
+    // ends a run of string characters: double quote or backslash
+    SCAN_STRING = 8,
+    // can change the nesting of forms: newline, parentheses, double quote,
+    // backslash, semicolon
+    SCAN_STRUCTURE = 16
+} ScanClass;
+
+// The first byte in [p, end) that is (scan_for) or isn't (scan_past) in the
+// class, or end. These use SSE2 or AVX2 where the CPU has them.
+const char * scan_for (const char *p, const char *end, ScanClass class);
+const char * scan_past (const char *p, const char *end, ScanClass class);
+
 int is_delim (char c);
-SExp * parser__parse_program (FILE *in, int is_repl);
+// Parses the top-level forms of a file on the worker pool
+SExp * read_all_parallel (Interp *interp, SExp *filename);
+SExp * parser__parse_program (Interp *interp, FILE *in, int is_repl);
 
 int parser__is_symbol_token (char *token, size_t token_size);
 int parser__is_number_token (char *token);
 char parser__token_to_character (char *token, size_t token_size);
 int parser__is_nil_token (char *token, size_t token_size);
 
-int parser__parse_atom (char *token, size_t token_size, Atom *atom);
-int parser__parse_pair (char *token, size_t token_size, Pair *pair);
-int parser__parse_sexp (char *token, size_t token_size, SExp *exp);
+int parser__parse_atom (Interp *interp, char *token, size_t token_size, Atom *atom);
+int parser__parse_pair (Interp *interp, char *token, size_t token_size, Pair *pair);
+int parser__parse_sexp (Interp *interp, char *token, size_t token_size, SExp *exp);
 
 // EVAL
-SExp * eval (SExp *exp, SExp *env);
-SExp * apply (SExp *proc, SExp *args);
-SExp * null_env_proc (SExp *exp);
-SExp * init_scheme_env ();
-SExp * new_symbol_table ();
-SExp * build_symbol_table (SExp *exp, SExp *symbol_table);
-SExp * prune_symbols (SExp *exp, SExp *symbol_table);
+SExp * eval (Interp *interp, SExp *exp, SExp *env);
+SExp * apply (Interp *interp, SExp *proc, int argc, SExp **argv);
+SExp * apply_procedure (Interp *interp, SExp *proc, int argc, SExp **argv);
+JitState * jit_state (Interp *interp, SExp *exp);
+JitState * jit_tier_up (Interp *interp, Closure *closure);
+SExp * procedure_name (SExp *procedure);
+SExp * extend_environment (Interp *interp, SExp *vars, SExp *vals, SExp *base_env);
+SExp * null_env_proc (Interp *interp, int argc, SExp **argv);
+SExp * init_scheme_env (Interp *interp);
+SymbolTable * new_symbol_table (SExp *env);
+SExp * intern_symbol (Interp *interp, SExp *symbol);
+SExp * intern_symbols (Interp *interp, SExp *exp);
+SExp * optimize (Interp *interp, SExp *program);
 
-void run_repl ();
-void load_and_run (char *filename);
+// The kinds of expression eval and the compiler tell apart
+int is_symbol (SExp *exp);
+int is_string (SExp *exp);
+int is_boolean (SExp *exp);
+int is_character (SExp *exp);
+int is_self_evaluating (SExp *exp);
+int is_tagged_list (SExp *exp, const char *tag);
+int is_quoted (SExp *exp);
+int is_assignment (SExp *exp);
+int is_definition (SExp *exp);
+int is_if (SExp *exp);
+int is_lambda (SExp *exp);
+int is_begin (SExp *exp);
+int is_cond (SExp *exp);
+int is_let (SExp *exp);
+int is_and (SExp *exp);
+int is_or (SExp *exp);
+int is_guard (SExp *exp);
+int is_delay (SExp *exp);
+int is_delay_force (SExp *exp);
+int is_cons_stream (SExp *exp);
+int is_folded (SExp *exp);
+int folds_hold (SExp *exp);
+int is_primitive_procedure (SExp *exp);
+int is_assigned_in (SExp *exp, SExp *var);
+SExp * definition_variable (SExp *exp);
+SExp * definition_value (Interp *interp, SExp *exp);
+SExp * cond_to_if (Interp *interp, SExp *exp);
 
-SExp *global_env;
-SExp *global_symbol_table;
+void run_repl (Interp *interp);
+SExp * parse_and_close (Interp *interp, FILE *in);
+SExp * run_program (Interp *interp, FILE *in, SExp *env);
+SExp * eval_string (Interp *interp, const char *source, SExp *env);
+int load_and_run (Interp *interp, const char *filename);
 
 void print (SExp *exp);
+void write_sexp (FILE *out, SExp *exp);
+
+// HEAP SEGMENTS
+// A heap segment is a file holding a datum's cells exactly as they sit in
+// memory, so it can be mapped read-only and used in place: pages are only read
+// in as the datum is walked, and processes mapping the same file share them.
+// Pointers in the file are linked for the segment to be mapped at base. If
+// that range is taken, every pointer word is relocated, which makes the pages
+// private. Segments are trusted like code, and only fit the build that wrote
+// them.
+//
+// The cells of the datum's distinct symbols come first, side by side. Loading
+// points each one's atom at the atom of the interned symbol of its name, so
+// only their pages are written; eq? and variable lookup treat symbols sharing
+// an atom as the same symbol. Nothing else in a segment is ever written:
+// set-car!, set-cdr! and string-append! refuse its cells, and the evaluator
+// doesn't cache anything in them.
+
+#define SEGMENT_MAGIC "LITHPSG2"
+// the sizes of the cells a segment holds, checked against the build loading it
+#define SEGMENT_LAYOUT (sizeof(SExp) | sizeof(Atom) << 8 | sizeof(Pair) << 16)
+// segments are linked at one of these many 4GB slots from SEGMENT_BASE, picked
+// by a hash of their contents
+#define SEGMENT_BASE 0x100000000000UL
+#define SEGMENT_SLOTS 1024
+#define SEGMENT_SLOT_SIZE (1UL << 32)
+
+typedef struct SegmentHeader {
+    char magic[8];
+    size_t layout;
+    uintptr_t base;
+    size_t size;
+    SExp *root;
+    // offset of the table of every word holding a pointer into the segment
+    size_t pointers;
+    size_t n_pointers;
+    // offset of the first symbol cell
+    size_t symbols;
+    size_t n_symbols;
+} SegmentHeader;
+
+// Where a segment is mapped; loaded segments are kept in a list that's only
+// ever pushed onto
+typedef struct MappedSegment {
+    const char *start;
+    size_t size;
+    struct MappedSegment *next;
+} MappedSegment;
+
+void save_segment (Interp *interp, SExp *filename, SExp *datum);
+SExp * load_segment (Interp *interp, SExp *filename);
+int in_segment (const void *cell);
+
+// COMPILED PROCEDURES
+// What code generated by lithp --compile calls into
+
+int is_true (SExp *exp);
+int is_false (SExp *exp);
+int is_number (SExp *exp);
+int is_pair (SExp *exp);
+int is_compiled_procedure (SExp *exp);
+SExp * new_number (Interp *interp, long int value);
+SExp * apply_list (Interp *interp, SExp *procedure, SExp *arguments);
+void set_variable (Interp *interp, SExp *var, SExp *val, SExp *env);
+SExp * raise_object (Interp *interp, SExp *obj, int continuable);
+
+SExp * new_compiled_procedure (Interp *interp, CompiledCode code, int n_free, SExp **free);
+SExp * apply_compiled (Interp *interp, SExp *procedure, int argc, SExp **argv);
+SExp * compiled_tail_call (Interp *interp, SExp *procedure, int argc, SExp **argv);
+SExp * compiled_arity_error (Interp *interp, SExp *procedure, int argc);
+SExp * compiled_global (Interp *interp, SExp **cell, SExp *symbol);
+SExp * compiled_name (SExp *value, SExp *symbol);
+SExp * compiled_define (Interp *interp, SExp *symbol, SExp *value);
+SExp * compiled_guard (Interp *interp, SExp *body, SExp *clauses);
+SExp * new_promise (Interp *interp, SExp *exp, SExp *env, SExp *thunk, int chained);
+int lithp_run_compiled (Interp *interp, SExp *(*toplevel)(Interp *interp));
+
+// Writes C for the programs in paths, in order, to out; returns nonzero if
+// one of them can't be compiled
+int compile_program (Interp *interp, FILE *out, char **paths, int n_paths);
+
+// EMBEDDING
+// Link against liblithp.a or liblithp.so. Values are never freed, and an
+// interpreter must only be used by one host thread at a time.
+
+// Creates an interpreter, loading the prelude from prelude_path unless NULL
+Interp * lithp_new (const char *prelude_path);
+// Evaluate every expression in source or the file at path, returning the value
+// of the last, or NULL if it couldn't be read or parsed or raised an error
+SExp * lithp_eval_string (Interp *interp, const char *source);
+SExp * lithp_eval_file (Interp *interp, const char *path);
+
+// Binds name in the global environment. proc is called with its evaluated
+// arguments once their count has been checked against min_args and max_args
+// (VARIADIC for no maximum).
+void lithp_define (Interp *interp, const char *name, SExp *value);
+void lithp_define_primitive (Interp *interp, const char *name, Proc proc, int min_args, int max_args);
+// The global value of name, or NULL if it's unbound
+SExp * lithp_lookup (Interp *interp, const char *name);
+SExp * lithp_apply (Interp *interp, SExp *procedure, int argc, SExp **argv);
+// Holds what's evaluated from now on to fuel more calls, bytes more bytes
+// allocated and calls nested depth deeper than now, replacing any limits set
+// before; a negative value means no limit. Going over raises an error, which
+// ends the evaluation.
+void lithp_set_limits (Interp *interp, long fuel, long bytes, long depth);
+// When an evaluation or lithp_apply returns NULL because something was raised,
+// the raised object; NULL after a parse error
+SExp * lithp_last_error (Interp *interp);
+// the message of an error object, or NULL for anything else
+const char * lithp_error_message (SExp *error);
+
+// From C values
+SExp * lithp_nil ();
+SExp * lithp_boolean (int value);
+SExp * lithp_number (Interp *interp, long value);
+SExp * lithp_string (Interp *interp, const char *chars);
+SExp * lithp_symbol (Interp *interp, const char *name);
+SExp * lithp_cons (Interp *interp, SExp *car, SExp *cdr);
+
+// To C values; lists are walked with car and cdr
+int lithp_get_number (SExp *exp, long *value);
+// the characters of a string or symbol, or NULL for anything else
+const char * lithp_get_string (SExp *exp);
+int lithp_is_true (SExp *exp);
+int lithp_is_nil (SExp *exp);
+int lithp_is_pair (SExp *exp);
+
+#endif
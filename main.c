@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lithp.h"
+
+// SERVER
+// --serve reads requests on stdin and --serve-socket PATH from each client of
+// a Unix socket in turn. A request is its length in bytes, a newline, then that
+// much Scheme source. The response is framed the same way and holds whatever
+// the request printed followed by its printed value.
+
+typedef struct ServeStats {
+    unsigned long requests;
+    unsigned long long start_ns;
+} ServeStats;
+
+static volatile sig_atomic_t stop_serving;
+
+// --fuel, --max-bytes and --max-depth, each -1 for no limit; a server applies
+// them to each request afresh
+static long fuel_limit = -1;
+static long bytes_limit = -1;
+static long depth_limit = -1;
+
+// --max-request, the largest request source accepted; a client sending a
+// longer one gets an error response and is disconnected
+static size_t max_request = 16 * 1024 * 1024;
+
+void
+handle_stop_signal (int signal) {
+    stop_serving = 1;
+}
+
+void
+write_response (FILE *out, const char *response, size_t length) {
+    fprintf(out, "%zu\n", length);
+    fwrite(response, 1, length, out);
+    fflush(out);
+}
+
+// Returns the source of the next request, or NULL at the end of the input or
+// on a malformed frame. A request too large to take is answered with an error
+// here, and NULL returned since the rest of the stream can't be trusted.
+char *
+read_request (FILE *in, FILE *out) {
+    const char *refusal;
+    size_t length;
+    char *source;
+
+    if (fscanf(in, "%zu", &length) != 1 || getc(in) != '\n')
+        return NULL;
+    source = length <= max_request ? malloc(length + 1) : NULL;
+    if (source == NULL) {
+        refusal = length <= max_request ? "ERR: out of memory\n" : "ERR: request too large\n";
+        write_response(out, refusal, strlen(refusal));
+        return NULL;
+    }
+    if (fread(source, 1, length, in) != length) {
+        free(source);
+        return NULL;
+    }
+    source[length] = '\0';
+    return source;
+}
+
+// Evaluates source in a fresh frame on top of the global environment, so its
+// definitions don't leak into later requests
+void
+serve_request (Interp *interp, const char *source, FILE *out) {
+    char *response;
+    size_t length;
+    FILE *capture = open_memstream(&response, &length);
+    FILE *real_stdout = stdout;
+    SExp *env = extend_environment(interp, &NIL, &NIL, interp->global_env);
+    ErrorHandler handler;
+    SExp *result;
+
+    // lithp prints everything to stdout, so point it at the response
+    fflush(stdout);
+    stdout = capture;
+    lithp_set_limits(interp, fuel_limit, bytes_limit, depth_limit);
+    push_error_handler(interp, &handler, NULL);
+    if (setjmp(handler.jmp) == 0) {
+        result = eval_string(interp, source, env);
+        pop_error_handler(interp, &handler);
+        if (result == NULL)
+            printf("ERR: Parser error\n");
+        else
+            print(result);
+    } else {
+        // the error goes back to the client and the server carries on
+        print_error(stdout, handler.raised);
+    }
+    stdout = real_stdout;
+    fclose(capture);
+
+    write_response(out, response, length);
+    free(response);
+}
+
+void
+serve_stream (Interp *interp, FILE *in, FILE *out, ServeStats *stats) {
+    char *source;
+    while (!stop_serving && (source = read_request(in, out)) != NULL) {
+        serve_request(interp, source, out);
+        free(source);
+        stats->requests++;
+    }
+}
+
+int
+serve_socket (Interp *interp, const char *path, ServeStats *stats) {
+    struct sockaddr_un addr;
+    int server, client;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("ERR: socket path too long: %s\n", path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+        perror("ERR: couldn't listen on socket");
+        return 1;
+    }
+    while (!stop_serving) {
+        client = accept(server, NULL, NULL);
+        if (client < 0)
+            continue;
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+        serve_stream(interp, in, out, stats);
+        fclose(in);
+        fclose(out);
+    }
+    close(server);
+    unlink(path);
+    return 0;
+}
+
+// Serves requests until the input ends or SIGINT/SIGTERM, then reports the
+// throughput to stderr
+int
+serve (Interp *interp, const char *socket_path) {
+    ServeStats stats = { 0, monotonic_ns() };
+    struct sigaction action;
+    int ret = 0;
+
+    // no SA_RESTART, so a signal interrupts a blocking read or accept
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // a client hanging up early shouldn't take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (socket_path == NULL)
+        serve_stream(interp, stdin, stdout, &stats);
+    else
+        ret = serve_socket(interp, socket_path, &stats);
+
+    double seconds = (monotonic_ns() - stats.start_ns) / 1e9;
+    fprintf(stderr, "serve: requests=%lu seconds=%.3f evals_per_sec=%.0f\n",
+            stats.requests, seconds, seconds > 0 ? stats.requests / seconds : 0);
+    return ret;
+}
+
+// MAIN
+
+// the interpreter run by main, for the atexit reports
+static Interp *main_interp;
+
+void
+print_profile_report () {
+    profile_report(main_interp, stderr);
+}
+
+// --stats prints a machine-readable summary of the run for the benchmarks
+void
+print_run_stats () {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fflush(stdout);
+    unsigned long cells = main_interp->cells_allocated;
+    unsigned long bytes = main_interp->bytes_allocated;
+    int i;
+    // include the pool workers' allocations; by now they're idle
+    if (main_interp->pool != NULL) {
+        for (i = 0; i < main_interp->pool->n_workers; i++) {
+            cells += main_interp->pool->workers[i].interp->cells_allocated;
+            bytes += main_interp->pool->workers[i].interp->bytes_allocated;
+        }
+    }
+    fprintf(stderr, "stats: cells=%lu bytes=%lu max_rss_kb=%ld\n", cells, bytes, usage.ru_maxrss);
+}
+
+int main (int n_args, char **argv) {
+    char *filename = NULL;
+    char *socket_path = NULL;
+    int profile = 0;
+    int serving = 0;
+    int optimize = 1;
+    int dump_optimized = 0;
+    char *compile_path = NULL;
+    long jit_threshold = -1;
+    int i;
+
+    for (i = 1; i < n_args; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            atexit(print_run_stats);
+        } else if (strcmp(argv[i], "--no-optimize") == 0) {
+            optimize = 0;
+        } else if (strcmp(argv[i], "--dump-optimized") == 0) {
+            dump_optimized = 1;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            jit_threshold = 0;
+        } else if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < n_args) {
+            jit_threshold = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < n_args) {
+            fuel_limit = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-bytes") == 0 && i + 1 < n_args) {
+            bytes_limit = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < n_args) {
+            depth_limit = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < n_args) {
+            compile_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-request") == 0 && i + 1 < n_args) {
+            max_request = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serving = 1;
+        } else if (strcmp(argv[i], "--serve-socket") == 0 && i + 1 < n_args) {
+            serving = 1;
+            socket_path = argv[++i];
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    Interp *interp = main_interp = new_interp();
+    interp->optimize = optimize;
+    if (jit_threshold >= 0)
+        interp->jit_threshold = jit_threshold;
+    if (profile) {
+        interp->profiling = 1;
+        atexit(print_profile_report);
+    }
+
+    // --compile FILE writes C for the prelude and FILE to stdout, to be built
+    // against liblithp into a standalone program
+    if (compile_path != NULL) {
+        char *paths[] = { "prelude.scm", compile_path };
+        return compile_program(interp, stdout, paths, 2);
+    }
+
+    // load the prelude for non-C standard procedures
+    load_and_run(interp, "prelude.scm");
+    // only dump the user's program, not the prelude
+    interp->dump_optimized = dump_optimized;
+
+    if (serving) {
+        return serve(interp, socket_path);
+    }
+    // the limits only hold the user's program, not the prelude
+    lithp_set_limits(interp, fuel_limit, bytes_limit, depth_limit);
+    if (filename == NULL) {
+        run_repl(interp);
+        return 0;
+    }
+    // a program that raised or didn't parse fails the run
+    return load_and_run(interp, filename) != 0;
+}